@@ -0,0 +1,447 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifndef _LANGUAGE_C
+#define _LANGUAGE_C
+#endif
+#include <PR/gbi.h>
+
+#include "gfx_pc.h"
+#include "gfx_capture.h"
+
+struct CaptureRegion {
+    uint64_t addr;
+    uint64_t size;
+};
+
+struct CaptureDedupEntry {
+    uint64_t addr;
+    uint64_t size; // 0 means empty slot
+    uint64_t hash;
+    uint64_t offset;
+};
+
+static struct {
+    FILE *file;
+    uint64_t file_pos;
+
+    uint64_t *frame_offsets;
+    uint32_t num_frames;
+    uint32_t frame_offsets_capacity;
+
+    struct CaptureRegion *regions;
+    size_t num_regions;
+    size_t regions_capacity;
+
+    uint64_t root_addr;
+
+    // Payloads already in the file, so that unchanged memory is stored only once
+    struct CaptureDedupEntry *dedup;
+    size_t dedup_capacity;
+    size_t dedup_count;
+} recorder;
+
+struct GfxCapture {
+    uint8_t *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+    const struct GfxCaptureFileHeader *header;
+    const uint64_t *frame_offsets;
+};
+
+static struct {
+    uint8_t *base;
+    const struct GfxCaptureRegion *regions;
+    uint32_t num_regions;
+} replay;
+
+bool gfx_capture_recording;
+bool gfx_capture_replaying;
+
+static uint32_t gfx_capture_gbi_config(void) {
+    uint32_t config = sizeof(void *);
+#ifdef F3DEX_GBI_2
+    config |= 1 << 8;
+#endif
+#ifdef F3DEX_GBI_2E
+    config |= 1 << 9;
+#endif
+#if defined(F3DEX_GBI) || defined(F3DLP_GBI)
+    config |= 1 << 10;
+#endif
+#ifdef GBI_FLOATS
+    config |= 1 << 11;
+#endif
+    return config;
+}
+
+static uint64_t gfx_capture_hash(const uint8_t *data, size_t size) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        h = (h ^ v) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    for (; i < size; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static bool gfx_capture_write(const void *data, size_t size) {
+    if (fwrite(data, 1, size, recorder.file) != size) {
+        return false;
+    }
+    recorder.file_pos += size;
+    return true;
+}
+
+static bool gfx_capture_align(uint32_t alignment) {
+    static const uint8_t zeros[GFX_CAPTURE_ALIGNMENT];
+    size_t padding = (alignment - recorder.file_pos % alignment) % alignment;
+    return gfx_capture_write(zeros, padding);
+}
+
+static void gfx_capture_abort(void) {
+    fprintf(stderr, "Display list capture: write failed, stopping capture\n");
+    fclose(recorder.file);
+    recorder.file = NULL;
+    gfx_capture_recording = false;
+}
+
+bool gfx_capture_start(const char *filename) {
+    if (recorder.file != NULL) {
+        gfx_capture_stop();
+    }
+    recorder.file = fopen(filename, "wb");
+    if (recorder.file == NULL) {
+        return false;
+    }
+    recorder.file_pos = 0;
+    recorder.num_frames = 0;
+    recorder.num_regions = 0;
+    recorder.dedup_count = 0;
+    if (recorder.dedup != NULL) {
+        memset(recorder.dedup, 0, recorder.dedup_capacity * sizeof(struct CaptureDedupEntry));
+    }
+
+    // Written again with the final frame count in gfx_capture_stop
+    struct GfxCaptureFileHeader header = {GFX_CAPTURE_MAGIC, GFX_CAPTURE_VERSION, gfx_capture_gbi_config(), 0, 0};
+    if (!gfx_capture_write(&header, sizeof(header))) {
+        gfx_capture_abort();
+        return false;
+    }
+    gfx_capture_recording = true;
+    return true;
+}
+
+void gfx_capture_stop(void) {
+    if (recorder.file == NULL) {
+        return;
+    }
+    gfx_capture_recording = false;
+
+    struct GfxCaptureFileHeader header = {GFX_CAPTURE_MAGIC, GFX_CAPTURE_VERSION, gfx_capture_gbi_config(), recorder.num_frames, 0};
+    if (!gfx_capture_align(8)) {
+        gfx_capture_abort();
+        return;
+    }
+    header.frame_index_offset = recorder.file_pos;
+    if (!gfx_capture_write(recorder.frame_offsets, recorder.num_frames * sizeof(uint64_t)) ||
+        fseek(recorder.file, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, recorder.file) != 1) {
+        gfx_capture_abort();
+        return;
+    }
+    fclose(recorder.file);
+    recorder.file = NULL;
+}
+
+void gfx_capture_record_frame_begin(const Gfx *commands) {
+    recorder.root_addr = (uintptr_t)commands;
+    recorder.num_regions = 0;
+}
+
+void gfx_capture_record_region(const void *addr, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    if (recorder.num_regions == recorder.regions_capacity) {
+        recorder.regions_capacity = recorder.regions_capacity == 0 ? 1024 : recorder.regions_capacity * 2;
+        recorder.regions = realloc(recorder.regions, recorder.regions_capacity * sizeof(struct CaptureRegion));
+    }
+    recorder.regions[recorder.num_regions].addr = (uintptr_t)addr;
+    recorder.regions[recorder.num_regions].size = size;
+    recorder.num_regions++;
+}
+
+static int gfx_capture_compare_regions(const void *a, const void *b) {
+    const struct CaptureRegion *ra = a, *rb = b;
+    if (ra->addr != rb->addr) {
+        return ra->addr < rb->addr ? -1 : 1;
+    }
+    return ra->size < rb->size ? -1 : ra->size > rb->size;
+}
+
+static struct CaptureDedupEntry *gfx_capture_dedup_slot(uint64_t addr, uint64_t size, uint64_t hash) {
+    size_t mask = recorder.dedup_capacity - 1;
+    size_t i = (hash ^ addr) & mask;
+    while (recorder.dedup[i].size != 0) {
+        struct CaptureDedupEntry *e = &recorder.dedup[i];
+        if (e->addr == addr && e->size == size && e->hash == hash) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &recorder.dedup[i];
+}
+
+static void gfx_capture_dedup_grow(void) {
+    struct CaptureDedupEntry *old = recorder.dedup;
+    size_t old_capacity = recorder.dedup_capacity;
+    recorder.dedup_capacity = old_capacity == 0 ? 4096 : old_capacity * 2;
+    recorder.dedup = calloc(recorder.dedup_capacity, sizeof(struct CaptureDedupEntry));
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].size != 0) {
+            *gfx_capture_dedup_slot(old[i].addr, old[i].size, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+}
+
+void gfx_capture_record_frame_end(void) {
+    if (recorder.file == NULL) {
+        return;
+    }
+
+    // Merge overlapping regions. Merely adjacent regions are kept apart, so that
+    // an unchanged texture or vertex buffer keeps its payload between frames.
+    qsort(recorder.regions, recorder.num_regions, sizeof(struct CaptureRegion), gfx_capture_compare_regions);
+    size_t n = 0;
+    for (size_t i = 0; i < recorder.num_regions; i++) {
+        struct CaptureRegion *r = &recorder.regions[i];
+        if (n > 0 && r->addr < recorder.regions[n - 1].addr + recorder.regions[n - 1].size) {
+            struct CaptureRegion *prev = &recorder.regions[n - 1];
+            if (r->addr + r->size > prev->addr + prev->size) {
+                prev->size = r->addr + r->size - prev->addr;
+            }
+        } else {
+            recorder.regions[n++] = *r;
+        }
+    }
+    recorder.num_regions = n;
+
+    struct GfxCaptureRegion *table = malloc(n * sizeof(struct GfxCaptureRegion));
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t *data = (const uint8_t *)(uintptr_t)recorder.regions[i].addr;
+        uint64_t size = recorder.regions[i].size;
+        uint64_t hash = gfx_capture_hash(data, size);
+
+        if (recorder.dedup_count * 2 >= recorder.dedup_capacity) {
+            gfx_capture_dedup_grow();
+        }
+        struct CaptureDedupEntry *e = gfx_capture_dedup_slot(recorder.regions[i].addr, size, hash);
+        if (e->size == 0) {
+            if (!gfx_capture_align(GFX_CAPTURE_ALIGNMENT)) {
+                free(table);
+                gfx_capture_abort();
+                return;
+            }
+            e->addr = recorder.regions[i].addr;
+            e->size = size;
+            e->hash = hash;
+            e->offset = recorder.file_pos;
+            recorder.dedup_count++;
+            if (!gfx_capture_write(data, size)) {
+                free(table);
+                gfx_capture_abort();
+                return;
+            }
+        }
+        table[i].addr = recorder.regions[i].addr;
+        table[i].size = size;
+        table[i].offset = e->offset;
+    }
+
+    struct GfxCaptureFrameHeader frame_header = {recorder.root_addr, gfx_current_dimensions.width, gfx_current_dimensions.height, n, 0};
+    bool ok = gfx_capture_align(8);
+    uint64_t frame_offset = recorder.file_pos;
+    ok = ok && gfx_capture_write(&frame_header, sizeof(frame_header));
+    ok = ok && gfx_capture_write(table, n * sizeof(struct GfxCaptureRegion));
+    free(table);
+    if (!ok) {
+        gfx_capture_abort();
+        return;
+    }
+
+    if (recorder.num_frames == recorder.frame_offsets_capacity) {
+        recorder.frame_offsets_capacity = recorder.frame_offsets_capacity == 0 ? 256 : recorder.frame_offsets_capacity * 2;
+        recorder.frame_offsets = realloc(recorder.frame_offsets, recorder.frame_offsets_capacity * sizeof(uint64_t));
+    }
+    recorder.frame_offsets[recorder.num_frames++] = frame_offset;
+}
+
+static bool gfx_capture_validate(const struct GfxCapture *capture) {
+    const struct GfxCaptureFileHeader *header = capture->header;
+    if (header->magic != GFX_CAPTURE_MAGIC || header->version != GFX_CAPTURE_VERSION) {
+        fprintf(stderr, "Display list capture: not a capture file\n");
+        return false;
+    }
+    if (header->gbi_config != gfx_capture_gbi_config()) {
+        fprintf(stderr, "Display list capture: recorded with a different pointer size or GBI\n");
+        return false;
+    }
+    if (header->frame_index_offset % 8 != 0 || header->frame_index_offset > capture->size ||
+        (capture->size - header->frame_index_offset) / sizeof(uint64_t) < header->num_frames) {
+        return false;
+    }
+    for (uint32_t i = 0; i < header->num_frames; i++) {
+        uint64_t offset = capture->frame_offsets[i];
+        if (offset % 8 != 0 || offset > capture->size || capture->size - offset < sizeof(struct GfxCaptureFrameHeader)) {
+            return false;
+        }
+        const struct GfxCaptureFrameHeader *frame = (const struct GfxCaptureFrameHeader *)(capture->data + offset);
+        const struct GfxCaptureRegion *regions = (const struct GfxCaptureRegion *)(frame + 1);
+        if ((capture->size - offset - sizeof(*frame)) / sizeof(struct GfxCaptureRegion) < frame->num_regions) {
+            return false;
+        }
+        for (uint32_t j = 0; j < frame->num_regions; j++) {
+            if (regions[j].offset > capture->size || capture->size - regions[j].offset < regions[j].size) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+struct GfxCapture *gfx_capture_open(const char *filename) {
+    struct GfxCapture *capture = calloc(1, sizeof(struct GfxCapture));
+
+#ifdef _WIN32
+    capture->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (capture->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(capture->file, &size) || size.QuadPart == 0) {
+        if (capture->file != INVALID_HANDLE_VALUE) {
+            CloseHandle(capture->file);
+        }
+        free(capture);
+        return NULL;
+    }
+    capture->mapping = CreateFileMappingA(capture->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    capture->data = capture->mapping != NULL ? (uint8_t *)MapViewOfFile(capture->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    capture->size = size.QuadPart;
+    if (capture->data == NULL) {
+        if (capture->mapping != NULL) {
+            CloseHandle(capture->mapping);
+        }
+        CloseHandle(capture->file);
+        free(capture);
+        return NULL;
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(capture);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        free(capture);
+        return NULL;
+    }
+    capture->data = data;
+    capture->size = st.st_size;
+#endif
+
+    capture->header = (const struct GfxCaptureFileHeader *)capture->data;
+    if (capture->size < sizeof(struct GfxCaptureFileHeader)) {
+        fprintf(stderr, "Display list capture: not a capture file\n");
+        gfx_capture_close(capture);
+        return NULL;
+    }
+    capture->frame_offsets = (const uint64_t *)(capture->data + capture->header->frame_index_offset);
+    if (!gfx_capture_validate(capture)) {
+        gfx_capture_close(capture);
+        return NULL;
+    }
+    return capture;
+}
+
+void gfx_capture_close(struct GfxCapture *capture) {
+    if (replay.base == capture->data) {
+        replay.base = NULL;
+        replay.regions = NULL;
+        replay.num_regions = 0;
+        gfx_capture_replaying = false;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(capture->data);
+    CloseHandle(capture->mapping);
+    CloseHandle(capture->file);
+#else
+    munmap(capture->data, capture->size);
+#endif
+    free(capture);
+}
+
+uint32_t gfx_capture_get_num_frames(const struct GfxCapture *capture) {
+    return capture->header->num_frames;
+}
+
+const void *gfx_capture_get_data(const struct GfxCapture *capture, size_t *size) {
+    *size = capture->size;
+    return capture->data;
+}
+
+Gfx *gfx_capture_select_frame(struct GfxCapture *capture, uint32_t frame) {
+    const struct GfxCaptureFrameHeader *frame_header = (const struct GfxCaptureFrameHeader *)(capture->data + capture->frame_offsets[frame]);
+    replay.base = capture->data;
+    replay.regions = (const struct GfxCaptureRegion *)(frame_header + 1);
+    replay.num_regions = frame_header->num_regions;
+    gfx_capture_replaying = true;
+    return (Gfx *)gfx_capture_translate_addr(frame_header->root_addr);
+}
+
+void *gfx_capture_translate_addr(uintptr_t addr) {
+    // Find the last region starting at or before addr
+    uint32_t lo = 0, hi = replay.num_regions;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (replay.regions[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0 && addr - replay.regions[lo - 1].addr < replay.regions[lo - 1].size) {
+        const struct GfxCaptureRegion *r = &replay.regions[lo - 1];
+        return replay.base + r->offset + (addr - r->addr);
+    }
+    // Not recorded, e.g. color and depth image addresses that are only compared
+    return (void *)addr;
+}
@@ -0,0 +1,82 @@
+#ifndef GFX_CAPTURE_H
+#define GFX_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Display list capture files.
+//
+// A capture holds, for every recorded frame, the root display list address
+// and all memory regions (display lists, vertices, matrices, viewports, lights,
+// textures and palettes) that the frame's commands read. Regions keep their
+// original addresses, so the command stream is stored unmodified. On replay
+// the file is memory-mapped and seg_addr() translates the original addresses
+// into the mapping, without copying or patching any data.
+//
+// File layout (native endianness, all offsets are absolute file offsets):
+//
+//   struct GfxCaptureFileHeader
+//   region payloads, each aligned to GFX_CAPTURE_ALIGNMENT, shared between
+//   frames when contents are unchanged
+//   per frame: struct GfxCaptureFrameHeader followed by num_regions
+//   struct GfxCaptureRegion, sorted by addr and non-overlapping
+//   frame index: num_frames uint64_t offsets to the frame headers
+
+#define GFX_CAPTURE_MAGIC 0x43443346 // "F3DC"
+#define GFX_CAPTURE_VERSION 1
+#define GFX_CAPTURE_ALIGNMENT 16
+
+struct GfxCaptureFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t gbi_config; // pointer size and GBI variant the capture was made with
+    uint32_t num_frames;
+    uint64_t frame_index_offset;
+};
+
+struct GfxCaptureFrameHeader {
+    uint64_t root_addr;
+    uint32_t width, height;
+    uint32_t num_regions;
+    uint32_t padding;
+};
+
+struct GfxCaptureRegion {
+    uint64_t addr;
+    uint64_t size;
+    uint64_t offset;
+};
+
+struct GfxCapture;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Recording (hooks gfx_run)
+bool gfx_capture_start(const char *filename);
+void gfx_capture_stop(void);
+
+// Replay. gfx_capture_select_frame returns the frame's root display list,
+// which can be passed directly to gfx_run.
+struct GfxCapture *gfx_capture_open(const char *filename);
+void gfx_capture_close(struct GfxCapture *capture);
+uint32_t gfx_capture_get_num_frames(const struct GfxCapture *capture);
+Gfx *gfx_capture_select_frame(struct GfxCapture *capture, uint32_t frame);
+// The mapped file, which all replayed addresses point into
+const void *gfx_capture_get_data(const struct GfxCapture *capture, size_t *size);
+
+// Used by gfx_pc.c
+extern bool gfx_capture_recording;
+extern bool gfx_capture_replaying;
+void gfx_capture_record_frame_begin(const Gfx *commands);
+void gfx_capture_record_region(const void *addr, size_t size);
+void gfx_capture_record_frame_end(void);
+void *gfx_capture_translate_addr(uintptr_t addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
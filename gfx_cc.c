@@ -1,6 +1,6 @@
 #include "gfx_cc.h"
 
-void gfx_cc_get_features(uint32_t shader_id, struct CCFeatures *cc_features) {
+void gfx_cc_get_features(uint64_t shader_id, struct CCFeatures *cc_features) {
     for (int i = 0; i < 4; i++) {
         cc_features->c[0][i] = (shader_id >> (i * 3)) & 7;
         cc_features->c[1][i] = (shader_id >> (12 + i * 3)) & 7;
@@ -10,6 +10,13 @@ void gfx_cc_get_features(uint32_t shader_id, struct CCFeatures *cc_features) {
     cc_features->opt_fog = (shader_id & SHADER_OPT_FOG) != 0;
     cc_features->opt_texture_edge = (shader_id & SHADER_OPT_TEXTURE_EDGE) != 0;
     cc_features->opt_noise = (shader_id & SHADER_OPT_NOISE) != 0;
+    cc_features->opt_packed_vertices = (shader_id & SHADER_OPT_PACKED_VERTICES) != 0;
+    cc_features->opt_texture_atlas = (shader_id & SHADER_OPT_TEXTURE_ATLAS) != 0;
+    cc_features->opt_texture_arrays = (shader_id & SHADER_OPT_TEXTURE_ARRAYS) != 0;
+    cc_features->opt_uber = (shader_id & SHADER_OPT_UBER) != 0;
+    cc_features->opt_palette[0] = (shader_id & SHADER_OPT_PALETTE_TEXEL0) != 0;
+    cc_features->opt_palette[1] = (shader_id & SHADER_OPT_PALETTE_TEXEL1) != 0;
+    cc_features->opt_palette_linear = (shader_id & SHADER_OPT_PALETTE_LINEAR) != 0;
 
     cc_features->used_textures[0] = false;
     cc_features->used_textures[1] = false;
@@ -38,4 +45,13 @@ void gfx_cc_get_features(uint32_t shader_id, struct CCFeatures *cc_features) {
     cc_features->do_mix[0] = cc_features->c[0][1] == cc_features->c[0][3];
     cc_features->do_mix[1] = cc_features->c[1][1] == cc_features->c[1][3];
     cc_features->color_alpha_same = (shader_id & 0xfff) == ((shader_id >> 12) & 0xfff);
+
+    if (cc_features->opt_uber) {
+        // The vertex layout every combiner can be evaluated with
+        cc_features->opt_alpha = true;
+        cc_features->opt_fog = true;
+        cc_features->used_textures[0] = true;
+        cc_features->used_textures[1] = true;
+        cc_features->num_inputs = 3;
+    }
 }
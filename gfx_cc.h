@@ -30,6 +30,34 @@ enum {
 #define SHADER_OPT_FOG (1 << 25)
 #define SHADER_OPT_TEXTURE_EDGE (1 << 26)
 #define SHADER_OPT_NOISE (1 << 27)
+#define SHADER_OPT_PACKED_VERTICES (1 << 28) // fog and inputs are UNORM8x4 instead of floats
+#define SHADER_OPT_TEXTURE_ATLAS (1 << 29) // textures are sampled from atlas pages, see below
+#define SHADER_OPT_TEXTURE_ARRAYS (1 << 30) // textures are layers of texture arrays, the layer of each used texture follows the texture coordinates
+#define SHADER_OPT_UBER (1U << 31) // generic combiner selected per vertex, see below
+#define SHADER_OPT_PALETTE_TEXEL0 (1ULL << 32) // texture 0 holds color indices, see below
+#define SHADER_OPT_PALETTE_TEXEL1 (1ULL << 33)
+#define SHADER_OPT_PALETTE_LINEAR (1ULL << 34) // the shader filters palette textures bilinearly
+
+// With SHADER_OPT_TEXTURE_ATLAS, each texture is a rectangle in a square page
+// of GFX_TEXTURE_ATLAS_SIZE texels. After the texture coordinates, the vertex
+// holds the rectangle (x, y, width, height in texels) of each used texture,
+// followed by the tile's cms, cmt and linear filter flag. The shader applies
+// wrapping and filtering itself, sampling the page with nearest filtering.
+#define GFX_TEXTURE_ATLAS_SIZE 1024
+
+// A SHADER_OPT_UBER shader evaluates any (A - B) * C + D combiner, so that
+// combiner and option changes don't switch programs. Only the packed vertex,
+// atlas and texture array options and no combiner inputs are part of its id.
+// Its vertices are laid out like those of a shader with alpha, fog, both
+// textures and three inputs (prim, shade and env color), followed by four
+// floats: the color and alpha combiners as CC_* values (a + 8 * b + 64 * c +
+// 512 * d), the option flags (alpha 1, texture edge 2, noise 4) and the LOD
+// fraction. Without fog, the fog factor is 0.
+
+// With SHADER_OPT_PALETTE_TEXEL0/1, the texture holds 8-bit color indices of a
+// CI texture, which are looked up in a 256x1 RGBA32 palette texture. Index
+// textures are sampled with nearest filtering; with SHADER_OPT_PALETTE_LINEAR,
+// the shader filters the looked up colors itself, given the index texture size.
 
 struct CCFeatures {
     uint8_t c[2][4];
@@ -37,6 +65,12 @@ struct CCFeatures {
     bool opt_fog;
     bool opt_texture_edge;
     bool opt_noise;
+    bool opt_packed_vertices;
+    bool opt_texture_atlas;
+    bool opt_texture_arrays;
+    bool opt_uber;
+    bool opt_palette[2];
+    bool opt_palette_linear;
     bool used_textures[2];
     int num_inputs;
     bool do_single[2];
@@ -49,7 +83,7 @@ struct CCFeatures {
 extern "C" {
 #endif
 
-void gfx_cc_get_features(uint32_t shader_id, struct CCFeatures *cc_features);
+void gfx_cc_get_features(uint64_t shader_id, struct CCFeatures *cc_features);
 
 #ifdef __cplusplus
 }
@@ -64,7 +64,7 @@ struct ShaderProgramD3D11 {
     ComPtr<ID3D11InputLayout> input_layout;
     ComPtr<ID3D11BlendState> blend_state;
 
-    uint32_t shader_id;
+    uint64_t shader_id;
     uint8_t num_inputs;
     uint8_t num_floats;
     bool used_textures[2];
@@ -314,7 +314,7 @@ static void gfx_d3d11_load_shader(struct ShaderProgram *new_prg) {
     d3d.shader_program = (struct ShaderProgramD3D11 *)new_prg;
 }
 
-static struct ShaderProgram *gfx_d3d11_create_and_load_new_shader(uint32_t shader_id) {
+static struct ShaderProgram *gfx_d3d11_create_and_load_new_shader(uint64_t shader_id) {
     CCFeatures cc_features;
     gfx_cc_get_features(shader_id, &cc_features);
 
@@ -401,7 +401,7 @@ static struct ShaderProgram *gfx_d3d11_create_and_load_new_shader(uint32_t shade
     return (struct ShaderProgram *)(d3d.shader_program = prg);
 }
 
-static struct ShaderProgram *gfx_d3d11_lookup_shader(uint32_t shader_id) {
+static struct ShaderProgram *gfx_d3d11_lookup_shader(uint64_t shader_id) {
     for (size_t i = 0; i < d3d.shader_program_pool_size; i++) {
         if (d3d.shader_program_pool[i].shader_id == shader_id) {
             return (struct ShaderProgram *)&d3d.shader_program_pool[i];
@@ -718,6 +718,22 @@ struct GfxRenderingAPI gfx_direct3d11_api = {
     gfx_d3d11_set_scissor,
     gfx_d3d11_set_use_alpha,
     gfx_d3d11_draw_triangles,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
     gfx_d3d11_init,
     gfx_d3d11_on_resize,
     gfx_d3d11_start_frame,
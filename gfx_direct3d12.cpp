@@ -46,7 +46,7 @@ using namespace Microsoft::WRL; // For ComPtr
 namespace {
 
 struct ShaderProgramD3D12 {
-    uint32_t shader_id;
+    uint64_t shader_id;
     uint8_t num_inputs;
     bool used_textures[2];
     uint8_t num_floats;
@@ -58,11 +58,11 @@ struct ShaderProgramD3D12 {
 };
 
 struct PipelineDesc {
-    uint32_t shader_id;
+    uint64_t shader_id;
     bool depth_test;
     bool depth_mask;
     bool zmode_decal;
-    bool _padding;
+    bool _padding[5];
     
     bool operator==(const PipelineDesc& o) const {
         return memcmp(this, &o, sizeof(*this)) == 0;
@@ -230,12 +230,12 @@ static void gfx_direct3d12_load_shader(struct ShaderProgram *new_prg) {
     d3d.must_reload_pipeline = true;
 }
 
-static struct ShaderProgram *gfx_direct3d12_create_and_load_new_shader(uint32_t shader_id) {
+static struct ShaderProgram *gfx_direct3d12_create_and_load_new_shader(uint64_t shader_id) {
     /*static FILE *fp;
     if (!fp) {
         fp = fopen("shaders.txt", "w");
     }
-    fprintf(fp, "0x%08x\n", shader_id);
+    fprintf(fp, "0x%016llx\n", (unsigned long long)shader_id);
     fflush(fp);*/
     
     struct ShaderProgramD3D12 *prg = &d3d.shader_program_pool[d3d.shader_program_pool_size++];
@@ -266,7 +266,7 @@ static struct ShaderProgram *gfx_direct3d12_create_and_load_new_shader(uint32_t
     return (struct ShaderProgram *)(d3d.shader_program = prg);
 }
 
-static struct ShaderProgram *gfx_direct3d12_lookup_shader(uint32_t shader_id) {
+static struct ShaderProgram *gfx_direct3d12_lookup_shader(uint64_t shader_id) {
     for (size_t i = 0; i < d3d.shader_program_pool_size; i++) {
         if (d3d.shader_program_pool[i].shader_id == shader_id) {
             return (struct ShaderProgram *)&d3d.shader_program_pool[i];
@@ -956,6 +956,22 @@ struct GfxRenderingAPI gfx_direct3d12_api = {
     gfx_direct3d12_set_scissor,
     gfx_direct3d12_set_use_alpha,
     gfx_direct3d12_draw_triangles,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
     gfx_direct3d12_init,
     gfx_direct3d12_on_resize,
     gfx_direct3d12_start_frame,
@@ -5,7 +5,7 @@
 #include "gfx_direct3d_common.h"
 #include "gfx_cc.h"
 
-void get_cc_features(uint32_t shader_id, CCFeatures *cc_features) {
+void get_cc_features(uint64_t shader_id, CCFeatures *cc_features) {
     for (int i = 0; i < 4; i++) {
         cc_features->c[0][i] = (shader_id >> (i * 3)) & 7;
         cc_features->c[1][i] = (shader_id >> (12 + i * 3)) & 7;
@@ -0,0 +1,482 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "gfx_disk_cache.h"
+#include "gfx_hash.h"
+
+#define INITIAL_INDEX_CAPACITY 1024
+#define MAX_QUEUED_BYTES (64 << 20) // entries beyond it are dropped until the writer catches up
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~(uint64_t)((a) - 1))
+
+struct DiskCacheIndexEntry {
+    struct GfxDiskCacheKey key;
+    uint64_t offset; // of the payload, 0 means empty slot
+    uint32_t size;
+};
+
+struct DiskCacheWrite {
+    struct DiskCacheWrite *next;
+    uint64_t offset;
+    uint64_t size; // of the entry, with padding
+    uint8_t data[];
+};
+
+static struct {
+    bool open;
+    FILE *file; // used by the writer thread until close
+
+    uint8_t *data;
+    uint64_t mapped_size; // of the file, readable through data
+    uint64_t map_size; // of the mapping, which may reach past the end of the file
+    bool remapped; // in the current frame
+#ifdef _WIN32
+    HANDLE handle;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+
+    // Entries in the file or queued for writing
+    struct DiskCacheIndexEntry *index;
+    size_t index_capacity;
+    size_t index_count;
+    uint64_t end; // offset of the next entry
+
+    // Shared with the writer thread
+    struct DiskCacheWrite *head, *tail;
+    uint64_t queued_bytes;
+    uint64_t written_end; // entries before it are in the file
+    bool failed;
+    bool stopping;
+    bool writer_started;
+    bool close_at_exit;
+#ifdef _WIN32
+    SRWLOCK lock;
+    CONDITION_VARIABLE work_available;
+    HANDLE writer;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_t writer;
+#endif
+} cache = {
+#ifdef _WIN32
+    .lock = SRWLOCK_INIT,
+    .work_available = CONDITION_VARIABLE_INIT,
+#else
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_available = PTHREAD_COND_INITIALIZER,
+#endif
+};
+
+#ifdef _WIN32
+
+static void cache_lock(void) {
+    AcquireSRWLockExclusive(&cache.lock);
+}
+
+static void cache_unlock(void) {
+    ReleaseSRWLockExclusive(&cache.lock);
+}
+
+static void cache_sleep(void) {
+    SleepConditionVariableSRW(&cache.work_available, &cache.lock, INFINITE, 0);
+}
+
+static void cache_wake(void) {
+    WakeConditionVariable(&cache.work_available);
+}
+
+#else
+
+static void cache_lock(void) {
+    pthread_mutex_lock(&cache.lock);
+}
+
+static void cache_unlock(void) {
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static void cache_sleep(void) {
+    pthread_cond_wait(&cache.work_available, &cache.lock);
+}
+
+static void cache_wake(void) {
+    pthread_cond_signal(&cache.work_available);
+}
+
+#endif
+
+static uint64_t gfx_disk_cache_check(const struct GfxDiskCacheEntryHeader *header) {
+    uint64_t h = header->key.hash ^ (header->key.params * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)header->size << 32 | header->magic) ^
+                 (header->payload_hash * 0xC2B2AE3D27D4EB4FULL);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void gfx_disk_cache_unmap(void) {
+    if (cache.data != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(cache.data);
+        CloseHandle(cache.mapping);
+#else
+        munmap(cache.data, cache.map_size);
+#endif
+    }
+    cache.data = NULL;
+    cache.mapped_size = 0;
+    cache.map_size = 0;
+}
+
+// Maps the first size bytes of the file
+static bool gfx_disk_cache_map(uint64_t size) {
+#ifndef _WIN32
+    // Reserve room for the file to grow, so that it is remapped only a few times
+    uint64_t map_size = cache.map_size * 2 < GFX_DISK_CACHE_MAX_SIZE ? cache.map_size * 2 : GFX_DISK_CACHE_MAX_SIZE;
+    map_size = map_size > size ? map_size : size;
+#endif
+    gfx_disk_cache_unmap();
+#ifdef _WIN32
+    cache.mapping = CreateFileMappingA(cache.handle, NULL, PAGE_READONLY, (DWORD)(size >> 32), (DWORD)size, NULL);
+    if (cache.mapping == NULL) {
+        return false;
+    }
+    cache.data = (uint8_t *)MapViewOfFile(cache.mapping, FILE_MAP_READ, 0, 0, size);
+    if (cache.data == NULL) {
+        CloseHandle(cache.mapping);
+        return false;
+    }
+    cache.map_size = size;
+#else
+    void *data = mmap(NULL, map_size, PROT_READ, MAP_SHARED, cache.fd, 0);
+    if (data == MAP_FAILED && map_size > size) {
+        // Not enough address space to reserve
+        map_size = size;
+        data = mmap(NULL, map_size, PROT_READ, MAP_SHARED, cache.fd, 0);
+    }
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    cache.data = data;
+    cache.map_size = map_size;
+#endif
+    cache.mapped_size = size;
+    return true;
+}
+
+static size_t gfx_disk_cache_slot(const struct GfxDiskCacheKey *key) {
+    return (key->hash ^ (key->params * 0x9E3779B97F4A7C15ULL)) & (cache.index_capacity - 1);
+}
+
+static struct DiskCacheIndexEntry *gfx_disk_cache_find(const struct GfxDiskCacheKey *key) {
+    if (cache.index == NULL) {
+        return NULL;
+    }
+    for (size_t i = gfx_disk_cache_slot(key);; i = (i + 1) & (cache.index_capacity - 1)) {
+        struct DiskCacheIndexEntry *entry = &cache.index[i];
+        if (entry->offset == 0) {
+            return NULL;
+        }
+        if (entry->key.hash == key->hash && entry->key.params == key->params) {
+            return entry;
+        }
+    }
+}
+
+static void gfx_disk_cache_index_insert(const struct GfxDiskCacheKey *key, uint64_t offset, uint32_t size) {
+    if ((cache.index_count + 1) * 4 > cache.index_capacity * 3) {
+        struct DiskCacheIndexEntry *old = cache.index;
+        size_t old_capacity = cache.index_capacity;
+        cache.index_capacity = old_capacity != 0 ? old_capacity * 2 : INITIAL_INDEX_CAPACITY;
+        cache.index = calloc(cache.index_capacity, sizeof(struct DiskCacheIndexEntry));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].offset != 0) {
+                size_t j = gfx_disk_cache_slot(&old[i].key);
+                while (cache.index[j].offset != 0) {
+                    j = (j + 1) & (cache.index_capacity - 1);
+                }
+                cache.index[j] = old[i];
+            }
+        }
+        free(old);
+    }
+    size_t i = gfx_disk_cache_slot(key);
+    while (cache.index[i].offset != 0) {
+        if (cache.index[i].key.hash == key->hash && cache.index[i].key.params == key->params) {
+            // A later entry with the same key replaces the earlier one
+            cache.index[i].offset = offset;
+            cache.index[i].size = size;
+            return;
+        }
+        i = (i + 1) & (cache.index_capacity - 1);
+    }
+    cache.index[i].key = *key;
+    cache.index[i].offset = offset;
+    cache.index[i].size = size;
+    cache.index_count++;
+}
+
+// Indexes the entries of the mapped file, up to the first one that is cut short or invalid.
+// Payloads are only verified here, as they are read from disk anyway when they are used.
+static uint64_t gfx_disk_cache_scan(void) {
+    uint64_t pos = sizeof(struct GfxDiskCacheFileHeader);
+    while (pos + sizeof(struct GfxDiskCacheEntryHeader) <= cache.mapped_size) {
+        const struct GfxDiskCacheEntryHeader *header = (const struct GfxDiskCacheEntryHeader *)(cache.data + pos);
+        uint64_t payload = pos + sizeof(struct GfxDiskCacheEntryHeader);
+        if (header->magic != GFX_DISK_CACHE_ENTRY_MAGIC || header->check != gfx_disk_cache_check(header) ||
+            payload + header->size > cache.mapped_size ||
+            gfx_hash64(cache.data + payload, header->size, 0) != header->payload_hash) {
+            break;
+        }
+        gfx_disk_cache_index_insert(&header->key, payload, header->size);
+        pos = ALIGN(payload + header->size, GFX_DISK_CACHE_ALIGNMENT);
+    }
+    return pos;
+}
+
+static void gfx_disk_cache_write_entries(void) {
+    bool failed = false;
+    cache_lock();
+    for (;;) {
+        while (cache.head == NULL && !cache.stopping) {
+            cache_sleep();
+        }
+        if (cache.head == NULL) {
+            break;
+        }
+        struct DiskCacheWrite *write = cache.head;
+        cache.head = write->next;
+        if (cache.head == NULL) {
+            cache.tail = NULL;
+        }
+        cache_unlock();
+        // Hashed here rather than when queued, to keep it off the caller's thread
+        struct GfxDiskCacheEntryHeader *header = (struct GfxDiskCacheEntryHeader *)write->data;
+        header->payload_hash = gfx_hash64(write->data + sizeof(*header), header->size, 0);
+        header->check = gfx_disk_cache_check(header);
+        // Flushed per entry, so that an exit without close loses little
+        failed = failed || fwrite(write->data, write->size, 1, cache.file) != 1 || fflush(cache.file) != 0;
+        cache_lock();
+        cache.queued_bytes -= write->size;
+        if (failed) {
+            cache.failed = true;
+        } else {
+            cache.written_end = write->offset + write->size;
+        }
+        free(write);
+    }
+    cache_unlock();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI gfx_disk_cache_writer(LPVOID arg) {
+    gfx_disk_cache_write_entries();
+    return 0;
+}
+#else
+static void *gfx_disk_cache_writer(void *arg) {
+    gfx_disk_cache_write_entries();
+    return NULL;
+}
+#endif
+
+bool gfx_disk_cache_open(const char *filename) {
+    gfx_disk_cache_close();
+
+    FILE *file = fopen(filename, "r+b");
+    if (file == NULL) {
+        file = fopen(filename, "w+b");
+    }
+    if (file == NULL) {
+        return false;
+    }
+    struct GfxDiskCacheFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != GFX_DISK_CACHE_MAGIC ||
+        header.version != GFX_DISK_CACHE_VERSION) {
+        // New file, or one from another version: start over
+        file = freopen(filename, "w+b", file);
+        memset(&header, 0, sizeof(header));
+        header.magic = GFX_DISK_CACHE_MAGIC;
+        header.version = GFX_DISK_CACHE_VERSION;
+        if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file) != 0) {
+            if (file != NULL) {
+                fclose(file);
+            }
+            return false;
+        }
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+
+#ifdef _WIN32
+    cache.handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL, NULL);
+    bool opened = cache.handle != INVALID_HANDLE_VALUE;
+#else
+    cache.fd = open(filename, O_RDONLY);
+    bool opened = cache.fd >= 0;
+#endif
+    if (!opened || size < (long)sizeof(header) || !gfx_disk_cache_map(size)) {
+        if (opened) {
+#ifdef _WIN32
+            CloseHandle(cache.handle);
+#else
+            close(cache.fd);
+#endif
+        }
+        fclose(file);
+        return false;
+    }
+
+    // New entries overwrite whatever follows the last valid one
+    cache.end = gfx_disk_cache_scan();
+    cache.written_end = cache.end;
+    fseek(file, cache.end, SEEK_SET);
+    cache.file = file;
+    cache.stopping = false;
+#ifdef _WIN32
+    cache.writer = CreateThread(NULL, 0, gfx_disk_cache_writer, NULL, 0, NULL);
+    cache.writer_started = cache.writer != NULL;
+#else
+    cache.writer_started = pthread_create(&cache.writer, NULL, gfx_disk_cache_writer, NULL) == 0;
+#endif
+    // Without the writer, entries in the file are still used, but none are added
+    cache.failed = !cache.writer_started;
+    cache.open = true;
+    if (!cache.close_at_exit) {
+        cache.close_at_exit = atexit(gfx_disk_cache_close) == 0;
+    }
+    return true;
+}
+
+void gfx_disk_cache_close(void) {
+    if (!cache.open) {
+        return;
+    }
+    if (cache.writer_started) {
+        cache_lock();
+        cache.stopping = true;
+        cache_wake();
+        cache_unlock();
+#ifdef _WIN32
+        WaitForSingleObject(cache.writer, INFINITE);
+        CloseHandle(cache.writer);
+#else
+        pthread_join(cache.writer, NULL);
+#endif
+    }
+    fclose(cache.file);
+    gfx_disk_cache_unmap();
+#ifdef _WIN32
+    CloseHandle(cache.handle);
+#else
+    close(cache.fd);
+#endif
+    free(cache.index);
+    cache.index = NULL;
+    cache.index_capacity = 0;
+    cache.index_count = 0;
+    cache.file = NULL;
+    cache.open = false;
+}
+
+// Returns the entry if it is in the file
+static struct DiskCacheIndexEntry *gfx_disk_cache_find_written(const struct GfxDiskCacheKey *key) {
+    struct DiskCacheIndexEntry *entry = gfx_disk_cache_find(key);
+    if (entry == NULL || entry->offset + entry->size <= cache.mapped_size) {
+        return entry;
+    }
+    cache_lock();
+    bool written = entry->offset + entry->size <= cache.written_end;
+    cache_unlock();
+    return written ? entry : NULL;
+}
+
+bool gfx_disk_cache_lookup(const struct GfxDiskCacheKey *key, const uint8_t **payload, size_t *size) {
+    struct DiskCacheIndexEntry *entry = gfx_disk_cache_find_written(key);
+    if (entry == NULL) {
+        return false;
+    }
+    if (entry->offset + entry->size > cache.mapped_size) {
+        // Written after the file was mapped
+        cache_lock();
+        uint64_t written_end = cache.written_end;
+        cache_unlock();
+        if (written_end <= cache.map_size) {
+            cache.mapped_size = written_end;
+        } else if (cache.remapped || !gfx_disk_cache_map(written_end)) {
+            return false;
+        } else {
+            cache.remapped = true;
+        }
+    }
+    *payload = cache.data + entry->offset;
+    *size = entry->size;
+    return true;
+}
+
+bool gfx_disk_cache_contains(const struct GfxDiskCacheKey *key) {
+    return gfx_disk_cache_find_written(key) != NULL;
+}
+
+void gfx_disk_cache_new_frame(void) {
+    cache.remapped = false;
+}
+
+void gfx_disk_cache_put(const struct GfxDiskCacheKey *key, const void *payload, size_t size) {
+    if (!cache.open || size > UINT32_MAX || gfx_disk_cache_find(key) != NULL) {
+        return;
+    }
+    uint64_t entry_size = ALIGN(sizeof(struct GfxDiskCacheEntryHeader) + size, GFX_DISK_CACHE_ALIGNMENT);
+    if (cache.end + entry_size > GFX_DISK_CACHE_MAX_SIZE) {
+        return;
+    }
+    cache_lock();
+    bool accepted = !cache.failed && cache.queued_bytes + entry_size <= MAX_QUEUED_BYTES;
+    cache_unlock();
+    if (!accepted) {
+        return;
+    }
+
+    struct DiskCacheWrite *write = malloc(sizeof(struct DiskCacheWrite) + entry_size);
+    if (write == NULL) {
+        return;
+    }
+    // The writer thread fills in the payload hash and the check
+    struct GfxDiskCacheEntryHeader header = {GFX_DISK_CACHE_ENTRY_MAGIC, (uint32_t)size, *key, 0, 0};
+    memcpy(write->data, &header, sizeof(header));
+    memcpy(write->data + sizeof(header), payload, size);
+    memset(write->data + sizeof(header) + size, 0, entry_size - sizeof(header) - size);
+    write->next = NULL;
+    write->offset = cache.end;
+    write->size = entry_size;
+    gfx_disk_cache_index_insert(key, cache.end + sizeof(header), (uint32_t)size);
+    cache.end += entry_size;
+
+    cache_lock();
+    if (cache.tail != NULL) {
+        cache.tail->next = write;
+    } else {
+        cache.head = write;
+    }
+    cache.tail = write;
+    cache.queued_bytes += entry_size;
+    cache_wake();
+    cache_unlock();
+}
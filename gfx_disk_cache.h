@@ -0,0 +1,75 @@
+#ifndef GFX_DISK_CACHE_H
+#define GFX_DISK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Persistent cache of payloads in a file, for data that is expensive to
+// compute but cheap to key, such as decoded textures.
+//
+// The file is only appended to. Entries are written by a background thread,
+// so gfx_disk_cache_put only copies the payload. Lookups return pointers into
+// a read-only memory mapping of the file, so payloads are only read from disk
+// when they are used. The mapping grows with the file, at most once per frame
+// and geometrically where the platform allows mapping past the end of the
+// file; growing it invalidates earlier lookups. Entries written after it was
+// grown in the current frame are not found until the next frame. The file is closed at exit, after the queued entries have
+// been written. If the process is killed before, an entry cut short is ignored.
+//
+// File layout (native endianness):
+//
+//   struct GfxDiskCacheFileHeader
+//   entries: struct GfxDiskCacheEntryHeader followed by the payload, each
+//   aligned to GFX_DISK_CACHE_ALIGNMENT
+//
+// All functions must be called from the same thread, and only one process may
+// use a file at a time.
+
+#define GFX_DISK_CACHE_MAGIC 0x43443346 // "F3DC"
+#define GFX_DISK_CACHE_VERSION 2
+#define GFX_DISK_CACHE_ENTRY_MAGIC 0x59525445 // "ETRY"
+#define GFX_DISK_CACHE_ALIGNMENT 16
+#define GFX_DISK_CACHE_MAX_SIZE (1ULL << 30) // entries beyond it are not stored
+
+struct GfxDiskCacheFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t padding;
+};
+
+struct GfxDiskCacheKey {
+    uint64_t hash;
+    uint64_t params;
+};
+
+struct GfxDiskCacheEntryHeader {
+    uint32_t magic; // GFX_DISK_CACHE_ENTRY_MAGIC
+    uint32_t size; // of the payload
+    struct GfxDiskCacheKey key;
+    uint64_t payload_hash; // XXH64, verified once when the file is opened
+    uint64_t check; // of the fields above, to detect entries that weren't written
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Opens or creates the cache file, closing the current one
+bool gfx_disk_cache_open(const char *filename);
+// Writes the queued entries and closes the file
+void gfx_disk_cache_close(void);
+
+// Returns the payload of the key, valid until the next lookup or close
+bool gfx_disk_cache_lookup(const struct GfxDiskCacheKey *key, const uint8_t **payload, size_t *size);
+bool gfx_disk_cache_contains(const struct GfxDiskCacheKey *key);
+// Allows the mapping to grow again
+void gfx_disk_cache_new_frame(void);
+// Copies the payload and queues it for writing, unless the key is already stored
+void gfx_disk_cache_put(const struct GfxDiskCacheKey *key, const void *payload, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef GFX_HASH_H
+#define GFX_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_PRIME64_1 0x9e3779b185ebca87ULL
+#define HASH_PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME64_3 0x165667b19e3779f9ULL
+#define HASH_PRIME64_4 0x85ebca77c2b2ae63ULL
+#define HASH_PRIME64_5 0x27d4eb2f165667c5ULL
+
+static inline uint64_t gfx_hash_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t gfx_hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t gfx_hash_round(uint64_t acc, uint64_t input) {
+    acc += input * HASH_PRIME64_2;
+    acc = gfx_hash_rotl64(acc, 31);
+    return acc * HASH_PRIME64_1;
+}
+
+static inline uint64_t gfx_hash_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= gfx_hash_round(0, val);
+    return acc * HASH_PRIME64_1 + HASH_PRIME64_4;
+}
+
+// XXH64. The four independent lanes of the main loop keep the multipliers busy,
+// and as texture sizes are multiples of 8 bytes, the tail is rarely used.
+static inline uint64_t gfx_hash64(const uint8_t *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + HASH_PRIME64_1 + HASH_PRIME64_2;
+        uint64_t v2 = seed + HASH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - HASH_PRIME64_1;
+        do {
+            v1 = gfx_hash_round(v1, gfx_hash_read64(p));
+            v2 = gfx_hash_round(v2, gfx_hash_read64(p + 8));
+            v3 = gfx_hash_round(v3, gfx_hash_read64(p + 16));
+            v4 = gfx_hash_round(v4, gfx_hash_read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = gfx_hash_rotl64(v1, 1) + gfx_hash_rotl64(v2, 7) + gfx_hash_rotl64(v3, 12) + gfx_hash_rotl64(v4, 18);
+        h = gfx_hash_merge_round(h, v1);
+        h = gfx_hash_merge_round(h, v2);
+        h = gfx_hash_merge_round(h, v3);
+        h = gfx_hash_merge_round(h, v4);
+    } else {
+        h = seed + HASH_PRIME64_5;
+    }
+    h += len;
+
+    while (p + 8 <= end) {
+        h ^= gfx_hash_round(0, gfx_hash_read64(p));
+        h = gfx_hash_rotl64(h, 27) * HASH_PRIME64_1 + HASH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        h ^= v * HASH_PRIME64_1;
+        h = gfx_hash_rotl64(h, 23) * HASH_PRIME64_2 + HASH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p * HASH_PRIME64_5;
+        h = gfx_hash_rotl64(h, 11) * HASH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME64_2;
+    h ^= h >> 29;
+    h *= HASH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+#endif
@@ -0,0 +1,324 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gfx_cc.h"
+#include "gfx_null.h"
+#include "gfx_rendering_api.h"
+#include "gfx_window_manager_api.h"
+#include "gfx_screen_config.h"
+
+// Headless backends that do no GPU or windowing work at all.
+// Everything the renderer asks for is only counted, which gives a CPU-only
+// baseline of the display list interpreter (e.g. on build servers without a GPU).
+
+struct ShaderProgram {
+    uint64_t shader_id;
+    uint8_t num_inputs;
+    bool used_textures[2];
+};
+
+static struct ShaderProgram shader_program_pool[64];
+static uint8_t shader_program_pool_size;
+
+static uint32_t texture_count;
+
+// Staging memory handed out by map_texture_staging, grown as needed
+static uint8_t *staging_buf;
+static size_t staging_size;
+
+static struct GfxNullCounters counters;
+
+static uint32_t window_width = DESIRED_SCREEN_WIDTH;
+static uint32_t window_height = DESIRED_SCREEN_HEIGHT;
+
+static bool gfx_null_z_is_from_0_to_1(void) {
+    return false;
+}
+
+static void gfx_null_unload_shader(struct ShaderProgram *old_prg) {
+}
+
+static void gfx_null_load_shader(struct ShaderProgram *new_prg) {
+    counters.shader_loads++;
+}
+
+static struct ShaderProgram *gfx_null_create_and_load_new_shader(uint64_t shader_id) {
+    struct CCFeatures cc_features;
+    gfx_cc_get_features(shader_id, &cc_features);
+
+    struct ShaderProgram *prg = &shader_program_pool[shader_program_pool_size++];
+    prg->shader_id = shader_id;
+    prg->num_inputs = cc_features.num_inputs;
+    prg->used_textures[0] = cc_features.used_textures[0];
+    prg->used_textures[1] = cc_features.used_textures[1];
+
+    counters.shaders_created++;
+    gfx_null_load_shader(prg);
+    return prg;
+}
+
+static struct ShaderProgram *gfx_null_lookup_shader(uint64_t shader_id) {
+    for (size_t i = 0; i < shader_program_pool_size; i++) {
+        if (shader_program_pool[i].shader_id == shader_id) {
+            return &shader_program_pool[i];
+        }
+    }
+    return NULL;
+}
+
+static void gfx_null_shader_get_info(struct ShaderProgram *prg, uint8_t *num_inputs, bool used_textures[2]) {
+    *num_inputs = prg->num_inputs;
+    used_textures[0] = prg->used_textures[0];
+    used_textures[1] = prg->used_textures[1];
+}
+
+static uint32_t gfx_null_new_texture(void) {
+    counters.textures_created++;
+    return ++texture_count;
+}
+
+static void gfx_null_select_texture(int tile, uint32_t texture_id) {
+    counters.texture_binds++;
+}
+
+static void gfx_null_upload_texture(const uint8_t *rgba32_buf, int width, int height) {
+    counters.texture_uploads++;
+    counters.texture_upload_bytes += (uint64_t)width * height * 4;
+}
+
+static void gfx_null_set_sampler_parameters(int tile, bool linear_filter, uint32_t cms, uint32_t cmt) {
+    counters.sampler_changes++;
+}
+
+static void gfx_null_set_depth_test(bool depth_test) {
+    counters.state_changes++;
+}
+
+static void gfx_null_set_depth_mask(bool z_upd) {
+    counters.state_changes++;
+}
+
+static void gfx_null_set_zmode_decal(bool zmode_decal) {
+    counters.state_changes++;
+}
+
+static void gfx_null_set_viewport(int x, int y, int width, int height) {
+    counters.state_changes++;
+}
+
+static void gfx_null_set_scissor(int x, int y, int width, int height) {
+    counters.state_changes++;
+}
+
+static void gfx_null_set_use_alpha(bool use_alpha) {
+    counters.state_changes++;
+}
+
+static void gfx_null_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_tris) {
+    counters.draw_calls++;
+    counters.triangles += buf_vbo_num_tris;
+    counters.vertex_bytes += buf_vbo_len * sizeof(float);
+}
+
+static void gfx_null_draw_triangles_indexed(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_verts, const uint16_t buf_ibo[], size_t buf_ibo_len) {
+    counters.draw_calls++;
+    counters.triangles += buf_ibo_len / 3;
+    counters.vertex_bytes += buf_vbo_len * sizeof(float) + buf_ibo_len * sizeof(uint16_t);
+}
+
+static bool gfx_null_supports_packed_vertices(void) {
+    return true;
+}
+
+static void gfx_null_upload_texture_region(const uint8_t *rgba32_buf, int x, int y, int width, int height) {
+    counters.texture_uploads++;
+    counters.texture_upload_bytes += (uint64_t)width * height * 4;
+}
+
+static bool gfx_null_supports_texture_arrays(void) {
+    return true;
+}
+
+static void gfx_null_select_texture_array(int tile, uint32_t texture_id) {
+    counters.texture_binds++;
+}
+
+static void gfx_null_allocate_texture_array(int width, int height, int layers) {
+}
+
+static void gfx_null_upload_texture_layer(const uint8_t *rgba32_buf, int width, int height, int layer) {
+    counters.texture_uploads++;
+    counters.texture_upload_bytes += (uint64_t)width * height * 4;
+}
+
+static bool gfx_null_supports_uber_shader(void) {
+    return true;
+}
+
+static void gfx_null_delete_texture(uint32_t texture_id) {
+    counters.textures_deleted++;
+}
+
+static void gfx_null_upload_index_texture(const uint8_t *index_buf, int width, int height) {
+    counters.texture_uploads++;
+    counters.texture_upload_bytes += (uint64_t)width * height;
+}
+
+static void gfx_null_select_palette(int tile, uint32_t texture_id, int width, int height) {
+    counters.texture_binds++;
+}
+
+static void gfx_null_upload_palette(const uint8_t *rgba32_buf) {
+    counters.texture_uploads++;
+    counters.texture_upload_bytes += 256 * 4;
+}
+
+static void gfx_null_upload_texture_format(const uint8_t *buf, int width, int height, enum GfxTextureFormat format) {
+    counters.texture_uploads++;
+    counters.texture_upload_bytes += (uint64_t)width * height * (format == GFX_TEXTURE_FORMAT_I8 ? 1 : 2);
+}
+
+static uint8_t *gfx_null_map_texture_staging(size_t size) {
+    if (size > staging_size) {
+        uint8_t *buf = realloc(staging_buf, size);
+        if (buf == NULL) {
+            return NULL;
+        }
+        staging_buf = buf;
+        staging_size = size;
+    }
+    return staging_buf;
+}
+
+static bool gfx_null_supports_texture_row_length(void) {
+    return true;
+}
+
+static void gfx_null_set_texture_row_length(int row_length) {
+}
+
+static void gfx_null_init(void) {
+}
+
+static void gfx_null_on_resize(void) {
+}
+
+static void gfx_null_start_frame(void) {
+    counters.frames++;
+}
+
+static void gfx_null_end_frame(void) {
+}
+
+static void gfx_null_finish_render(void) {
+}
+
+void gfx_null_get_counters(struct GfxNullCounters *out) {
+    *out = counters;
+}
+
+void gfx_null_reset_counters(void) {
+    memset(&counters, 0, sizeof(counters));
+}
+
+struct GfxRenderingAPI gfx_null_api = {
+    gfx_null_z_is_from_0_to_1,
+    gfx_null_unload_shader,
+    gfx_null_load_shader,
+    gfx_null_create_and_load_new_shader,
+    gfx_null_lookup_shader,
+    gfx_null_shader_get_info,
+    gfx_null_new_texture,
+    gfx_null_select_texture,
+    gfx_null_upload_texture,
+    gfx_null_set_sampler_parameters,
+    gfx_null_set_depth_test,
+    gfx_null_set_depth_mask,
+    gfx_null_set_zmode_decal,
+    gfx_null_set_viewport,
+    gfx_null_set_scissor,
+    gfx_null_set_use_alpha,
+    gfx_null_draw_triangles,
+    gfx_null_draw_triangles_indexed,
+    gfx_null_supports_packed_vertices,
+    gfx_null_upload_texture_region,
+    gfx_null_supports_texture_arrays,
+    gfx_null_select_texture_array,
+    gfx_null_allocate_texture_array,
+    gfx_null_upload_texture_layer,
+    gfx_null_supports_uber_shader,
+    gfx_null_delete_texture,
+    gfx_null_upload_index_texture,
+    gfx_null_select_palette,
+    gfx_null_upload_palette,
+    gfx_null_upload_texture_format,
+    gfx_null_map_texture_staging,
+    gfx_null_supports_texture_row_length,
+    gfx_null_set_texture_row_length,
+    gfx_null_init,
+    gfx_null_on_resize,
+    gfx_null_start_frame,
+    gfx_null_end_frame,
+    gfx_null_finish_render
+};
+
+static void gfx_null_wapi_init(const char *game_name, bool start_in_fullscreen) {
+}
+
+static void gfx_null_wapi_set_keyboard_callbacks(bool (*on_key_down)(int scancode), bool (*on_key_up)(int scancode), void (*on_all_keys_up)(void)) {
+}
+
+static void gfx_null_wapi_set_fullscreen_changed_callback(void (*on_fullscreen_changed)(bool is_now_fullscreen)) {
+}
+
+static void gfx_null_wapi_set_fullscreen(bool enable) {
+}
+
+static void gfx_null_wapi_main_loop(void (*run_one_game_iter)(void)) {
+    while (1) {
+        run_one_game_iter();
+    }
+}
+
+static void gfx_null_wapi_get_dimensions(uint32_t *width, uint32_t *height) {
+    *width = window_width;
+    *height = window_height;
+}
+
+static void gfx_null_wapi_handle_events(void) {
+}
+
+static bool gfx_null_wapi_start_frame(void) {
+    // Never drop frames, there is no display to keep up with
+    return true;
+}
+
+static void gfx_null_wapi_swap_buffers_begin(void) {
+}
+
+static void gfx_null_wapi_swap_buffers_end(void) {
+}
+
+static double gfx_null_wapi_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct GfxWindowManagerAPI gfx_null_wapi = {
+    gfx_null_wapi_init,
+    gfx_null_wapi_set_keyboard_callbacks,
+    gfx_null_wapi_set_fullscreen_changed_callback,
+    gfx_null_wapi_set_fullscreen,
+    gfx_null_wapi_main_loop,
+    gfx_null_wapi_get_dimensions,
+    gfx_null_wapi_handle_events,
+    gfx_null_wapi_start_frame,
+    gfx_null_wapi_swap_buffers_begin,
+    gfx_null_wapi_swap_buffers_end,
+    gfx_null_wapi_get_time
+};
@@ -0,0 +1,39 @@
+#ifndef GFX_NULL_H
+#define GFX_NULL_H
+
+#include <stdint.h>
+
+#include "gfx_rendering_api.h"
+#include "gfx_window_manager_api.h"
+
+struct GfxNullCounters {
+    uint64_t frames;
+    uint64_t draw_calls;
+    uint64_t triangles;
+    uint64_t vertex_bytes; // including index buffers
+    uint64_t shaders_created;
+    uint64_t shader_loads;
+    uint64_t textures_created;
+    uint64_t textures_deleted;
+    uint64_t texture_binds;
+    uint64_t texture_uploads;
+    uint64_t texture_upload_bytes;
+    uint64_t sampler_changes;
+    uint64_t state_changes; // depth test/mask, decal, viewport, scissor and blending
+};
+
+extern struct GfxRenderingAPI gfx_null_api;
+extern struct GfxWindowManagerAPI gfx_null_wapi;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void gfx_null_get_counters(struct GfxNullCounters *counters);
+void gfx_null_reset_counters(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifndef _LANGUAGE_C
 #define _LANGUAGE_C
@@ -28,27 +30,128 @@
 #include "gfx_cc.h"
 #include "gfx_rendering_api.h"
 
+#ifndef GL_TEXTURE_2D_ARRAY
+#define GL_TEXTURE_2D_ARRAY 0x8C1A
+#endif
+#ifndef GL_RED
+#define GL_RED 0x1903
+#endif
+#ifndef GL_RGB5_A1
+#define GL_RGB5_A1 0x8057
+#endif
+#ifndef GL_UNSIGNED_SHORT_5_5_5_1
+#define GL_UNSIGNED_SHORT_5_5_5_1 0x8034
+#endif
+#ifndef GL_RGBA8
+#define GL_RGBA8 0x8058
+#endif
+#ifndef GL_R8
+#define GL_R8 0x8229
+#endif
+#ifndef GL_UNPACK_ROW_LENGTH
+#define GL_UNPACK_ROW_LENGTH 0x0CF2
+#endif
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_INVALIDATE_RANGE_BIT
+#define GL_MAP_INVALIDATE_RANGE_BIT 0x0004
+#endif
+#ifndef GL_MAP_UNSYNCHRONIZED_BIT
+#define GL_MAP_UNSYNCHRONIZED_BIT 0x0020
+#endif
+
+typedef void (*TexImage3DFunc)(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLsizei depth, GLint border, GLenum format, GLenum type, const void *pixels);
+typedef void (*TexSubImage3DFunc)(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint zoffset, GLsizei width, GLsizei height, GLsizei depth, GLenum format, GLenum type, const void *pixels);
+typedef void (*TexStorage2DFunc)(GLenum target, GLsizei levels, GLenum internalformat, GLsizei width, GLsizei height);
+typedef void *(*MapBufferRangeFunc)(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+typedef GLboolean (*UnmapBufferFunc)(GLenum target);
+
+#define STAGING_BUFFER_SIZE (1 << 20)
+
 struct ShaderProgram {
-    uint32_t shader_id;
+    uint64_t shader_id;
     GLuint opengl_program_id;
     uint8_t num_inputs;
     bool used_textures[2];
-    uint8_t num_floats;
-    GLint attrib_locations[7];
-    uint8_t attrib_sizes[7];
+    uint8_t num_floats; // vertex stride in 32-bit words
+    GLint attrib_locations[10];
+    uint8_t attrib_sizes[10];
+    bool attrib_packed[10]; // a single UNORM8x4 word instead of attrib_sizes floats
     uint8_t num_attribs;
     bool used_noise;
     GLint frame_count_location;
     GLint window_height_location;
+    GLint index_texture_size_locations[2]; // -1 unless the shader filters palette textures
 };
 
 static struct ShaderProgram shader_program_pool[64];
 static uint8_t shader_program_pool_size;
 static GLuint opengl_vbo;
+static GLuint opengl_ibo;
 
+static struct ShaderProgram *current_program;
 static uint32_t frame_count;
 static uint32_t current_height;
 
+// GL_EXT_texture_array, loaded at init if available
+static TexImage3DFunc gl_tex_image_3d;
+static TexSubImage3DFunc gl_tex_sub_image_3d;
+static GLenum bound_target[2] = {GL_TEXTURE_2D, GL_TEXTURE_2D}; // per tile
+
+// Texture ids from new_texture are handles to GL textures, so that a texture
+// whose immutable storage doesn't fit an upload can be swapped for a new one
+struct TextureHandle {
+    GLuint name; // 0 if the handle is free
+    uint32_t next_free; // in the free list, 0 at its end
+    // Storage of the 2D texture, for uploads of the same size and format to reuse.
+    // The format and type of the last upload are compared too, as unsized
+    // internal formats of OpenGL ES 2 take them from the upload.
+    GLsizei width, height;
+    GLenum internal_format, format, type;
+    bool immutable;
+    // Sampler parameters, set again on a new GL texture
+    bool sampler_set;
+    GLint filter, wrap_s, wrap_t;
+};
+static struct TextureHandle *textures;
+static uint32_t textures_capacity;
+static uint32_t textures_count; // handles ever used, including 0
+static uint32_t free_textures; // released handles, reused first
+static uint32_t selected_texture; // by select_texture or select_palette, the target of uploads
+static uint32_t bound_texture[4]; // per texture unit: tiles, then their palettes
+static GLenum active_unit;
+
+// glTexStorage2D (OpenGL 4.2, GL_ARB_texture_storage or OpenGL ES 3), loaded at init if available
+static TexStorage2DFunc gl_tex_storage_2d;
+// GL_UNPACK_ROW_LENGTH, missing in OpenGL ES 2 without GL_EXT_unpack_subimage
+static bool unpack_row_length;
+
+// Staging memory for map_texture_staging, in a pixel buffer object used as a
+// ring: each upload takes the next range, and when the ring is full the
+// buffer's storage is orphaned, so that ranges are never written while the
+// GPU may still read them. Needs glMapBufferRange (OpenGL 3.0 or ES 3).
+static struct {
+    GLuint buffer;
+    MapBufferRangeFunc map_range;
+    UnmapBufferFunc unmap;
+    size_t offset;
+    uint8_t *mapped; // at offset, until the next upload
+} staging;
+
+// Index textures are GL_RED where supported (GL_ARB_texture_rg), otherwise GL_LUMINANCE.
+// Palettes are bound to texture units 2 and 3.
+static GLenum index_texture_format = GL_LUMINANCE;
+static float index_texture_size[2][2]; // per tile, of the texture selected with its palette
+
+// GFX_TEXTURE_FORMAT_RGBA5551 is stored as GL_RGB5_A1, except on OpenGL ES 2, which only
+// takes unsized internal formats. The intensity formats are GL_LUMINANCE(_ALPHA), which
+// sample as (I, I, I, 1) and (I, I, I, A) without texture swizzles.
+static GLint rgba5551_internal_format = GL_RGB5_A1;
+
 static bool gfx_opengl_z_is_from_0_to_1(void) {
     return false;
 }
@@ -59,8 +162,13 @@ static void gfx_opengl_vertex_array_set_attribs(struct ShaderProgram *prg) {
 
     for (int i = 0; i < prg->num_attribs; i++) {
         glEnableVertexAttribArray(prg->attrib_locations[i]);
-        glVertexAttribPointer(prg->attrib_locations[i], prg->attrib_sizes[i], GL_FLOAT, GL_FALSE, num_floats * sizeof(float), (void *) (pos * sizeof(float)));
-        pos += prg->attrib_sizes[i];
+        if (prg->attrib_packed[i]) {
+            glVertexAttribPointer(prg->attrib_locations[i], 4, GL_UNSIGNED_BYTE, GL_TRUE, num_floats * sizeof(float), (void *) (pos * sizeof(float)));
+            pos += 1;
+        } else {
+            glVertexAttribPointer(prg->attrib_locations[i], prg->attrib_sizes[i], GL_FLOAT, GL_FALSE, num_floats * sizeof(float), (void *) (pos * sizeof(float)));
+            pos += prg->attrib_sizes[i];
+        }
     }
 }
 
@@ -69,6 +177,11 @@ static void gfx_opengl_set_uniforms(struct ShaderProgram *prg) {
         glUniform1i(prg->frame_count_location, frame_count);
         glUniform1i(prg->window_height_location, current_height);
     }
+    for (int i = 0; i < 2; i++) {
+        if (prg->index_texture_size_locations[i] != -1) {
+            glUniform2f(prg->index_texture_size_locations[i], index_texture_size[i][0], index_texture_size[i][1]);
+        }
+    }
 }
 
 static void gfx_opengl_unload_shader(struct ShaderProgram *old_prg) {
@@ -83,6 +196,7 @@ static void gfx_opengl_load_shader(struct ShaderProgram *new_prg) {
     glUseProgram(new_prg->opengl_program_id);
     gfx_opengl_vertex_array_set_attribs(new_prg);
     gfx_opengl_set_uniforms(new_prg);
+    current_program = new_prg;
 }
 
 static void append_str(char *buf, size_t *len, const char *str) {
@@ -164,12 +278,12 @@ static void append_formula(char *buf, size_t *len, uint8_t c[2][4], bool do_sing
     }
 }
 
-static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shader_id) {
+static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint64_t shader_id) {
     struct CCFeatures cc_features;
     gfx_cc_get_features(shader_id, &cc_features);
 
-    char vs_buf[1024];
-    char fs_buf[1024];
+    char vs_buf[2048];
+    char fs_buf[8192];
     size_t vs_len = 0;
     size_t fs_len = 0;
     size_t num_floats = 4;
@@ -177,54 +291,198 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     // Vertex shader
     append_line(vs_buf, &vs_len, "#version 110");
     append_line(vs_buf, &vs_len, "attribute vec4 aVtxPos;");
+    bool use_atlas = cc_features.opt_texture_atlas && (cc_features.used_textures[0] || cc_features.used_textures[1]);
+    bool use_arrays = cc_features.opt_texture_arrays;
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
         append_line(vs_buf, &vs_len, "attribute vec2 aTexCoord;");
         append_line(vs_buf, &vs_len, "varying vec2 vTexCoord;");
         num_floats += 2;
     }
+    if (use_atlas) {
+        for (int i = 0; i < 2; i++) {
+            if (cc_features.used_textures[i]) {
+                vs_len += sprintf(vs_buf + vs_len, "attribute vec4 aTexRect%d;\n", i);
+                vs_len += sprintf(vs_buf + vs_len, "varying vec4 vTexRect%d;\n", i);
+                num_floats += 4;
+            }
+        }
+        append_line(vs_buf, &vs_len, "attribute vec3 aTexMode;");
+        append_line(vs_buf, &vs_len, "varying vec3 vTexMode;");
+        num_floats += 3;
+    }
+    if (use_arrays) {
+        for (int i = 0; i < 2; i++) {
+            if (cc_features.used_textures[i]) {
+                vs_len += sprintf(vs_buf + vs_len, "attribute float aTexLayer%d;\n", i);
+                vs_len += sprintf(vs_buf + vs_len, "varying float vTexLayer%d;\n", i);
+                num_floats += 1;
+            }
+        }
+    }
     if (cc_features.opt_fog) {
         append_line(vs_buf, &vs_len, "attribute vec4 aFog;");
         append_line(vs_buf, &vs_len, "varying vec4 vFog;");
-        num_floats += 4;
+        num_floats += cc_features.opt_packed_vertices ? 1 : 4;
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
         vs_len += sprintf(vs_buf + vs_len, "attribute vec%d aInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
         vs_len += sprintf(vs_buf + vs_len, "varying vec%d vInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
-        num_floats += cc_features.opt_alpha ? 4 : 3;
+        num_floats += cc_features.opt_packed_vertices ? 1 : cc_features.opt_alpha ? 4 : 3;
+    }
+    if (cc_features.opt_uber) {
+        append_line(vs_buf, &vs_len, "attribute vec4 aCombiner;");
+        append_line(vs_buf, &vs_len, "varying vec4 vCombiner;");
+        num_floats += 4;
     }
     append_line(vs_buf, &vs_len, "void main() {");
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
         append_line(vs_buf, &vs_len, "vTexCoord = aTexCoord;");
     }
+    if (use_atlas) {
+        for (int i = 0; i < 2; i++) {
+            if (cc_features.used_textures[i]) {
+                vs_len += sprintf(vs_buf + vs_len, "vTexRect%d = aTexRect%d;\n", i, i);
+            }
+        }
+        append_line(vs_buf, &vs_len, "vTexMode = aTexMode;");
+    }
+    if (use_arrays) {
+        for (int i = 0; i < 2; i++) {
+            if (cc_features.used_textures[i]) {
+                vs_len += sprintf(vs_buf + vs_len, "vTexLayer%d = aTexLayer%d;\n", i, i);
+            }
+        }
+    }
     if (cc_features.opt_fog) {
         append_line(vs_buf, &vs_len, "vFog = aFog;");
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
         vs_len += sprintf(vs_buf + vs_len, "vInput%d = aInput%d;\n", i + 1, i + 1);
     }
+    if (cc_features.opt_uber) {
+        append_line(vs_buf, &vs_len, "vCombiner = aCombiner;");
+    }
     append_line(vs_buf, &vs_len, "gl_Position = aVtxPos;");
     append_line(vs_buf, &vs_len, "}");
 
     // Fragment shader
     append_line(fs_buf, &fs_len, "#version 110");
+    if (use_arrays) {
+        append_line(fs_buf, &fs_len, "#extension GL_EXT_texture_array : require");
+    }
     //append_line(fs_buf, &fs_len, "precision mediump float;");
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
         append_line(fs_buf, &fs_len, "varying vec2 vTexCoord;");
     }
+    if (use_atlas) {
+        for (int i = 0; i < 2; i++) {
+            if (cc_features.used_textures[i]) {
+                fs_len += sprintf(fs_buf + fs_len, "varying vec4 vTexRect%d;\n", i);
+            }
+        }
+        append_line(fs_buf, &fs_len, "varying vec3 vTexMode;");
+    }
+    if (use_arrays) {
+        for (int i = 0; i < 2; i++) {
+            if (cc_features.used_textures[i]) {
+                fs_len += sprintf(fs_buf + fs_len, "varying float vTexLayer%d;\n", i);
+            }
+        }
+    }
     if (cc_features.opt_fog) {
         append_line(fs_buf, &fs_len, "varying vec4 vFog;");
     }
     for (int i = 0; i < cc_features.num_inputs; i++) {
         fs_len += sprintf(fs_buf + fs_len, "varying vec%d vInput%d;\n", cc_features.opt_alpha ? 4 : 3, i + 1);
     }
+    if (cc_features.opt_uber) {
+        append_line(fs_buf, &fs_len, "varying vec4 vCombiner;");
+    }
     if (cc_features.used_textures[0]) {
-        append_line(fs_buf, &fs_len, "uniform sampler2D uTex0;");
+        append_line(fs_buf, &fs_len, use_arrays ? "uniform sampler2DArray uTex0;" : "uniform sampler2D uTex0;");
     }
     if (cc_features.used_textures[1]) {
-        append_line(fs_buf, &fs_len, "uniform sampler2D uTex1;");
+        append_line(fs_buf, &fs_len, use_arrays ? "uniform sampler2DArray uTex1;" : "uniform sampler2D uTex1;");
+    }
+    bool use_palettes = false;
+    for (int i = 0; i < 2; i++) {
+        if (cc_features.used_textures[i] && cc_features.opt_palette[i]) {
+            fs_len += sprintf(fs_buf + fs_len, "uniform sampler2D uPalette%d;\n", i);
+            if (cc_features.opt_palette_linear) {
+                fs_len += sprintf(fs_buf + fs_len, "uniform vec2 uIndexTextureSize%d;\n", i);
+            }
+            use_palettes = true;
+        }
     }
 
-    if (cc_features.opt_alpha && cc_features.opt_noise) {
+    if (use_palettes) {
+        // Index i is stored as i / 255, and its entry is at (i + 0.5) / 256
+        append_line(fs_buf, &fs_len, "vec4 paletteFetch(sampler2D tex, sampler2D palette, vec2 uv) {");
+        append_line(fs_buf, &fs_len, "    return texture2D(palette, vec2((texture2D(tex, uv).r * 255.0 + 0.5) / 256.0, 0.5));");
+        append_line(fs_buf, &fs_len, "}");
+    }
+    if (use_palettes && cc_features.opt_palette_linear) {
+        // Bilinear filtering of the looked up colors, with wrapping left to the sampler
+        append_line(fs_buf, &fs_len, "vec4 paletteSample(sampler2D tex, sampler2D palette, vec2 uv, vec2 size) {");
+        append_line(fs_buf, &fs_len, "    vec2 t = uv * size - 0.5;");
+        append_line(fs_buf, &fs_len, "    vec2 i = floor(t);");
+        append_line(fs_buf, &fs_len, "    vec2 f = t - i;");
+        append_line(fs_buf, &fs_len, "    vec2 p = (i + 0.5) / size;");
+        append_line(fs_buf, &fs_len, "    vec2 d = 1.0 / size;");
+        append_line(fs_buf, &fs_len, "    vec4 top = mix(paletteFetch(tex, palette, p), paletteFetch(tex, palette, p + vec2(d.x, 0.0)), f.x);");
+        append_line(fs_buf, &fs_len, "    vec4 bottom = mix(paletteFetch(tex, palette, p + vec2(0.0, d.y)), paletteFetch(tex, palette, p + d), f.x);");
+        append_line(fs_buf, &fs_len, "    return mix(top, bottom, f.y);");
+        append_line(fs_buf, &fs_len, "}");
+    }
+
+    if (use_atlas) {
+        // Texel index wrapping like GL_REPEAT, GL_MIRRORED_REPEAT and GL_CLAMP_TO_EDGE.
+        // The + 0.5 keeps floor exact for integer indices.
+        append_line(fs_buf, &fs_len, "float atlasWrap(float i, float size, float mode) {");
+        append_line(fs_buf, &fs_len, "    if (mode >= 2.0) return clamp(i, 0.0, size - 1.0);");
+        append_line(fs_buf, &fs_len, "    if (mode == 1.0) {");
+        append_line(fs_buf, &fs_len, "        i -= 2.0 * size * floor((i + 0.5) / (2.0 * size));");
+        append_line(fs_buf, &fs_len, "        return i < size ? i : 2.0 * size - 1.0 - i;");
+        append_line(fs_buf, &fs_len, "    }");
+        append_line(fs_buf, &fs_len, "    return i - size * floor((i + 0.5) / size);");
+        append_line(fs_buf, &fs_len, "}");
+        append_line(fs_buf, &fs_len, "vec4 atlasFetch(sampler2D tex, vec4 rect, vec3 mode, float x, float y) {");
+        append_line(fs_buf, &fs_len, "    vec2 i = vec2(atlasWrap(x, rect.z, mode.x), atlasWrap(y, rect.w, mode.y));");
+        fs_len += sprintf(fs_buf + fs_len, "    return texture2D(tex, (rect.xy + i + 0.5) / %d.0);\n", GFX_TEXTURE_ATLAS_SIZE);
+        append_line(fs_buf, &fs_len, "}");
+        append_line(fs_buf, &fs_len, "vec4 atlasSample(sampler2D tex, vec2 uv, vec4 rect, vec3 mode) {");
+        // Interpolating equal values may not give exactly the same value
+        append_line(fs_buf, &fs_len, "    rect = floor(rect + 0.5);");
+        append_line(fs_buf, &fs_len, "    mode = floor(mode + 0.5);");
+        append_line(fs_buf, &fs_len, "    vec2 t = uv * rect.zw;");
+        append_line(fs_buf, &fs_len, "    if (mode.z == 0.0) return atlasFetch(tex, rect, mode, floor(t.x), floor(t.y));");
+        append_line(fs_buf, &fs_len, "    t -= 0.5;");
+        append_line(fs_buf, &fs_len, "    vec2 i = floor(t);");
+        append_line(fs_buf, &fs_len, "    vec2 f = t - i;");
+        append_line(fs_buf, &fs_len, "    vec4 top = mix(atlasFetch(tex, rect, mode, i.x, i.y), atlasFetch(tex, rect, mode, i.x + 1.0, i.y), f.x);");
+        append_line(fs_buf, &fs_len, "    vec4 bottom = mix(atlasFetch(tex, rect, mode, i.x, i.y + 1.0), atlasFetch(tex, rect, mode, i.x + 1.0, i.y + 1.0), f.x);");
+        append_line(fs_buf, &fs_len, "    return mix(top, bottom, f.y);");
+        append_line(fs_buf, &fs_len, "}");
+    }
+
+    if (cc_features.opt_uber) {
+        // Combiner inputs by CC_* value, with vInput1-3 the prim, shade and env color
+        append_line(fs_buf, &fs_len, "vec4 ccInput(float sel, vec4 texVal0, vec4 texVal1, float lod) {");
+        append_line(fs_buf, &fs_len, "    if (sel < 0.5) return vec4(0.0);");
+        append_line(fs_buf, &fs_len, "    if (sel < 1.5) return texVal0;");
+        append_line(fs_buf, &fs_len, "    if (sel < 2.5) return texVal1;");
+        append_line(fs_buf, &fs_len, "    if (sel < 3.5) return vInput1;");
+        append_line(fs_buf, &fs_len, "    if (sel < 4.5) return vInput2;");
+        append_line(fs_buf, &fs_len, "    if (sel < 5.5) return vInput3;");
+        append_line(fs_buf, &fs_len, "    if (sel < 6.5) return vec4(texVal0.a);");
+        append_line(fs_buf, &fs_len, "    return vec4(lod);");
+        append_line(fs_buf, &fs_len, "}");
+        append_line(fs_buf, &fs_len, "vec4 ccEval(vec4 sel, vec4 texVal0, vec4 texVal1, float lod) {");
+        append_line(fs_buf, &fs_len, "    return (ccInput(sel.x, texVal0, texVal1, lod) - ccInput(sel.y, texVal0, texVal1, lod)) * ccInput(sel.z, texVal0, texVal1, lod) + ccInput(sel.w, texVal0, texVal1, lod);");
+        append_line(fs_buf, &fs_len, "}");
+    }
+
+    if ((cc_features.opt_alpha && cc_features.opt_noise) || cc_features.opt_uber) {
         append_line(fs_buf, &fs_len, "uniform int frame_count;");
         append_line(fs_buf, &fs_len, "uniform int window_height;");
 
@@ -236,24 +494,57 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
 
     append_line(fs_buf, &fs_len, "void main() {");
 
-    if (cc_features.used_textures[0]) {
-        append_line(fs_buf, &fs_len, "vec4 texVal0 = texture2D(uTex0, vTexCoord);");
+    if (cc_features.opt_uber) {
+        // Interpolating equal values may not give exactly the same value
+        append_line(fs_buf, &fs_len, "vec3 combiner = floor(vCombiner.xyz + 0.5);");
+        append_line(fs_buf, &fs_len, "vec4 ccColor = mod(floor(combiner.x / vec4(1.0, 8.0, 64.0, 512.0)), 8.0);");
+        append_line(fs_buf, &fs_len, "vec4 ccAlpha = mod(floor(combiner.y / vec4(1.0, 8.0, 64.0, 512.0)), 8.0);");
+        append_line(fs_buf, &fs_len, "vec3 ccOpts = mod(floor(combiner.z / vec3(1.0, 2.0, 4.0)), 2.0);");
+        // Only sample the textures the combiner uses (CC_TEXEL0, CC_TEXEL0A and CC_TEXEL1)
+        append_line(fs_buf, &fs_len, "bool useTex0 = any(equal(ccColor, vec4(1.0))) || any(equal(ccColor, vec4(6.0))) || any(equal(ccAlpha, vec4(1.0))) || any(equal(ccAlpha, vec4(6.0)));");
+        append_line(fs_buf, &fs_len, "bool useTex1 = any(equal(ccColor, vec4(2.0))) || any(equal(ccAlpha, vec4(2.0)));");
     }
-    if (cc_features.used_textures[1]) {
-        append_line(fs_buf, &fs_len, "vec4 texVal1 = texture2D(uTex1, vTexCoord);");
+    for (int i = 0; i < 2; i++) {
+        if (!cc_features.used_textures[i]) {
+            continue;
+        }
+        char sample[96];
+        if (use_atlas) {
+            sprintf(sample, "atlasSample(uTex%d, vTexCoord, vTexRect%d, vTexMode)", i, i);
+        } else if (use_arrays) {
+            // The layer is rounded to the nearest integer by the lookup
+            sprintf(sample, "texture2DArray(uTex%d, vec3(vTexCoord, vTexLayer%d))", i, i);
+        } else if (cc_features.opt_palette[i] && cc_features.opt_palette_linear) {
+            sprintf(sample, "paletteSample(uTex%d, uPalette%d, vTexCoord, uIndexTextureSize%d)", i, i, i);
+        } else if (cc_features.opt_palette[i]) {
+            sprintf(sample, "paletteFetch(uTex%d, uPalette%d, vTexCoord)", i, i);
+        } else {
+            sprintf(sample, "texture2D(uTex%d, vTexCoord)", i);
+        }
+        if (cc_features.opt_uber) {
+            fs_len += sprintf(fs_buf + fs_len, "vec4 texVal%d = vec4(0.0);\n", i);
+            fs_len += sprintf(fs_buf + fs_len, "if (useTex%d) texVal%d = %s;\n", i, i, sample);
+        } else {
+            fs_len += sprintf(fs_buf + fs_len, "vec4 texVal%d = %s;\n", i, sample);
+        }
     }
 
-    append_str(fs_buf, &fs_len, cc_features.opt_alpha ? "vec4 texel = " : "vec3 texel = ");
-    if (!cc_features.color_alpha_same && cc_features.opt_alpha) {
-        append_str(fs_buf, &fs_len, "vec4(");
-        append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[0], cc_features.do_multiply[0], cc_features.do_mix[0], false, false, true);
-        append_str(fs_buf, &fs_len, ", ");
-        append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[1], cc_features.do_multiply[1], cc_features.do_mix[1], true, true, true);
-        append_str(fs_buf, &fs_len, ")");
+    if (cc_features.opt_uber) {
+        append_line(fs_buf, &fs_len, "vec4 texel = vec4(ccEval(ccColor, texVal0, texVal1, vCombiner.w).rgb, ccEval(ccAlpha, texVal0, texVal1, vCombiner.w).a);");
+        append_line(fs_buf, &fs_len, "if (ccOpts.y != 0.0) { if (texel.a > 0.3) texel.a = 1.0; else discard; }");
     } else {
-        append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[0], cc_features.do_multiply[0], cc_features.do_mix[0], cc_features.opt_alpha, false, cc_features.opt_alpha);
+        append_str(fs_buf, &fs_len, cc_features.opt_alpha ? "vec4 texel = " : "vec3 texel = ");
+        if (!cc_features.color_alpha_same && cc_features.opt_alpha) {
+            append_str(fs_buf, &fs_len, "vec4(");
+            append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[0], cc_features.do_multiply[0], cc_features.do_mix[0], false, false, true);
+            append_str(fs_buf, &fs_len, ", ");
+            append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[1], cc_features.do_multiply[1], cc_features.do_mix[1], true, true, true);
+            append_str(fs_buf, &fs_len, ")");
+        } else {
+            append_formula(fs_buf, &fs_len, cc_features.c, cc_features.do_single[0], cc_features.do_multiply[0], cc_features.do_mix[0], cc_features.opt_alpha, false, cc_features.opt_alpha);
+        }
+        append_line(fs_buf, &fs_len, ";");
     }
-    append_line(fs_buf, &fs_len, ";");
 
     if (cc_features.opt_texture_edge && cc_features.opt_alpha) {
         append_line(fs_buf, &fs_len, "if (texel.a > 0.3) texel.a = 1.0; else discard;");
@@ -270,6 +561,10 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     if (cc_features.opt_alpha && cc_features.opt_noise) {
         append_line(fs_buf, &fs_len, "texel.a *= floor(clamp(random(vec3(floor(gl_FragCoord.xy * (240.0 / float(window_height))), float(frame_count))) + texel.a, 0.0, 1.0));");
     }
+    if (cc_features.opt_uber) {
+        append_line(fs_buf, &fs_len, "if (ccOpts.z != 0.0) texel.a *= floor(clamp(random(vec3(floor(gl_FragCoord.xy * (240.0 / float(window_height))), float(frame_count))) + texel.a, 0.0, 1.0));");
+        append_line(fs_buf, &fs_len, "if (ccOpts.x == 0.0) texel.a = 1.0;");
+    }
 
     if (cc_features.opt_alpha) {
         append_line(fs_buf, &fs_len, "gl_FragColor = texel;");
@@ -329,17 +624,50 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     struct ShaderProgram *prg = &shader_program_pool[shader_program_pool_size++];
     prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aVtxPos");
     prg->attrib_sizes[cnt] = 4;
+    prg->attrib_packed[cnt] = false;
     ++cnt;
 
     if (cc_features.used_textures[0] || cc_features.used_textures[1]) {
         prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aTexCoord");
         prg->attrib_sizes[cnt] = 2;
+        prg->attrib_packed[cnt] = false;
+        ++cnt;
+    }
+
+    if (use_atlas) {
+        for (int i = 0; i < 2; i++) {
+            if (cc_features.used_textures[i]) {
+                char name[16];
+                sprintf(name, "aTexRect%d", i);
+                prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, name);
+                prg->attrib_sizes[cnt] = 4;
+                prg->attrib_packed[cnt] = false;
+                ++cnt;
+            }
+        }
+        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aTexMode");
+        prg->attrib_sizes[cnt] = 3;
+        prg->attrib_packed[cnt] = false;
         ++cnt;
     }
 
+    if (use_arrays) {
+        for (int i = 0; i < 2; i++) {
+            if (cc_features.used_textures[i]) {
+                char name[16];
+                sprintf(name, "aTexLayer%d", i);
+                prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, name);
+                prg->attrib_sizes[cnt] = 1;
+                prg->attrib_packed[cnt] = false;
+                ++cnt;
+            }
+        }
+    }
+
     if (cc_features.opt_fog) {
         prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aFog");
         prg->attrib_sizes[cnt] = 4;
+        prg->attrib_packed[cnt] = cc_features.opt_packed_vertices;
         ++cnt;
     }
 
@@ -348,6 +676,14 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
         sprintf(name, "aInput%d", i + 1);
         prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, name);
         prg->attrib_sizes[cnt] = cc_features.opt_alpha ? 4 : 3;
+        prg->attrib_packed[cnt] = cc_features.opt_packed_vertices;
+        ++cnt;
+    }
+
+    if (cc_features.opt_uber) {
+        prg->attrib_locations[cnt] = glGetAttribLocation(shader_program, "aCombiner");
+        prg->attrib_sizes[cnt] = 4;
+        prg->attrib_packed[cnt] = false;
         ++cnt;
     }
 
@@ -359,6 +695,24 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
     prg->num_floats = num_floats;
     prg->num_attribs = cnt;
 
+    // Uniform locations are needed by gfx_opengl_load_shader
+    if ((cc_features.opt_alpha && cc_features.opt_noise) || cc_features.opt_uber) {
+        prg->frame_count_location = glGetUniformLocation(shader_program, "frame_count");
+        prg->window_height_location = glGetUniformLocation(shader_program, "window_height");
+        prg->used_noise = true;
+    } else {
+        prg->used_noise = false;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (cc_features.used_textures[i] && cc_features.opt_palette[i] && cc_features.opt_palette_linear) {
+            char name[24];
+            sprintf(name, "uIndexTextureSize%d", i);
+            prg->index_texture_size_locations[i] = glGetUniformLocation(shader_program, name);
+        } else {
+            prg->index_texture_size_locations[i] = -1;
+        }
+    }
+
     gfx_opengl_load_shader(prg);
 
     if (cc_features.used_textures[0]) {
@@ -369,19 +723,20 @@ static struct ShaderProgram *gfx_opengl_create_and_load_new_shader(uint32_t shad
         GLint sampler_location = glGetUniformLocation(shader_program, "uTex1");
         glUniform1i(sampler_location, 1);
     }
-
-    if (cc_features.opt_alpha && cc_features.opt_noise) {
-        prg->frame_count_location = glGetUniformLocation(shader_program, "frame_count");
-        prg->window_height_location = glGetUniformLocation(shader_program, "window_height");
-        prg->used_noise = true;
-    } else {
-        prg->used_noise = false;
+    for (int i = 0; i < 2; i++) {
+        if (cc_features.used_textures[i] && cc_features.opt_palette[i]) {
+            char name[16];
+            sprintf(name, "uPalette%d", i);
+            GLint sampler_location = glGetUniformLocation(shader_program, name);
+            glUniform1i(sampler_location, 2 + i);
+        }
     }
 
+
     return prg;
 }
 
-static struct ShaderProgram *gfx_opengl_lookup_shader(uint32_t shader_id) {
+static struct ShaderProgram *gfx_opengl_lookup_shader(uint64_t shader_id) {
     for (size_t i = 0; i < shader_program_pool_size; i++) {
         if (shader_program_pool[i].shader_id == shader_id) {
             return &shader_program_pool[i];
@@ -396,19 +751,160 @@ static void gfx_opengl_shader_get_info(struct ShaderProgram *prg, uint8_t *num_i
     used_textures[1] = prg->used_textures[1];
 }
 
+static void gfx_opengl_active_unit(GLenum unit) {
+    if (unit != active_unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        active_unit = unit;
+    }
+}
+
 static GLuint gfx_opengl_new_texture(void) {
-    GLuint ret;
-    glGenTextures(1, &ret);
-    return ret;
+    uint32_t handle = free_textures;
+    if (handle != 0) {
+        free_textures = textures[handle].next_free;
+    } else {
+        handle = textures_count++;
+    }
+    if (handle == textures_capacity) {
+        uint32_t capacity = textures_capacity * 2;
+        textures = realloc(textures, capacity * sizeof(struct TextureHandle));
+        memset(&textures[textures_capacity], 0, (capacity - textures_capacity) * sizeof(struct TextureHandle));
+        textures_capacity = capacity;
+    }
+    memset(&textures[handle], 0, sizeof(struct TextureHandle));
+    glGenTextures(1, &textures[handle].name);
+    return handle;
 }
 
 static void gfx_opengl_select_texture(int tile, GLuint texture_id) {
-    glActiveTexture(GL_TEXTURE0 + tile);
-    glBindTexture(GL_TEXTURE_2D, texture_id);
+    gfx_opengl_active_unit(tile);
+    glBindTexture(GL_TEXTURE_2D, textures[texture_id].name);
+    bound_target[tile] = GL_TEXTURE_2D;
+    bound_texture[tile] = texture_id;
+    selected_texture = texture_id;
+}
+
+// Replaces the GL texture of the selected handle, whose storage is immutable
+static void gfx_opengl_replace_texture(void) {
+    struct TextureHandle *tex = &textures[selected_texture];
+    GLuint old_name = tex->name;
+    glGenTextures(1, &tex->name);
+    glDeleteTextures(1, &old_name);
+    GLenum unit = active_unit;
+    for (int i = 0; i < 4; i++) {
+        // Bindings of the old texture reverted to 0 when it was deleted
+        if (bound_texture[i] == selected_texture) {
+            gfx_opengl_active_unit(i);
+            glBindTexture(GL_TEXTURE_2D, tex->name);
+        }
+    }
+    gfx_opengl_active_unit(unit);
+    if (tex->sampler_set) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, tex->filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, tex->filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, tex->wrap_s);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, tex->wrap_t);
+    }
+    tex->immutable = false;
+    tex->width = 0;
+    tex->height = 0;
+}
+
+static uint8_t *gfx_opengl_map_texture_staging(size_t size) {
+    if (staging.buffer == 0 || size > STAGING_BUFFER_SIZE) {
+        return NULL;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.buffer);
+    if (staging.mapped != NULL) {
+        // Not uploaded from
+        staging.unmap(GL_PIXEL_UNPACK_BUFFER);
+    }
+    if (staging.offset + size > STAGING_BUFFER_SIZE) {
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, STAGING_BUFFER_SIZE, NULL, GL_STREAM_DRAW);
+        staging.offset = 0;
+    }
+    staging.mapped = staging.map_range(GL_PIXEL_UNPACK_BUFFER, staging.offset, size,
+                                       GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return staging.mapped;
+}
+
+// Uploads texels to the selected texture, reusing its storage if it has the same
+// size and format. sized_format is 0 for formats without immutable storage.
+static void gfx_opengl_tex_image(GLenum sized_format, GLint internal_format, int width, int height, GLenum format, GLenum type, const uint8_t *buf, size_t size) {
+    struct TextureHandle *tex = &textures[selected_texture];
+    const void *pixels = buf;
+    bool from_staging = false;
+    if (staging.mapped != NULL) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.buffer);
+        staging.unmap(GL_PIXEL_UNPACK_BUFFER);
+        if (buf == staging.mapped) {
+            // The texels are read from the buffer, at the offset they were written to
+            pixels = (const void *)(uintptr_t)staging.offset;
+            staging.offset = (staging.offset + size + 15) & ~(size_t)15;
+            from_staging = true;
+        } else {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+        staging.mapped = NULL;
+    }
+    if (tex->width == width && tex->height == height && tex->internal_format == (GLenum)internal_format && tex->format == format && tex->type == type) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, pixels);
+    } else {
+        if (tex->immutable) {
+            gfx_opengl_replace_texture();
+        }
+        if (gl_tex_storage_2d != NULL && sized_format != 0) {
+            gl_tex_storage_2d(GL_TEXTURE_2D, 1, sized_format, width, height);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, pixels);
+            tex->immutable = true;
+        } else {
+            glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, pixels);
+        }
+        tex->width = width;
+        tex->height = height;
+        tex->internal_format = internal_format;
+        tex->format = format;
+        tex->type = type;
+    }
+    if (from_staging) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
 }
 
 static void gfx_opengl_upload_texture(const uint8_t *rgba32_buf, int width, int height) {
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba32_buf);
+    gfx_opengl_tex_image(GL_RGBA8, GL_RGBA, width, height, GL_RGBA, GL_UNSIGNED_BYTE, rgba32_buf, (size_t)width * height * 4);
+}
+
+static void gfx_opengl_upload_texture_region(const uint8_t *rgba32_buf, int x, int y, int width, int height) {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, rgba32_buf);
+}
+
+static bool gfx_opengl_supports_texture_row_length(void) {
+    return unpack_row_length;
+}
+
+static void gfx_opengl_set_texture_row_length(int row_length) {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+}
+
+static bool gfx_opengl_supports_texture_arrays(void) {
+    return gl_tex_image_3d != NULL && gl_tex_sub_image_3d != NULL;
+}
+
+static void gfx_opengl_select_texture_array(int tile, uint32_t texture_id) {
+    gfx_opengl_active_unit(tile);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textures[texture_id].name);
+    bound_target[tile] = GL_TEXTURE_2D_ARRAY;
+    bound_texture[tile] = texture_id;
+}
+
+static void gfx_opengl_allocate_texture_array(int width, int height, int layers) {
+    gl_tex_image_3d(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, width, height, layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+}
+
+static void gfx_opengl_upload_texture_layer(const uint8_t *rgba32_buf, int width, int height, int layer) {
+    gl_tex_sub_image_3d(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, rgba32_buf);
 }
 
 static uint32_t gfx_cm_to_opengl(uint32_t val) {
@@ -419,11 +915,17 @@ static uint32_t gfx_cm_to_opengl(uint32_t val) {
 }
 
 static void gfx_opengl_set_sampler_parameters(int tile, bool linear_filter, uint32_t cms, uint32_t cmt) {
-    glActiveTexture(GL_TEXTURE0 + tile);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, linear_filter ? GL_LINEAR : GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, linear_filter ? GL_LINEAR : GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, gfx_cm_to_opengl(cms));
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, gfx_cm_to_opengl(cmt));
+    GLenum target = bound_target[tile];
+    struct TextureHandle *tex = &textures[bound_texture[tile]];
+    tex->sampler_set = true;
+    tex->filter = linear_filter ? GL_LINEAR : GL_NEAREST;
+    tex->wrap_s = gfx_cm_to_opengl(cms);
+    tex->wrap_t = gfx_cm_to_opengl(cmt);
+    gfx_opengl_active_unit(tile);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, tex->filter);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, tex->filter);
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, tex->wrap_s);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, tex->wrap_t);
 }
 
 static void gfx_opengl_set_depth_test(bool depth_test) {
@@ -451,6 +953,10 @@ static void gfx_opengl_set_zmode_decal(bool zmode_decal) {
 static void gfx_opengl_set_viewport(int x, int y, int width, int height) {
     glViewport(x, y, width, height);
     current_height = height;
+    if (current_program != NULL) {
+        // The uber shader stays loaded across frames and viewports
+        gfx_opengl_set_uniforms(current_program);
+    }
 }
 
 static void gfx_opengl_set_scissor(int x, int y, int width, int height) {
@@ -471,6 +977,73 @@ static void gfx_opengl_draw_triangles(float buf_vbo[], size_t buf_vbo_len, size_
     glDrawArrays(GL_TRIANGLES, 0, 3 * buf_vbo_num_tris);
 }
 
+static void gfx_opengl_draw_triangles_indexed(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_verts, const uint16_t buf_ibo[], size_t buf_ibo_len) {
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * buf_vbo_len, buf_vbo, GL_STREAM_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16_t) * buf_ibo_len, buf_ibo, GL_STREAM_DRAW);
+    glDrawElements(GL_TRIANGLES, buf_ibo_len, GL_UNSIGNED_SHORT, 0);
+}
+
+static bool gfx_opengl_supports_packed_vertices(void) {
+    return true;
+}
+
+static bool gfx_opengl_supports_uber_shader(void) {
+    return true;
+}
+
+static void gfx_opengl_delete_texture(GLuint texture_id) {
+    glDeleteTextures(1, &textures[texture_id].name);
+    textures[texture_id].name = 0;
+    textures[texture_id].next_free = free_textures;
+    free_textures = texture_id;
+    for (int i = 0; i < 4; i++) {
+        if (bound_texture[i] == texture_id) {
+            bound_texture[i] = 0;
+        }
+    }
+}
+
+static void gfx_opengl_upload_index_texture(const uint8_t *index_buf, int width, int height) {
+    // Luminance formats have no immutable storage on desktop OpenGL
+    GLenum sized_format = index_texture_format == GL_RED ? GL_R8 : 0;
+    gfx_opengl_tex_image(sized_format, index_texture_format, width, height, index_texture_format, GL_UNSIGNED_BYTE, index_buf, (size_t)width * height);
+}
+
+static void gfx_opengl_upload_texture_format(const uint8_t *buf, int width, int height, enum GfxTextureFormat format) {
+    switch (format) {
+        case GFX_TEXTURE_FORMAT_RGBA5551:
+            gfx_opengl_tex_image(rgba5551_internal_format == GL_RGB5_A1 ? GL_RGB5_A1 : 0, rgba5551_internal_format, width, height,
+                                 GL_RGBA, GL_UNSIGNED_SHORT_5_5_5_1, buf, (size_t)width * height * 2);
+            break;
+        case GFX_TEXTURE_FORMAT_IA88:
+            gfx_opengl_tex_image(0, GL_LUMINANCE_ALPHA, width, height, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, buf, (size_t)width * height * 2);
+            break;
+        case GFX_TEXTURE_FORMAT_I8:
+            gfx_opengl_tex_image(0, GL_LUMINANCE, width, height, GL_LUMINANCE, GL_UNSIGNED_BYTE, buf, (size_t)width * height);
+            break;
+    }
+}
+
+static void gfx_opengl_select_palette(int tile, GLuint texture_id, int width, int height) {
+    gfx_opengl_active_unit(2 + tile);
+    glBindTexture(GL_TEXTURE_2D, textures[texture_id].name);
+    bound_texture[2 + tile] = texture_id;
+    selected_texture = texture_id;
+    index_texture_size[tile][0] = width;
+    index_texture_size[tile][1] = height;
+    if (current_program != NULL) {
+        gfx_opengl_set_uniforms(current_program);
+    }
+}
+
+static void gfx_opengl_upload_palette(const uint8_t *rgba32_buf) {
+    gfx_opengl_tex_image(GL_RGBA8, GL_RGBA, 256, 1, GL_RGBA, GL_UNSIGNED_BYTE, rgba32_buf, 256 * 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
 static void gfx_opengl_init(void) {
 #if FOR_WINDOWS
     glewInit();
@@ -480,8 +1053,50 @@ static void gfx_opengl_init(void) {
     
     glBindBuffer(GL_ARRAY_BUFFER, opengl_vbo);
     
+    glGenBuffers(1, &opengl_ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, opengl_ibo);
+    
     glDepthFunc(GL_LEQUAL);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // rows of index and intensity textures may be any number of bytes
+    
+    const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+    if (extensions != NULL && strstr(extensions, "GL_EXT_texture_array") != NULL) {
+        gl_tex_image_3d = (TexImage3DFunc)SDL_GL_GetProcAddress("glTexImage3D");
+        gl_tex_sub_image_3d = (TexSubImage3DFunc)SDL_GL_GetProcAddress("glTexSubImage3D");
+    }
+    if (extensions != NULL && (strstr(extensions, "GL_ARB_texture_rg") != NULL || strstr(extensions, "GL_EXT_texture_rg") != NULL)) {
+        index_texture_format = GL_RED;
+    }
+    const char *version = (const char *)glGetString(GL_VERSION);
+    if (version != NULL && strncmp(version, "OpenGL ES 2", 11) == 0) {
+        rgba5551_internal_format = GL_RGBA;
+    }
+    // Handle 0 stands for no texture, for sampler parameters set before one is
+    // selected, so it is never handed out
+    textures_capacity = 1024;
+    textures = calloc(textures_capacity, sizeof(struct TextureHandle));
+    textures_count = 1;
+    free_textures = 0;
+
+    bool gles = version != NULL && strncmp(version, "OpenGL ES ", 10) == 0;
+    int major = version != NULL ? atoi(gles ? version + 10 : version) : 0;
+    const char *minor_str = version != NULL ? strchr(version, '.') : NULL;
+    int minor = minor_str != NULL ? atoi(minor_str + 1) : 0;
+    if (gles ? major >= 3 : major > 4 || (major == 4 && minor >= 2) || (extensions != NULL && strstr(extensions, "GL_ARB_texture_storage") != NULL)) {
+        gl_tex_storage_2d = (TexStorage2DFunc)SDL_GL_GetProcAddress("glTexStorage2D");
+    }
+    unpack_row_length = !gles || major >= 3 || (extensions != NULL && strstr(extensions, "GL_EXT_unpack_subimage") != NULL);
+    if (major >= 3) {
+        staging.map_range = (MapBufferRangeFunc)SDL_GL_GetProcAddress("glMapBufferRange");
+        staging.unmap = (UnmapBufferFunc)SDL_GL_GetProcAddress("glUnmapBuffer");
+    }
+    if (staging.map_range != NULL && staging.unmap != NULL) {
+        glGenBuffers(1, &staging.buffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.buffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, STAGING_BUFFER_SIZE, NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
 }
 
 static void gfx_opengl_on_resize(void) {
@@ -489,6 +1104,9 @@ static void gfx_opengl_on_resize(void) {
 
 static void gfx_opengl_start_frame(void) {
     frame_count++;
+    if (current_program != NULL) {
+        gfx_opengl_set_uniforms(current_program);
+    }
 
     glDisable(GL_SCISSOR_TEST);
     glDepthMask(GL_TRUE); // Must be set to clear Z-buffer
@@ -498,6 +1116,12 @@ static void gfx_opengl_start_frame(void) {
 }
 
 static void gfx_opengl_end_frame(void) {
+    if (staging.mapped != NULL) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.buffer);
+        staging.unmap(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        staging.mapped = NULL;
+    }
 }
 
 static void gfx_opengl_finish_render(void) {
@@ -521,6 +1145,22 @@ struct GfxRenderingAPI gfx_opengl_api = {
     gfx_opengl_set_scissor,
     gfx_opengl_set_use_alpha,
     gfx_opengl_draw_triangles,
+    gfx_opengl_draw_triangles_indexed,
+    gfx_opengl_supports_packed_vertices,
+    gfx_opengl_upload_texture_region,
+    gfx_opengl_supports_texture_arrays,
+    gfx_opengl_select_texture_array,
+    gfx_opengl_allocate_texture_array,
+    gfx_opengl_upload_texture_layer,
+    gfx_opengl_supports_uber_shader,
+    gfx_opengl_delete_texture,
+    gfx_opengl_upload_index_texture,
+    gfx_opengl_select_palette,
+    gfx_opengl_upload_palette,
+    gfx_opengl_upload_texture_format,
+    gfx_opengl_map_texture_staging,
+    gfx_opengl_supports_texture_row_length,
+    gfx_opengl_set_texture_row_length,
     gfx_opengl_init,
     gfx_opengl_on_resize,
     gfx_opengl_start_frame,
@@ -15,11 +15,19 @@
 #include "gfx_window_manager_api.h"
 #include "gfx_rendering_api.h"
 #include "gfx_screen_config.h"
+#include "gfx_capture.h"
+#include "gfx_trace.h"
+#include "gfx_simd.h"
+#include "gfx_hash.h"
+#include "gfx_write_watch.h"
+#include "gfx_worker_pool.h"
+#include "gfx_disk_cache.h"
+#include "gfx_texture_pack.h"
 
 #define SUPPORT_CHECK(x) assert(x)
 
 // SCALE_M_N: upscale/downscale M-bit integer to N-bit
-#define SCALE_5_8(VAL_) (((VAL_) * 0xFF) / 0x1F)
+#define SCALE_5_8(VAL_) (((VAL_) * 1053) >> 7) // equals VAL_ * 0xFF / 0x1F for 5-bit values
 #define SCALE_8_5(VAL_) ((((VAL_) + 4) * 0x1F) / 0xFF)
 #define SCALE_4_8(VAL_) ((VAL_) * 0x11)
 #define SCALE_8_4(VAL_) ((VAL_) / 0x11)
@@ -37,6 +45,7 @@
 #define MAX_BUFFERED 256
 #define MAX_LIGHTS 2
 #define MAX_VERTICES 64
+#define VERTEX_BATCH_SIZE 64 // must be a multiple of GFX_SIMD_WIDTH
 
 struct RGBA {
     uint8_t r, g, b, a;
@@ -55,24 +64,68 @@ struct LoadedVertex {
 
 struct TextureHashmapNode {
     struct TextureHashmapNode *next;
+    struct TextureHashmapNode *lru_prev, *lru_next; // most recently used first
     
     const uint8_t *texture_addr;
+    uint64_t content_hash; // when texture hashing is enabled
     uint8_t fmt, siz;
     
     uint32_t texture_id;
     uint8_t cms, cmt;
     bool linear_filter;
+    
+    // Location in the texture atlas, valid while atlas_generation matches the page's generation
+    uint8_t atlas_page;
+    uint32_t atlas_generation;
+    uint16_t atlas_x, atlas_y, width, height;
+    
+    // Layer of a texture array, valid while array_generation matches the layer's generation
+    uint8_t array_index, array_layer;
+    uint32_t array_generation;
+    
+    // Slice at (image_x, image_y) of a shared texture image, drawn from it instead
+    // of its own texture while image_generation matches the image's generation
+    uint8_t image_index;
+    uint32_t image_generation;
+    uint16_t image_x, image_y;
+    bool image_excluded; // drawn outside the slice, so it needs its own texture
+    
+    uint32_t size_bytes; // of the uploaded texture
+    bool palette_indexed; // uploaded as color indices, see palette_textures
+    const struct GfxTexturePackEntry *replacement; // waiting to be uploaded, see texture_pack
+    
+    // With write watching, the texels and palette are imported again if written after write_stamp
+    const uint8_t *palette;
+    uint32_t write_stamp;
+    bool write_watched;
 };
+
+#define TEXTURE_CACHE_DEFAULT_CAPACITY 512
+
+// When all nodes are in use, the least recently used texture that isn't bound
+// to a tile is evicted, and its texture is reused for the new one. Changing the
+// capacity clears the cache.
 static struct {
     struct TextureHashmapNode *hashmap[1024];
-    struct TextureHashmapNode pool[512];
-    uint32_t pool_pos;
-} gfx_texture_cache;
+    struct TextureHashmapNode *pool;
+    uint32_t pool_pos; // nodes in use
+    uint32_t capacity, requested_capacity;
+    // Textures of nodes dropped by shrinking the pool, when the rendering API
+    // can't delete them, reused before creating new ones
+    uint32_t *spare_texture_ids;
+    uint32_t num_spare_texture_ids;
+    struct TextureHashmapNode *lru_head, *lru_tail;
+    uint64_t size_bytes; // of the cached textures
+} gfx_texture_cache = {.requested_capacity = TEXTURE_CACHE_DEFAULT_CAPACITY};
 
 struct ColorCombiner {
-    uint32_t cc_id;
+    uint64_t cc_id;
     struct ShaderProgram *prg;
     uint8_t shader_input_mapping[2][4];
+    bool uses_lod;
+    uint8_t num_inputs;
+    bool used_textures[2];
+    float uber_combiner[3]; // with SHADER_OPT_UBER: color and alpha combiner, option flags
 };
 
 static struct ColorCombiner color_combiner_pool[64];
@@ -102,17 +155,53 @@ static struct RSP {
     struct LoadedVertex loaded_vertices[MAX_VERTICES + 4];
 } rsp;
 
+// Structure-of-arrays staging area for gfx_sp_vertex
+static struct {
+    float ob[3][VERTEX_BATCH_SIZE];
+    float n[3][VERTEX_BATCH_SIZE];
+    float x[VERTEX_BATCH_SIZE], y[VERTEX_BATCH_SIZE], z[VERTEX_BATCH_SIZE], w[VERTEX_BATCH_SIZE];
+    int32_t clip_rej[VERTEX_BATCH_SIZE];
+    int32_t fog[VERTEX_BATCH_SIZE];
+    int32_t rgb[3][VERTEX_BATCH_SIZE];
+    int32_t texgen[2][VERTEX_BATCH_SIZE];
+} vtx_batch;
+
+// Parts of the RSP/RDP state that changed since the last triangle, so that
+// gfx_update_render_state only re-evaluates what can have changed
+#define DIRTY_GEOMETRY_MODE (1 << 0)
+#define DIRTY_OTHER_MODE (1 << 1)
+#define DIRTY_COMBINE_MODE (1 << 2)
+#define DIRTY_TILE (1 << 3)
+#define DIRTY_TEXTURE (1 << 4)
+#define DIRTY_VIEWPORT_SCISSOR (1 << 5)
+#define DIRTY_COLORS (1 << 6)
+#define DIRTY_ALL 0x7f
+
+// Texels loaded into TMEM by G_LOADBLOCK or G_LOADTILE, read from memory when they are imported
+struct LoadedTexture {
+    const uint8_t *addr;
+    uint32_t size_bytes;
+    // A G_LOADTILE of a sub-rectangle of a wider texture image loads rows of
+    // row_bytes that are stride_bytes apart in memory. 0 if the rows follow each other.
+    uint32_t row_bytes, stride_bytes;
+    bool gathered; // the rows have been copied together, see gfx_loaded_texels
+    // Where the sub-rectangle lies in the texture image, for texture_images
+    const uint8_t *image_addr;
+    uint16_t image_width; // in texels
+    uint16_t x, y;
+};
+
 static struct RDP {
     const uint8_t *palette;
+    uint32_t palette_size_bytes; // loaded by the last G_LOADTLUT
+    struct PaletteCacheEntry *palette_decoded;
     struct {
         const uint8_t *addr;
         uint8_t siz;
+        uint16_t width; // of the texture image, in texels
         uint8_t tile_number;
     } texture_to_load;
-    struct {
-        const uint8_t *addr;
-        uint32_t size_bytes;
-    } loaded_texture[2];
+    struct LoadedTexture loaded_texture[2];
     struct {
         uint8_t fmt;
         uint8_t siz;
@@ -127,7 +216,7 @@ static struct RDP {
     
     struct RGBA env_color, prim_color, fog_color, fill_color;
     struct XYWidthHeight viewport, scissor;
-    bool viewport_or_scissor_changed;
+    uint32_t state_dirty; // DIRTY_* bits
     void *z_buf_address;
     void *color_image_address;
 } rdp;
@@ -146,47 +235,453 @@ struct GfxDimensions gfx_current_dimensions;
 
 static bool dropped_frame;
 
-static float buf_vbo[MAX_BUFFERED * (26 * 3)]; // 3 vertices in a triangle and 26 floats per vtx
+static float buf_vbo[MAX_BUFFERED * (37 * 3)]; // 3 vertices in a triangle and up to 37 floats per vtx (26 without atlas, array or uber shader attributes)
 static size_t buf_vbo_len;
 static size_t buf_vbo_num_tris;
+static size_t buf_vbo_num_verts;
+static uint16_t buf_ibo[MAX_BUFFERED * 3];
+static size_t buf_ibo_len;
+
+// Everything besides the loaded vertex itself that affects the attributes emitted for it
+struct VertexEmitKey {
+    struct ColorCombiner *comb;
+    struct RGBA prim_color, env_color, fog_color;
+    int32_t uls, ult;
+    uint32_t tex_width, tex_height;
+    bool linear_filter;
+    bool z_is_from_0_to_1;
+    float viewport_scale[2], viewport_offset[2];
+    float atlas_rect[2][4], atlas_mode[3];
+    float texture_layer[2];
+};
+
+// For indexed draws, where in the current batch each loaded vertex was emitted.
+// A vertex can be reused while its generation equals the current generation,
+// which is advanced on every flush and whenever the VertexEmitKey changes.
+static struct {
+    bool requested, enabled;
+    uint32_t generation;
+    uint32_t vertex_generation[MAX_VERTICES + 4];
+    uint16_t vertex_index[MAX_VERTICES + 4];
+    struct VertexEmitKey key;
+} indexed_draws;
+
+// Packed vertex layout (SHADER_OPT_PACKED_VERTICES): positions and texture
+// coordinates are floats, fog and combiner inputs one UNORM8x4 word each
+static struct {
+    bool requested, enabled;
+} packed_vertices;
+
+// Apply the viewport transform to the emitted clip space positions and draw
+// with a full window viewport, so that viewport changes don't split batches.
+// Clipping to the viewport is done by intersecting it with the scissor.
+static struct {
+    bool requested, enabled;
+} baked_viewport;
+
+// Draw with a single SHADER_OPT_UBER program that takes the combiner from
+// each vertex, so that combiner changes don't split batches
+static struct {
+    bool requested, enabled;
+} uber_shader;
+
+#define TEXTURE_ATLAS_PAGES 4
+
+// Packs imported textures into a few pages of GFX_TEXTURE_ATLAS_SIZE texels
+// (see SHADER_OPT_TEXTURE_ATLAS), so that texture changes don't split batches
+// unless a tile switches to another page. Pages are filled shelf by shelf, and
+// when all of them are full the next page in turn is cleared. Textures in a
+// cleared page are uploaded again when they are used the next time.
+static struct {
+    bool requested, enabled;
+    struct {
+        bool created;
+        uint32_t texture_id;
+        uint32_t generation;
+        uint16_t shelf_x, shelf_y, shelf_height;
+    } pages[TEXTURE_ATLAS_PAGES];
+    uint8_t current_page;
+    int8_t bound_page[2]; // per tile, -1 if unknown
+} texture_atlas;
+
+#define TEXTURE_ARRAY_COUNT 32
+#define TEXTURE_ARRAY_LAYERS 32
+
+// Keeps textures of the same size as layers of one texture array (see
+// SHADER_OPT_TEXTURE_ARRAYS), so that switching between them doesn't split
+// batches. Wrapping and filtering stay sampler state, shared by the array.
+// Full arrays reuse their layers in turn, and when all arrays are in use for
+// other sizes, the next array in turn is reallocated for the new size.
+struct TextureArray {
+    uint32_t texture_id;
+    uint16_t width, height; // 0 if not allocated
+    uint8_t next_layer;
+    bool full;
+    uint32_t layer_generation[TEXTURE_ARRAY_LAYERS];
+    uint8_t cms, cmt;
+    bool linear_filter;
+};
+static struct {
+    bool requested, enabled;
+    struct TextureArray arrays[TEXTURE_ARRAY_COUNT];
+    uint8_t next_array;
+    int8_t bound_array[2]; // per tile, -1 if unknown
+} texture_arrays;
+
+#define TEXTURE_HASH_MEMO_BITS 8
+#define TEXTURE_HASH_MEMO_SIZE (1 << TEXTURE_HASH_MEMO_BITS)
+
+// Keys the texture cache on a hash of the loaded texels (and the palette of CI
+// textures) instead of their address, so textures written in place are imported
+// again and identical textures at different addresses are shared. Hashes are
+// memoized per address for the rest of the frame.
+static struct {
+    bool requested, enabled;
+    uint32_t frame; // memo entries of other frames are stale
+    struct {
+        const uint8_t *addr, *palette;
+        uint32_t size_bytes, line_size_bytes, stride_bytes;
+        uint8_t fmt, siz;
+        uint32_t frame;
+        uint32_t write_stamp;
+        bool write_watched; // then valid in later frames until written
+        uint64_t hash;
+    } memo[TEXTURE_HASH_MEMO_SIZE];
+} texture_hashing;
+
+#define PALETTE_CACHE_SIZE 8
+
+// Decoded palettes of recent G_LOADTLUTs, replaced in turn. Like TMEM, they
+// keep the palette as it was when it was loaded.
+struct PaletteCacheEntry {
+    const uint8_t *addr;
+    uint32_t size_bytes;
+    uint8_t tlut[256 * 2];
+    uint8_t rgba32[256 * 4];
+    // Palette texture for palette_textures, uploaded when first bound after decoding
+    bool texture_created, texture_uploaded;
+    uint32_t texture_id;
+};
+static struct {
+    struct PaletteCacheEntry entries[PALETTE_CACHE_SIZE];
+    uint8_t next;
+} palette_cache;
+
+// Upload CI textures as color indices and their palettes as separate textures
+// (see SHADER_OPT_PALETTE_TEXEL0/1), so that the shader looks the colors up.
+// A tile keeps the palette of the last G_LOADTLUT before its texture was
+// imported or looked up, like the RGBA32 textures decoded with it.
+static struct {
+    bool requested, enabled;
+} palette_textures;
+
+// Upload textures with fewer than 32 bits per texel in the smallest format that
+// holds them exactly (see enum GfxTextureFormat) instead of decoding them to
+// RGBA32. RGBA16 textures only have their bytes swapped, and IA16 and I8
+// textures are uploaded straight from their loaded texels.
+static struct {
+    bool requested, enabled;
+} compact_textures;
+
+// Decode textures imported on the render thread straight into staging memory
+// of the rendering API (see map_texture_staging), which the upload then reads
+// without copying the texels again
+static struct {
+    bool requested, enabled;
+} texture_staging;
+
+// Upload sub-rectangles loaded by G_LOADTILE in formats that need no decoding
+// straight from their texture image, with its width as the row length (see
+// supports_texture_row_length), instead of copying their rows together first
+static struct {
+    bool enabled;
+} texture_row_length;
+
+#define TEXTURE_IMAGE_COUNT 8
+#define TEXTURE_IMAGE_MAX_BYTES (1 << 20)
+
+// A texture image that slices loaded by G_LOADTILE are drawn from
+struct TextureImage {
+    const uint8_t *addr;
+    uint16_t width; // in texels
+    uint8_t fmt, siz;
+    uint16_t row_begin, row_end; // uploaded rows
+    uint32_t texture_id;
+    uint32_t generation; // advanced when the image is replaced by another one
+    uint8_t cms, cmt;
+    bool linear_filter;
+};
+
+// Share one texture between the slices of a texture image that are loaded by
+// separate G_LOADTILEs, like the strips of a background. The image rows spanned
+// by the slices are uploaded once, straight from the image, and each slice is
+// drawn from them with its texture coordinates offset into the image, without
+// switching textures in between. Only for formats that need no decoding and
+// for clamped tiles drawn on their own, as a wrapping slice or two textures
+// with the same coordinates need textures of their own.
+static struct {
+    bool requested, enabled;
+    struct TextureImage images[TEXTURE_IMAGE_COUNT];
+    uint8_t next; // replaced in turn
+} texture_images;
+
+#define TEXTURE_DECODE_JOBS 32
+#define TEXTURE_DECODE_STACK_SIZE 32
+
+// Decoded texels, in the format of the upload function that takes them
+enum DecodedTextureFormat {
+    DECODED_RGBA32,   // gfx_upload_texture
+    DECODED_INDICES,  // gfx_upload_index_texture, with palette_textures
+    DECODED_RGBA5551, // gfx_upload_texture_format, with compact_textures
+    DECODED_IA88,
+    DECODED_I8
+};
+
+// Everything a decoded texture depends on, besides the texture modes, which
+// only change between frames
+struct TextureDecodeInput {
+    const uint8_t *addr;
+    uint32_t size_bytes;
+    uint32_t line_size_bytes;
+    uint8_t fmt, siz;
+    // TLUT of CI textures decoded to RGBA32, and its decoded colors
+    const uint8_t *palette;
+    uint32_t palette_size;
+    const uint8_t *palette_rgba32;
+};
+
+#define DECODED_TEXTURE_MAX_BYTES 32768
+
+struct DecodedTexture {
+    const uint8_t *buf; // data, or the loaded texels if they are uploaded as they are
+    uint32_t width, height;
+    enum DecodedTextureFormat format;
+    uint32_t row_length; // texels from one row of buf to the next, 0 if width
+    uint8_t *data; // DECODED_TEXTURE_MAX_BYTES for the decoder to write to
+};
+
+struct TextureDecodeJob {
+    struct GfxWorkerJob work; // first, so that the job can be found from it
+    bool submitted;
+    uint32_t seq;
+    struct TextureDecodeInput in;
+    uint8_t palette_rgba32[256 * 4];
+    struct DecodedTexture decoded;
+    uint8_t texels[DECODED_TEXTURE_MAX_BYTES];
+};
+
+// Decodes textures on worker threads before they are imported. A lookahead
+// scanner walks the display list ahead of the interpreter, following only the
+// texture loads, and submits a job for each texture that a draw command will
+// import and that isn't cached. An import with a matching job uploads its
+// result, waiting for it if needed. All jobs are finished before gfx_run
+// returns, as the game may write the texture memory afterwards.
+static struct {
+    uint32_t requested_threads, threads;
+    bool enabled;
+    struct TextureDecodeJob jobs[TEXTURE_DECODE_JOBS];
+    uint32_t next_seq;
+    struct {
+        const Gfx *stack[TEXTURE_DECODE_STACK_SIZE];
+        int depth; // 0 when the display list has been scanned
+        const uint8_t *image_addr;
+        uint8_t image_siz;
+        uint16_t image_width;
+        uint8_t load_tile_number;
+        struct {
+            const uint8_t *addr;
+            uint32_t size_bytes;
+            bool loaded; // since the last draw command
+        } tiles[2];
+        uint8_t fmt, siz;
+        uint32_t line_size_bytes;
+        const uint8_t *palette;
+        uint32_t palette_size;
+    } lookahead;
+} texture_decode;
+
+// Keeps decoded textures across runs in a file (see gfx_disk_cache.h), keyed
+// by a hash of their loaded texels and palette, so that textures imported in an
+// earlier run are uploaded from the file instead of being decoded
+static struct {
+    char *filename; // NULL disables
+    bool changed, enabled;
+} texture_disk_cache;
+
+// Part of the disk cache keys, to be increased when decoded textures change
+#define TEXTURE_DISK_CACHE_VERSION 1
+
+// Precedes the texels of a texture in the disk cache
+struct TextureDiskCacheHeader {
+    uint32_t format; // enum DecodedTextureFormat
+    uint32_t width, height;
+    uint32_t padding;
+};
+
+#define TEXTURE_PACK_MAX_PENDING 256
+#define TEXTURE_PACK_DEFAULT_BUDGET (4 << 20)
+
+// Replaces textures with those of a texture pack (see gfx_texture_pack.h). At
+// most budget_bytes of replacements are uploaded per frame. A texture whose
+// replacement doesn't fit is imported as usual, and replaced in a later frame.
+static struct {
+    char *filename; // NULL disables
+    bool changed, enabled;
+    struct GfxTexturePack *pack;
+    uint32_t budget_bytes;
+    uint32_t frame_bytes; // uploaded this frame
+    struct TextureHashmapNode *pending[TEXTURE_PACK_MAX_PENDING]; // oldest first
+    uint32_t num_pending;
+} texture_pack = {.budget_bytes = TEXTURE_PACK_DEFAULT_BUDGET};
+
+// Write protects the memory of imported textures and palettes (see
+// gfx_write_watch.h), so that cached textures are only imported or hashed
+// again when the game has written to their pages
+static struct {
+    bool requested, enabled;
+    uint32_t frame_stamp; // taken at the end of the previous frame
+} write_watch;
+
+// Render state derived by gfx_update_render_state, valid while rdp.state_dirty is clear
+static struct {
+    struct ColorCombiner *comb;
+    bool use_alpha, use_fog, use_texture;
+    bool linear_filter;
+    int32_t uls, ult;
+    uint32_t tex_width, tex_height;
+    bool z_is_from_0_to_1;
+    float viewport_scale[2], viewport_offset[2]; // when baked_viewport.enabled
+    float atlas_rect[2][4], atlas_mode[3]; // when texture_atlas.enabled
+    // The tile drawn from a shared texture image (-1 if none), and the rectangle
+    // of its slice that the texture coordinates must stay in
+    int image_tile;
+    int32_t slice_uls, slice_ult;
+    uint32_t slice_width, slice_height;
+    float texture_layer[2]; // when texture_arrays.enabled
+    uint64_t palette_opts; // SHADER_OPT_PALETTE_* of the bound textures, when palette_textures.enabled
+} tri_state;
 
 static struct GfxWindowManagerAPI *gfx_wapi;
 static struct GfxRenderingAPI *gfx_rapi;
 
+static struct {
+    bool enabled;
+    enum GfxStage current;
+    uint64_t last_time;
+} stage_timing;
+
+static struct GfxFrameStats frame_stats, last_frame_stats;
+
 #include <time.h>
-static unsigned long get_time(void) {
+static uint64_t get_time(void) {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Charges the time since the last stage switch to the current stage and switches to a new one.
+// Returns the previous stage, which should be passed to gfx_stage_leave.
+static inline enum GfxStage gfx_stage_enter(enum GfxStage stage) {
+    enum GfxStage prev = stage_timing.current;
+    if (stage_timing.enabled) {
+        uint64_t now = get_time();
+        frame_stats.stage_ns[prev] += now - stage_timing.last_time;
+        stage_timing.last_time = now;
+        stage_timing.current = stage;
+    }
+    return prev;
+}
+
+static inline void gfx_stage_leave(enum GfxStage prev) {
+    gfx_stage_enter(prev);
+}
+
+// Adds the time spent in the current stage so far to the frame stats
+static inline void gfx_stage_update(void) {
+    gfx_stage_enter(stage_timing.current);
+}
+
+static void gfx_new_vertex_generation(void) {
+    if (++indexed_draws.generation == 0) {
+        memset(indexed_draws.vertex_generation, 0, sizeof(indexed_draws.vertex_generation));
+        indexed_draws.generation = 1;
+    }
+}
+
+static inline void gfx_invalidate_emitted_vertex(size_t idx) {
+    indexed_draws.vertex_generation[idx] = 0;
+}
+
+static inline void gfx_capture_touch(const void *addr, size_t size) {
+    if (gfx_capture_recording) {
+        gfx_capture_record_region(addr, size);
+    }
 }
 
-static void gfx_flush(void) {
+static inline void gfx_trace_push(const char *name, const char *arg_name, uint64_t arg, bool arg_hex) {
+    if (gfx_trace_enabled) {
+        gfx_trace_begin(name, arg_name, arg, arg_hex);
+    }
+}
+
+static inline void gfx_trace_pop(void) {
+    if (gfx_trace_enabled) {
+        gfx_trace_end();
+    }
+}
+
+static void gfx_flush(enum GfxFlushReason reason) {
+    static const char *trace_names[GFX_FLUSH_REASON_COUNT] = {
+        "gfx_flush (depth test)",
+        "gfx_flush (depth mask)",
+        "gfx_flush (decal)",
+        "gfx_flush (viewport)",
+        "gfx_flush (scissor)",
+        "gfx_flush (shader)",
+        "gfx_flush (alpha)",
+        "gfx_flush (texture)",
+        "gfx_flush (sampler)",
+        "gfx_flush (buffer full)",
+        "gfx_flush (end of frame)"
+    };
     if (buf_vbo_len > 0) {
-        int num = buf_vbo_num_tris;
-        unsigned long t0 = get_time();
-        gfx_rapi->draw_triangles(buf_vbo, buf_vbo_len, buf_vbo_num_tris);
+        enum GfxStage prev_stage = gfx_stage_enter(GFX_STAGE_FLUSH);
+        frame_stats.draw_calls++;
+        frame_stats.draw_calls_by_reason[reason]++;
+        gfx_trace_push(trace_names[reason], "triangles", buf_vbo_num_tris, false);
+        if (indexed_draws.enabled) {
+            gfx_rapi->draw_triangles_indexed(buf_vbo, buf_vbo_len, buf_vbo_num_verts, buf_ibo, buf_ibo_len);
+            gfx_new_vertex_generation();
+        } else {
+            gfx_rapi->draw_triangles(buf_vbo, buf_vbo_len, buf_vbo_num_tris);
+        }
+        gfx_trace_pop();
         buf_vbo_len = 0;
         buf_vbo_num_tris = 0;
-        unsigned long t1 = get_time();
-        /*if (t1 - t0 > 1000) {
-            printf("f: %d %d\n", num, (int)(t1 - t0));
-        }*/
+        buf_vbo_num_verts = 0;
+        buf_ibo_len = 0;
+        gfx_stage_leave(prev_stage);
     }
 }
 
-static struct ShaderProgram *gfx_lookup_or_create_shader_program(uint32_t shader_id) {
+static struct ShaderProgram *gfx_lookup_or_create_shader_program(uint64_t shader_id) {
     struct ShaderProgram *prg = gfx_rapi->lookup_shader(shader_id);
     if (prg == NULL) {
+        gfx_flush(GFX_FLUSH_SHADER);
         gfx_rapi->unload_shader(rendering_state.shader_program);
+        gfx_trace_push("create_shader", "shader_id", shader_id, true);
         prg = gfx_rapi->create_and_load_new_shader(shader_id);
+        gfx_trace_pop();
+        frame_stats.shaders_created++;
         rendering_state.shader_program = prg;
     }
     return prg;
 }
 
-static void gfx_generate_cc(struct ColorCombiner *comb, uint32_t cc_id) {
+static void gfx_generate_cc(struct ColorCombiner *comb, uint64_t cc_id) {
     uint8_t c[2][4];
-    uint32_t shader_id = (cc_id >> 24) << 24;
+    uint64_t shader_id = (cc_id >> 24) << 24;
+    bool samples_texture[2] = {false, false};
     uint8_t shader_input_mapping[2][4] = {{0}};
     for (int i = 0; i < 4; i++) {
         c[0][i] = (cc_id >> (i * 3)) & 7;
@@ -224,14 +719,58 @@ static void gfx_generate_cc(struct ColorCombiner *comb, uint32_t cc_id) {
                     break;
             }
             shader_id |= val << (i * 12 + j * 3);
+            samples_texture[0] |= val == SHADER_TEXEL0 || val == SHADER_TEXEL0A;
+            samples_texture[1] |= val == SHADER_TEXEL1;
         }
     }
+    // Share the program with combiners that differ only in unsampled textures
+    if (!samples_texture[0]) {
+        shader_id &= ~SHADER_OPT_PALETTE_TEXEL0;
+    }
+    if (!samples_texture[1]) {
+        shader_id &= ~SHADER_OPT_PALETTE_TEXEL1;
+    }
+    if (!(shader_id & (SHADER_OPT_PALETTE_TEXEL0 | SHADER_OPT_PALETTE_TEXEL1))) {
+        shader_id &= ~SHADER_OPT_PALETTE_LINEAR;
+    }
+    if (cc_id & SHADER_OPT_UBER) {
+        // The combiner goes into the vertices instead
+        shader_id = cc_id & (SHADER_OPT_UBER | SHADER_OPT_PACKED_VERTICES | SHADER_OPT_TEXTURE_ATLAS | SHADER_OPT_TEXTURE_ARRAYS |
+                             SHADER_OPT_PALETTE_TEXEL0 | SHADER_OPT_PALETTE_TEXEL1 | SHADER_OPT_PALETTE_LINEAR);
+    }
     comb->cc_id = cc_id;
     comb->prg = gfx_lookup_or_create_shader_program(shader_id);
+    comb->uses_lod = false;
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 4; j++) {
+            if (shader_input_mapping[i][j] == CC_LOD) {
+                comb->uses_lod = true;
+            }
+        }
+    }
     memcpy(comb->shader_input_mapping, shader_input_mapping, sizeof(shader_input_mapping));
+    gfx_rapi->shader_get_info(comb->prg, &comb->num_inputs, comb->used_textures);
+    if (cc_id & SHADER_OPT_UBER) {
+        // The program samples both textures, but only those in the combiner are imported
+        comb->used_textures[0] = false;
+        comb->used_textures[1] = false;
+        for (int i = 0; i < 2; i++) {
+            comb->uber_combiner[i] = c[i][0] + 8 * c[i][1] + 64 * c[i][2] + 512 * c[i][3];
+            for (int j = 0; j < 4; j++) {
+                if (c[i][j] == CC_TEXEL0 || c[i][j] == CC_TEXEL0A) {
+                    comb->used_textures[0] = true;
+                }
+                if (c[i][j] == CC_TEXEL1) {
+                    comb->used_textures[1] = true;
+                }
+            }
+        }
+        comb->uber_combiner[2] = ((cc_id & SHADER_OPT_ALPHA) ? 1 : 0) + ((cc_id & SHADER_OPT_TEXTURE_EDGE) ? 2 : 0) +
+                                 ((cc_id & SHADER_OPT_NOISE) ? 4 : 0);
+    }
 }
 
-static struct ColorCombiner *gfx_lookup_or_create_color_combiner(uint32_t cc_id) {
+static struct ColorCombiner *gfx_lookup_or_create_color_combiner(uint64_t cc_id) {
     static struct ColorCombiner *prev_combiner;
     if (prev_combiner != NULL && prev_combiner->cc_id == cc_id) {
         return prev_combiner;
@@ -242,211 +781,608 @@ static struct ColorCombiner *gfx_lookup_or_create_color_combiner(uint32_t cc_id)
             return prev_combiner = &color_combiner_pool[i];
         }
     }
-    gfx_flush();
+    if (!(cc_id & SHADER_OPT_UBER)) {
+        // The uber shader is shared by all combiners and only flushes if it is created
+        gfx_flush(GFX_FLUSH_SHADER);
+    }
     struct ColorCombiner *comb = &color_combiner_pool[color_combiner_pool_size++];
     gfx_generate_cc(comb, cc_id);
     return prev_combiner = comb;
 }
 
-static bool gfx_texture_cache_lookup(int tile, struct TextureHashmapNode **n, const uint8_t *orig_addr, uint32_t fmt, uint32_t siz) {
-    size_t hash = (uintptr_t)orig_addr;
-    hash = (hash >> 5) & 0x3ff;
-    struct TextureHashmapNode **node = &gfx_texture_cache.hashmap[hash];
-    while (*node != NULL && *node - gfx_texture_cache.pool < (int)gfx_texture_cache.pool_pos) {
-        if ((*node)->texture_addr == orig_addr && (*node)->fmt == fmt && (*node)->siz == siz) {
-            gfx_rapi->select_texture(tile, (*node)->texture_id);
-            *n = *node;
-            return true;
-        }
-        node = &(*node)->next;
+static void gfx_switch_shader(struct ShaderProgram *prg) {
+    if (prg != rendering_state.shader_program) {
+        frame_stats.shader_switches++;
+        gfx_flush(GFX_FLUSH_SHADER);
+        gfx_rapi->unload_shader(rendering_state.shader_program);
+        gfx_rapi->load_shader(prg);
+        rendering_state.shader_program = prg;
     }
-    if (gfx_texture_cache.pool_pos == sizeof(gfx_texture_cache.pool) / sizeof(struct TextureHashmapNode)) {
-        // Pool is full. We just invalidate everything and start over.
-        gfx_texture_cache.pool_pos = 0;
-        node = &gfx_texture_cache.hashmap[hash];
-        //puts("Clearing texture cache");
-    }
-    *node = &gfx_texture_cache.pool[gfx_texture_cache.pool_pos++];
-    if ((*node)->texture_addr == NULL) {
-        (*node)->texture_id = gfx_rapi->new_texture();
-    }
-    gfx_rapi->select_texture(tile, (*node)->texture_id);
-    gfx_rapi->set_sampler_parameters(tile, false, 0, 0);
-    (*node)->cms = 0;
-    (*node)->cmt = 0;
-    (*node)->linear_filter = false;
-    (*node)->next = NULL;
-    (*node)->texture_addr = orig_addr;
-    (*node)->fmt = fmt;
-    (*node)->siz = siz;
-    *n = *node;
-    return false;
 }
 
-static void import_texture_rgba16(int tile) {
-    uint8_t rgba32_buf[8192];
-    
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes / 2; i++) {
-        uint16_t col16 = (rdp.loaded_texture[tile].addr[2 * i] << 8) | rdp.loaded_texture[tile].addr[2 * i + 1];
-        uint8_t a = col16 & 1;
-        uint8_t r = col16 >> 11;
-        uint8_t g = (col16 >> 6) & 0x1f;
-        uint8_t b = (col16 >> 1) & 0x1f;
-        rgba32_buf[4*i + 0] = SCALE_5_8(r);
-        rgba32_buf[4*i + 1] = SCALE_5_8(g);
-        rgba32_buf[4*i + 2] = SCALE_5_8(b);
-        rgba32_buf[4*i + 3] = a ? 255 : 0;
+static void gfx_texture_atlas_bind(int tile, uint8_t page) {
+    if (texture_atlas.bound_page[tile] != page) {
+        gfx_flush(GFX_FLUSH_TEXTURE);
+        gfx_rapi->select_texture(tile, texture_atlas.pages[page].texture_id);
+        texture_atlas.bound_page[tile] = page;
     }
-    
-    uint32_t width = rdp.texture_tile.line_size_bytes / 2;
-    uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
-    
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
 }
 
-static void import_texture_rgba32(int tile) {
-    uint32_t width = rdp.texture_tile.line_size_bytes / 2;
-    uint32_t height = (rdp.loaded_texture[tile].size_bytes / 2) / rdp.texture_tile.line_size_bytes;
-    gfx_rapi->upload_texture(rdp.loaded_texture[tile].addr, width, height);
+static bool gfx_texture_atlas_alloc_in_page(uint8_t page, uint32_t width, uint32_t height, uint16_t *x, uint16_t *y) {
+    if (texture_atlas.pages[page].shelf_x + width > GFX_TEXTURE_ATLAS_SIZE) {
+        // Start a new shelf below the current one
+        texture_atlas.pages[page].shelf_x = 0;
+        texture_atlas.pages[page].shelf_y += texture_atlas.pages[page].shelf_height;
+        texture_atlas.pages[page].shelf_height = 0;
+    }
+    if (texture_atlas.pages[page].shelf_y + height > GFX_TEXTURE_ATLAS_SIZE) {
+        return false;
+    }
+    *x = texture_atlas.pages[page].shelf_x;
+    *y = texture_atlas.pages[page].shelf_y;
+    texture_atlas.pages[page].shelf_x += width;
+    if (height > texture_atlas.pages[page].shelf_height) {
+        texture_atlas.pages[page].shelf_height = height;
+    }
+    return true;
+}
+
+static void gfx_texture_atlas_alloc(int tile, struct TextureHashmapNode *node, uint32_t width, uint32_t height) {
+    for (;;) {
+        uint8_t page = texture_atlas.current_page;
+        if (!texture_atlas.pages[page].created) {
+            uint8_t *zero_buf = calloc(GFX_TEXTURE_ATLAS_SIZE * GFX_TEXTURE_ATLAS_SIZE, 4);
+            texture_atlas.pages[page].texture_id = gfx_rapi->new_texture();
+            texture_atlas.bound_page[tile] = -1;
+            gfx_texture_atlas_bind(tile, page);
+            gfx_rapi->set_sampler_parameters(tile, false, G_TX_CLAMP, G_TX_CLAMP);
+            gfx_rapi->upload_texture(zero_buf, GFX_TEXTURE_ATLAS_SIZE, GFX_TEXTURE_ATLAS_SIZE);
+            free(zero_buf);
+            texture_atlas.pages[page].created = true;
+            texture_atlas.pages[page].generation = 1;
+        }
+        if (gfx_texture_atlas_alloc_in_page(page, width, height, &node->atlas_x, &node->atlas_y)) {
+            node->atlas_page = page;
+            node->atlas_generation = texture_atlas.pages[page].generation;
+            node->width = width;
+            node->height = height;
+            return;
+        }
+        
+        // Clear the next page, except the one the other tile is drawing with
+        page = (page + 1) % TEXTURE_ATLAS_PAGES;
+        if (page == texture_atlas.bound_page[tile ^ 1]) {
+            page = (page + 1) % TEXTURE_ATLAS_PAGES;
+        }
+        if (page == texture_atlas.bound_page[tile]) {
+            // Buffered triangles may still sample the old contents
+            gfx_flush(GFX_FLUSH_TEXTURE);
+        }
+        texture_atlas.pages[page].generation++;
+        texture_atlas.pages[page].shelf_x = 0;
+        texture_atlas.pages[page].shelf_y = 0;
+        texture_atlas.pages[page].shelf_height = 0;
+        texture_atlas.current_page = page;
+    }
 }
 
-static void import_texture_ia4(int tile) {
-    uint8_t rgba32_buf[32768];
-    
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes * 2; i++) {
-        uint8_t byte = rdp.loaded_texture[tile].addr[i / 2];
-        uint8_t part = (byte >> (4 - (i % 2) * 4)) & 0xf;
-        uint8_t intensity = part >> 1;
-        uint8_t alpha = part & 1;
-        uint8_t r = intensity;
-        uint8_t g = intensity;
-        uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = SCALE_3_8(r);
-        rgba32_buf[4*i + 1] = SCALE_3_8(g);
-        rgba32_buf[4*i + 2] = SCALE_3_8(b);
-        rgba32_buf[4*i + 3] = alpha ? 255 : 0;
+static void gfx_texture_array_bind(int tile, uint8_t index) {
+    if (texture_arrays.bound_array[tile] != index) {
+        gfx_flush(GFX_FLUSH_TEXTURE);
+        gfx_rapi->select_texture_array(tile, texture_arrays.arrays[index].texture_id);
+        texture_arrays.bound_array[tile] = index;
     }
-    
-    uint32_t width = rdp.texture_tile.line_size_bytes * 2;
-    uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
-    
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
 }
 
-static void import_texture_ia8(int tile) {
-    uint8_t rgba32_buf[16384];
+static void gfx_texture_array_alloc(int tile, struct TextureHashmapNode *node, uint32_t width, uint32_t height) {
+    struct TextureHashmapNode *other = rendering_state.textures[tile ^ 1];
+    int8_t other_array = texture_arrays.bound_array[tile ^ 1];
     
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
-        uint8_t intensity = rdp.loaded_texture[tile].addr[i] >> 4;
-        uint8_t alpha = rdp.loaded_texture[tile].addr[i] & 0xf;
-        uint8_t r = intensity;
-        uint8_t g = intensity;
-        uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = SCALE_4_8(r);
-        rgba32_buf[4*i + 1] = SCALE_4_8(g);
-        rgba32_buf[4*i + 2] = SCALE_4_8(b);
-        rgba32_buf[4*i + 3] = SCALE_4_8(alpha);
+    uint8_t index = 0;
+    while (index < TEXTURE_ARRAY_COUNT && (texture_arrays.arrays[index].width != width || texture_arrays.arrays[index].height != height)) {
+        index++;
+    }
+    if (index == TEXTURE_ARRAY_COUNT) {
+        // (Re)allocate the next array in turn, except the one the other tile is drawing with
+        index = texture_arrays.next_array;
+        if (index == other_array) {
+            index = (index + 1) % TEXTURE_ARRAY_COUNT;
+        }
+        texture_arrays.next_array = (index + 1) % TEXTURE_ARRAY_COUNT;
+        
+        struct TextureArray *arr = &texture_arrays.arrays[index];
+        if (arr->width == 0) {
+            arr->texture_id = gfx_rapi->new_texture();
+        }
+        texture_arrays.bound_array[tile] = -1;
+        gfx_texture_array_bind(tile, index);
+        gfx_rapi->allocate_texture_array(width, height, TEXTURE_ARRAY_LAYERS);
+        gfx_rapi->set_sampler_parameters(tile, false, 0, 0);
+        arr->width = width;
+        arr->height = height;
+        arr->next_layer = 0;
+        arr->full = false;
+        for (int i = 0; i < TEXTURE_ARRAY_LAYERS; i++) {
+            arr->layer_generation[i]++;
+        }
+        arr->cms = 0;
+        arr->cmt = 0;
+        arr->linear_filter = false;
     }
     
-    uint32_t width = rdp.texture_tile.line_size_bytes;
-    uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
-    
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    struct TextureArray *arr = &texture_arrays.arrays[index];
+    uint8_t layer = arr->next_layer;
+    if (arr->full) {
+        if (other != NULL && other->array_index == index && other->array_layer == layer && other->array_generation == arr->layer_generation[layer]) {
+            // Keep the other tile's texture
+            layer = (layer + 1) % TEXTURE_ARRAY_LAYERS;
+        }
+        if (index == texture_arrays.bound_array[0] || index == texture_arrays.bound_array[1]) {
+            // Buffered triangles may still sample the old contents
+            gfx_flush(GFX_FLUSH_TEXTURE);
+        }
+        arr->layer_generation[layer]++;
+    }
+    arr->next_layer = (layer + 1) % TEXTURE_ARRAY_LAYERS;
+    if (arr->next_layer == 0) {
+        arr->full = true;
+    }
+    node->array_index = index;
+    node->array_layer = layer;
+    node->array_generation = arr->layer_generation[layer];
 }
 
-static void import_texture_ia16(int tile) {
-    uint8_t rgba32_buf[8192];
+static void gfx_upload_texture(int tile, const uint8_t *rgba32_buf, uint32_t width, uint32_t height) {
+    struct TextureHashmapNode *cached = rendering_state.textures[tile];
+    gfx_texture_cache.size_bytes -= cached->size_bytes;
+    cached->size_bytes = width * height * 4;
+    gfx_texture_cache.size_bytes += cached->size_bytes;
+    cached->palette_indexed = false;
     
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes / 2; i++) {
-        uint8_t intensity = rdp.loaded_texture[tile].addr[2 * i];
-        uint8_t alpha = rdp.loaded_texture[tile].addr[2 * i + 1];
-        uint8_t r = intensity;
-        uint8_t g = intensity;
-        uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = r;
-        rgba32_buf[4*i + 1] = g;
-        rgba32_buf[4*i + 2] = b;
-        rgba32_buf[4*i + 3] = alpha;
+    if (texture_arrays.enabled) {
+        struct TextureHashmapNode *node = rendering_state.textures[tile];
+        gfx_texture_array_alloc(tile, node, width, height);
+        gfx_texture_array_bind(tile, node->array_index);
+        gfx_rapi->upload_texture_layer(rgba32_buf, width, height, node->array_layer);
+        return;
+    }
+    if (!texture_atlas.enabled) {
+        gfx_rapi->upload_texture(rgba32_buf, width, height);
+        return;
     }
     
-    uint32_t width = rdp.texture_tile.line_size_bytes / 2;
-    uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
+    SUPPORT_CHECK(width <= GFX_TEXTURE_ATLAS_SIZE && height <= GFX_TEXTURE_ATLAS_SIZE);
+    if (height > GFX_TEXTURE_ATLAS_SIZE) {
+        height = GFX_TEXTURE_ATLAS_SIZE;
+    }
+    if (width > GFX_TEXTURE_ATLAS_SIZE) {
+        // Only possible for very wide 4-bit textures, which then have at most 3 rows
+        static uint8_t cropped_buf[GFX_TEXTURE_ATLAS_SIZE * 4 * 4];
+        height = height > 4 ? 4 : height;
+        for (uint32_t y = 0; y < height; y++) {
+            memcpy(cropped_buf + y * GFX_TEXTURE_ATLAS_SIZE * 4, rgba32_buf + y * width * 4, GFX_TEXTURE_ATLAS_SIZE * 4);
+        }
+        rgba32_buf = cropped_buf;
+        width = GFX_TEXTURE_ATLAS_SIZE;
+    }
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    struct TextureHashmapNode *node = rendering_state.textures[tile];
+    gfx_texture_atlas_alloc(tile, node, width, height);
+    gfx_texture_atlas_bind(tile, node->atlas_page);
+    gfx_rapi->upload_texture_region(rgba32_buf, node->atlas_x, node->atlas_y, width, height);
 }
 
-static void import_texture_i4(int tile) {
-    uint8_t rgba32_buf[32768];
+static void gfx_upload_index_texture(int tile, const uint8_t *index_buf, uint32_t width, uint32_t height) {
+    struct TextureHashmapNode *cached = rendering_state.textures[tile];
+    gfx_texture_cache.size_bytes -= cached->size_bytes;
+    cached->size_bytes = width * height;
+    gfx_texture_cache.size_bytes += cached->size_bytes;
+    cached->palette_indexed = true;
+    cached->width = width;
+    cached->height = height;
+    gfx_rapi->upload_index_texture(index_buf, width, height);
+}
 
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes * 2; i++) {
-        uint8_t byte = rdp.loaded_texture[tile].addr[i / 2];
-        uint8_t part = (byte >> (4 - (i % 2) * 4)) & 0xf;
-        uint8_t intensity = part;
-        uint8_t r = intensity;
-        uint8_t g = intensity;
-        uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = SCALE_4_8(r);
-        rgba32_buf[4*i + 1] = SCALE_4_8(g);
-        rgba32_buf[4*i + 2] = SCALE_4_8(b);
-        rgba32_buf[4*i + 3] = 255;
+static void gfx_upload_texture_format(int tile, const uint8_t *buf, uint32_t width, uint32_t height, enum GfxTextureFormat format) {
+    struct TextureHashmapNode *cached = rendering_state.textures[tile];
+    gfx_texture_cache.size_bytes -= cached->size_bytes;
+    cached->size_bytes = width * height * (format == GFX_TEXTURE_FORMAT_I8 ? 1 : 2);
+    gfx_texture_cache.size_bytes += cached->size_bytes;
+    cached->palette_indexed = false;
+    gfx_rapi->upload_texture_format(buf, width, height, format);
+}
+
+static void gfx_decoded_texture(struct DecodedTexture *out, enum DecodedTextureFormat format, const uint8_t *buf, uint32_t width, uint32_t height) {
+    out->format = format;
+    out->buf = buf;
+    out->row_length = 0;
+    out->width = width;
+    out->height = height;
+}
+
+static void gfx_upload_decoded_texture(int tile, const struct DecodedTexture *decoded) {
+    if (decoded->row_length != 0) {
+        gfx_rapi->set_texture_row_length(decoded->row_length);
+    }
+    switch (decoded->format) {
+        case DECODED_RGBA32:
+            gfx_upload_texture(tile, decoded->buf, decoded->width, decoded->height);
+            break;
+        case DECODED_INDICES:
+            gfx_upload_index_texture(tile, decoded->buf, decoded->width, decoded->height);
+            break;
+        case DECODED_RGBA5551:
+            gfx_upload_texture_format(tile, decoded->buf, decoded->width, decoded->height, GFX_TEXTURE_FORMAT_RGBA5551);
+            break;
+        case DECODED_IA88:
+            gfx_upload_texture_format(tile, decoded->buf, decoded->width, decoded->height, GFX_TEXTURE_FORMAT_IA88);
+            break;
+        case DECODED_I8:
+            gfx_upload_texture_format(tile, decoded->buf, decoded->width, decoded->height, GFX_TEXTURE_FORMAT_I8);
+            break;
+    }
+    if (decoded->row_length != 0) {
+        gfx_rapi->set_texture_row_length(0);
     }
+}
 
-    uint32_t width = rdp.texture_tile.line_size_bytes * 2;
-    uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
+static size_t gfx_texture_cache_hash(const uint8_t *orig_addr, uint64_t content_hash) {
+    if (texture_hashing.enabled) {
+        return content_hash & 0x3ff;
+    }
+    return ((uintptr_t)orig_addr >> 5) & 0x3ff;
+}
 
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+// Bytes of the loaded palette used by textures of the format, 0 if none
+static uint32_t gfx_texture_palette_size(uint8_t fmt, uint8_t siz) {
+    if (fmt != G_IM_FMT_CI || palette_textures.enabled) {
+        // Palette textures are bound separately
+        return 0;
+    }
+    uint32_t size = siz == G_IM_SIZ_4b ? 16 * 2 : 256 * 2;
+    return size < rdp.palette_size_bytes ? size : rdp.palette_size_bytes;
 }
 
-static void import_texture_i8(int tile) {
-    uint8_t rgba32_buf[16384];
+// Texels loaded into the tile, one row after the other as in TMEM
+static const uint8_t *gfx_loaded_texels(int tile) {
+    static uint8_t tmem[2][4096];
+    struct LoadedTexture *loaded = &rdp.loaded_texture[tile];
+    if (loaded->stride_bytes == 0) {
+        return loaded->addr;
+    }
+    if (!loaded->gathered) {
+        const uint8_t *row = loaded->addr;
+        for (uint32_t offset = 0; offset < loaded->size_bytes; offset += loaded->row_bytes, row += loaded->stride_bytes) {
+            memcpy(tmem[tile] + offset, row, loaded->row_bytes);
+        }
+        loaded->gathered = true;
+    }
+    return tmem[tile];
+}
 
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
-        uint8_t intensity = rdp.loaded_texture[tile].addr[i];
-        uint8_t r = intensity;
-        uint8_t g = intensity;
-        uint8_t b = intensity;
-        rgba32_buf[4*i + 0] = r;
-        rgba32_buf[4*i + 1] = g;
-        rgba32_buf[4*i + 2] = b;
-        rgba32_buf[4*i + 3] = 255;
+// Bytes of memory the texels loaded into the tile were read from
+static uint32_t gfx_loaded_texture_span(int tile) {
+    const struct LoadedTexture *loaded = &rdp.loaded_texture[tile];
+    if (loaded->stride_bytes == 0) {
+        return loaded->size_bytes;
     }
+    return (loaded->size_bytes / loaded->row_bytes - 1) * loaded->stride_bytes + loaded->row_bytes;
+}
 
-    uint32_t width = rdp.texture_tile.line_size_bytes;
-    uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
+// Write protects the texels loaded for the tile and the palette. Returns
+// whether all of them are watched.
+static bool gfx_texture_watch(int tile, const uint8_t *palette, uint32_t palette_size) {
+    bool watched = gfx_write_watch_protect(rdp.loaded_texture[tile].addr, gfx_loaded_texture_span(tile));
+    if (palette_size != 0) {
+        watched = gfx_write_watch_protect(palette, palette_size) && watched;
+    }
+    return watched;
+}
 
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+static bool gfx_texture_written(int tile, const uint8_t *palette, uint32_t palette_size, uint32_t stamp) {
+    return gfx_write_watch_written(rdp.loaded_texture[tile].addr, gfx_loaded_texture_span(tile), stamp) ||
+           (palette_size != 0 && gfx_write_watch_written(palette, palette_size, stamp));
 }
 
+static size_t gfx_texture_hash_memo_index(const uint8_t *addr, const uint8_t *palette) {
+    // Textures are often a power of two bytes apart, so mix all address bits
+    uint64_t key = (uint64_t)(uintptr_t)addr ^ ((uint64_t)(uintptr_t)palette << 16);
+    return (key * HASH_PRIME64_1) >> (64 - TEXTURE_HASH_MEMO_BITS);
+}
 
-static void import_texture_ci4(int tile) {
-    uint8_t rgba32_buf[32768];
+// Hash of everything the decoded texture of the tile depends on
+static uint64_t gfx_texture_content_hash(int tile, uint8_t fmt, uint8_t siz) {
+    const uint8_t *addr = rdp.loaded_texture[tile].addr;
+    uint32_t size_bytes = rdp.loaded_texture[tile].size_bytes;
+    uint32_t stride_bytes = rdp.loaded_texture[tile].stride_bytes;
+    uint32_t line_size_bytes = rdp.texture_tile.line_size_bytes;
+    uint32_t palette_size = gfx_texture_palette_size(fmt, siz);
+    const uint8_t *palette = palette_size != 0 ? rdp.palette : NULL;
     
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes * 2; i++) {
-        uint8_t byte = rdp.loaded_texture[tile].addr[i / 2];
-        uint8_t idx = (byte >> (4 - (i % 2) * 4)) & 0xf;
-        uint16_t col16 = (rdp.palette[idx * 2] << 8) | rdp.palette[idx * 2 + 1]; // Big endian load
-        uint8_t a = col16 & 1;
-        uint8_t r = col16 >> 11;
-        uint8_t g = (col16 >> 6) & 0x1f;
-        uint8_t b = (col16 >> 1) & 0x1f;
-        rgba32_buf[4*i + 0] = SCALE_5_8(r);
-        rgba32_buf[4*i + 1] = SCALE_5_8(g);
-        rgba32_buf[4*i + 2] = SCALE_5_8(b);
-        rgba32_buf[4*i + 3] = a ? 255 : 0;
+    size_t i = gfx_texture_hash_memo_index(addr, palette);
+    if (texture_hashing.memo[i].addr == addr && texture_hashing.memo[i].palette == palette &&
+        texture_hashing.memo[i].size_bytes == size_bytes && texture_hashing.memo[i].line_size_bytes == line_size_bytes &&
+        texture_hashing.memo[i].stride_bytes == stride_bytes && texture_hashing.memo[i].fmt == fmt && texture_hashing.memo[i].siz == siz) {
+        if (texture_hashing.memo[i].frame == texture_hashing.frame) {
+            return texture_hashing.memo[i].hash;
+        }
+        if (write_watch.enabled && texture_hashing.memo[i].write_watched &&
+            !gfx_texture_written(tile, palette, palette_size, texture_hashing.memo[i].write_stamp)) {
+            texture_hashing.memo[i].frame = texture_hashing.frame;
+            return texture_hashing.memo[i].hash;
+        }
     }
     
-    uint32_t width = rdp.texture_tile.line_size_bytes * 2;
-    uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
+    if (write_watch.enabled) {
+        texture_hashing.memo[i].write_stamp = gfx_write_watch_stamp();
+        texture_hashing.memo[i].write_watched = gfx_texture_watch(tile, palette, palette_size);
+    } else {
+        texture_hashing.memo[i].write_watched = false;
+    }
+    uint64_t hash = gfx_hash64(gfx_loaded_texels(tile), size_bytes, ((uint64_t)line_size_bytes << 8) | (fmt << 4) | siz);
+    if (palette != NULL) {
+        hash = gfx_hash64(palette, palette_size, hash);
+    }
+    frame_stats.texture_bytes_hashed += size_bytes;
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    texture_hashing.memo[i].addr = addr;
+    texture_hashing.memo[i].palette = palette;
+    texture_hashing.memo[i].size_bytes = size_bytes;
+    texture_hashing.memo[i].line_size_bytes = line_size_bytes;
+    texture_hashing.memo[i].stride_bytes = stride_bytes;
+    texture_hashing.memo[i].fmt = fmt;
+    texture_hashing.memo[i].siz = siz;
+    texture_hashing.memo[i].frame = texture_hashing.frame;
+    texture_hashing.memo[i].hash = hash;
+    return hash;
 }
 
-static void import_texture_ci8(int tile) {
-    uint8_t rgba32_buf[16384];
+static void gfx_texture_cache_lru_unlink(struct TextureHashmapNode *node) {
+    if (node->lru_prev != NULL) {
+        node->lru_prev->lru_next = node->lru_next;
+    } else {
+        gfx_texture_cache.lru_head = node->lru_next;
+    }
+    if (node->lru_next != NULL) {
+        node->lru_next->lru_prev = node->lru_prev;
+    } else {
+        gfx_texture_cache.lru_tail = node->lru_prev;
+    }
+}
+
+static void gfx_texture_cache_lru_push_front(struct TextureHashmapNode *node) {
+    node->lru_prev = NULL;
+    node->lru_next = gfx_texture_cache.lru_head;
+    if (gfx_texture_cache.lru_head != NULL) {
+        gfx_texture_cache.lru_head->lru_prev = node;
+    } else {
+        gfx_texture_cache.lru_tail = node;
+    }
+    gfx_texture_cache.lru_head = node;
+}
+
+static struct TextureHashmapNode *gfx_texture_cache_evict(void) {
+    struct TextureHashmapNode *node = gfx_texture_cache.lru_tail;
+    while (node == rendering_state.textures[0] || node == rendering_state.textures[1]) {
+        // Buffered triangles may still use it
+        node = node->lru_prev;
+    }
+    struct TextureHashmapNode **link = &gfx_texture_cache.hashmap[gfx_texture_cache_hash(node->texture_addr, node->content_hash)];
+    while (*link != node) {
+        link = &(*link)->next;
+    }
+    *link = node->next;
+    gfx_texture_cache_lru_unlink(node);
+    gfx_texture_cache.size_bytes -= node->size_bytes;
+    frame_stats.texture_cache_evictions++;
+    return node;
+}
+
+// Drops all cached textures, deleting them if the rendering API supports it
+static void gfx_texture_cache_clear(void) {
+    for (uint32_t i = 0; i < gfx_texture_cache.pool_pos; i++) {
+        if (gfx_rapi->delete_texture != NULL) {
+            gfx_rapi->delete_texture(gfx_texture_cache.pool[i].texture_id);
+            gfx_texture_cache.pool[i].texture_addr = NULL;
+        }
+    }
+    memset(gfx_texture_cache.hashmap, 0, sizeof(gfx_texture_cache.hashmap));
+    gfx_texture_cache.pool_pos = 0;
+    gfx_texture_cache.lru_head = NULL;
+    gfx_texture_cache.lru_tail = NULL;
+    gfx_texture_cache.size_bytes = 0;
+    texture_pack.num_pending = 0;
+    for (int i = 0; i < TEXTURE_IMAGE_COUNT; i++) {
+        texture_images.images[i].addr = NULL;
+    }
+    rendering_state.textures[0] = NULL;
+    rendering_state.textures[1] = NULL;
+    rdp.textures_changed[0] = true;
+    rdp.textures_changed[1] = true;
+    rdp.state_dirty |= DIRTY_TEXTURE;
+}
+
+static void gfx_texture_cache_set_capacity(uint32_t capacity) {
+    // At least one node besides the textures bound to the two tiles
+    if (capacity < 3) {
+        capacity = 3;
+    }
+    if (capacity != gfx_texture_cache.capacity) {
+        gfx_texture_cache_clear();
+        if (capacity < gfx_texture_cache.capacity && gfx_rapi->delete_texture == NULL) {
+            // Keep the textures of the dropped nodes, which still have them
+            gfx_texture_cache.spare_texture_ids = realloc(gfx_texture_cache.spare_texture_ids,
+                (gfx_texture_cache.num_spare_texture_ids + gfx_texture_cache.capacity - capacity) * sizeof(uint32_t));
+            for (uint32_t i = capacity; i < gfx_texture_cache.capacity; i++) {
+                if (gfx_texture_cache.pool[i].texture_addr != NULL) {
+                    gfx_texture_cache.spare_texture_ids[gfx_texture_cache.num_spare_texture_ids++] = gfx_texture_cache.pool[i].texture_id;
+                }
+            }
+        }
+        gfx_texture_cache.pool = realloc(gfx_texture_cache.pool, capacity * sizeof(struct TextureHashmapNode));
+        if (capacity > gfx_texture_cache.capacity) {
+            memset(&gfx_texture_cache.pool[gfx_texture_cache.capacity], 0, (capacity - gfx_texture_cache.capacity) * sizeof(struct TextureHashmapNode));
+        }
+        gfx_texture_cache.capacity = capacity;
+    }
+}
+
+// The shared texture image the node is drawn from, NULL if it has its own texture
+static struct TextureImage *gfx_texture_image_of(const struct TextureHashmapNode *node) {
+    if (node == NULL || node->image_generation == 0) {
+        return NULL;
+    }
+    struct TextureImage *image = &texture_images.images[node->image_index];
+    return image->generation == node->image_generation ? image : NULL;
+}
+
+// Whether the texture of the tile may be drawn from a shared texture image with the current state.
+// The RDP clamps to the slice, while the image is only clamped at its own edges, so
+// only point sampled coordinates within the slice are drawn the same, which
+// gfx_texture_image_covers checks per triangle. Wrapping or mirroring would need the
+// slice on its own, and so would a second texture sampled with the same coordinates.
+static bool gfx_texture_image_usable(int tile) {
+    return texture_images.enabled && rdp.loaded_texture[tile].stride_bytes != 0 && !tri_state.linear_filter &&
+           (rdp.texture_tile.cms & G_TX_CLAMP) && (rdp.texture_tile.cmt & G_TX_CLAMP) && !tri_state.comb->used_textures[tile ^ 1];
+}
+
+static bool gfx_texture_cache_lookup(int tile, struct TextureHashmapNode **n, const uint8_t *orig_addr, uint64_t content_hash, uint32_t fmt, uint32_t siz) {
+    size_t hash = gfx_texture_cache_hash(orig_addr, content_hash);
+    struct TextureHashmapNode **node = &gfx_texture_cache.hashmap[hash];
+    while (*node != NULL) {
+        bool match = texture_hashing.enabled ? (*node)->content_hash == content_hash : (*node)->texture_addr == orig_addr;
+        if (match && (*node)->fmt == fmt && (*node)->siz == siz) {
+            *n = *node;
+            gfx_texture_cache_lru_unlink(*n);
+            gfx_texture_cache_lru_push_front(*n);
+            if (write_watch.enabled && !texture_hashing.enabled) {
+                uint32_t palette_size = gfx_texture_palette_size(fmt, siz);
+                const uint8_t *palette = palette_size != 0 ? rdp.palette : NULL;
+                if (!(*node)->write_watched || (*node)->palette != palette ||
+                    gfx_texture_written(tile, palette, palette_size, (*node)->write_stamp)) {
+                    // Its texels or palette may have been written, so it must be imported again
+                    if (!texture_atlas.enabled && !texture_arrays.enabled) {
+                        gfx_rapi->select_texture(tile, (*node)->texture_id);
+                    }
+                    return false;
+                }
+            }
+            if (texture_atlas.enabled) {
+                if ((*node)->atlas_generation != texture_atlas.pages[(*node)->atlas_page].generation) {
+                    // Its page has been cleared, so it must be uploaded again
+                    return false;
+                }
+                gfx_texture_atlas_bind(tile, (*node)->atlas_page);
+                return true;
+            }
+            if (texture_arrays.enabled) {
+                if ((*node)->array_generation != texture_arrays.arrays[(*node)->array_index].layer_generation[(*node)->array_layer]) {
+                    // Its layer has been reused, so it must be uploaded again
+                    return false;
+                }
+                gfx_texture_array_bind(tile, (*node)->array_index);
+                return true;
+            }
+            if ((*node)->image_generation != 0) {
+                struct TextureImage *image = gfx_texture_image_of(*node);
+                if (image != NULL && !(*node)->image_excluded && gfx_texture_image_usable(tile)) {
+                    gfx_rapi->select_texture(tile, image->texture_id);
+                    return true;
+                }
+                // Its image has been replaced, or it can't be drawn from it now, so it
+                // must be imported again, into its own texture if need be
+                (*node)->image_generation = 0;
+                gfx_rapi->select_texture(tile, (*node)->texture_id);
+                return false;
+            }
+            gfx_rapi->select_texture(tile, (*node)->texture_id);
+            return true;
+        }
+        node = &(*node)->next;
+    }
+    struct TextureHashmapNode *new_node;
+    if (gfx_texture_cache.pool_pos < gfx_texture_cache.capacity) {
+        new_node = &gfx_texture_cache.pool[gfx_texture_cache.pool_pos++];
+        if (new_node->texture_addr == NULL) {
+            new_node->texture_id = gfx_texture_cache.num_spare_texture_ids != 0
+                                       ? gfx_texture_cache.spare_texture_ids[--gfx_texture_cache.num_spare_texture_ids]
+                                       : gfx_rapi->new_texture();
+        }
+    } else {
+        new_node = gfx_texture_cache_evict();
+    }
+    if (!texture_atlas.enabled && !texture_arrays.enabled) {
+        gfx_rapi->select_texture(tile, new_node->texture_id);
+        gfx_rapi->set_sampler_parameters(tile, false, 0, 0);
+    }
+    new_node->atlas_generation = 0;
+    new_node->array_generation = 0;
+    new_node->image_generation = 0;
+    new_node->image_excluded = false;
+    new_node->cms = 0;
+    new_node->cmt = 0;
+    new_node->linear_filter = false;
+    new_node->size_bytes = 0;
+    new_node->palette_indexed = false;
+    new_node->replacement = NULL;
+    new_node->write_watched = false;
+    new_node->next = gfx_texture_cache.hashmap[hash];
+    gfx_texture_cache.hashmap[hash] = new_node;
+    gfx_texture_cache_lru_push_front(new_node);
+    new_node->texture_addr = orig_addr;
+    new_node->content_hash = content_hash;
+    new_node->fmt = fmt;
+    new_node->siz = siz;
+    *n = new_node;
+    return false;
+}
+
+#ifdef GFX_SIMD_BYTES
+// Stores 16 texels as I, I, I, A from their intensity and alpha bytes
+static inline void gfx_store_ia_texels(uint8_t *rgba32_buf, gfx_vb intensity, gfx_vb alpha) {
+    gfx_vb ii = vb_zip_lo_u8(intensity, intensity);
+    gfx_vb ia = vb_zip_lo_u8(intensity, alpha);
+    vb_store(rgba32_buf, vb_zip_lo_u16(ii, ia));
+    vb_store(rgba32_buf + 16, vb_zip_hi_u16(ii, ia));
+    ii = vb_zip_hi_u8(intensity, intensity);
+    ia = vb_zip_hi_u8(intensity, alpha);
+    vb_store(rgba32_buf + 32, vb_zip_lo_u16(ii, ia));
+    vb_store(rgba32_buf + 48, vb_zip_hi_u16(ii, ia));
+}
+
+// Splits 16 bytes into 32 4-bit values in texel order (high nibble first)
+static inline void gfx_split_nibbles(gfx_vb bytes, gfx_vb *first, gfx_vb *second) {
+    gfx_vb mask = vb_set1_u8(0x0f);
+    gfx_vb high = vb_and(vb_shr_u16(bytes, 4), mask);
+    gfx_vb low = vb_and(bytes, mask);
+    *first = vb_zip_lo_u8(high, low);
+    *second = vb_zip_hi_u8(high, low);
+}
+#endif
+
+// Decodes big endian RGBA 5551 texels, as used by RGBA16 textures and palettes
+static void gfx_decode_rgba16(uint8_t *rgba32_buf, const uint8_t *addr, uint32_t num_texels) {
+    uint32_t i = 0;
     
-    for (uint32_t i = 0; i < rdp.loaded_texture[tile].size_bytes; i++) {
-        uint8_t idx = rdp.loaded_texture[tile].addr[i];
-        uint16_t col16 = (rdp.palette[idx * 2] << 8) | rdp.palette[idx * 2 + 1]; // Big endian load
+#ifdef GFX_SIMD_BYTES
+    // SCALE_5_8 on 16-bit lanes
+    gfx_vb mask5 = vb_set1_u16(0x1f);
+    gfx_vb scale5 = vb_set1_u16(1053);
+    for (; i + 8 <= num_texels; i += 8) {
+        gfx_vb col16 = vb_load(addr + 2 * i);
+        col16 = vb_or(vb_shl_u16(col16, 8), vb_shr_u16(col16, 8));
+        gfx_vb r = vb_shr_u16(vb_mul_u16(vb_shr_u16(col16, 11), scale5), 7);
+        gfx_vb g = vb_shr_u16(vb_mul_u16(vb_and(vb_shr_u16(col16, 6), mask5), scale5), 7);
+        gfx_vb b = vb_shr_u16(vb_mul_u16(vb_and(vb_shr_u16(col16, 1), mask5), scale5), 7);
+        gfx_vb a = vb_mul_u16(vb_and(col16, vb_set1_u16(1)), vb_set1_u16(0xff00));
+        gfx_vb rg = vb_or(r, vb_shl_u16(g, 8));
+        gfx_vb ba = vb_or(b, a);
+        vb_store(rgba32_buf + 4 * i, vb_zip_lo_u16(rg, ba));
+        vb_store(rgba32_buf + 4 * i + 16, vb_zip_hi_u16(rg, ba));
+    }
+#endif
+    for (; i < num_texels; i++) {
+        uint16_t col16 = (addr[2 * i] << 8) | addr[2 * i + 1];
         uint8_t a = col16 & 1;
         uint8_t r = col16 >> 11;
         uint8_t g = (col16 >> 6) & 0x1f;
@@ -456,61 +1392,819 @@ static void import_texture_ci8(int tile) {
         rgba32_buf[4*i + 2] = SCALE_5_8(b);
         rgba32_buf[4*i + 3] = a ? 255 : 0;
     }
+}
+
+// Returns the decoded palette for the TLUT, decoding it unless a cached palette
+// was decoded from the same address and bytes. Entries that weren't loaded are
+// black.
+static struct PaletteCacheEntry *gfx_palette_cache_lookup(const uint8_t *addr, uint32_t size_bytes) {
+    if (size_bytes > sizeof(palette_cache.entries[0].tlut)) {
+        size_bytes = sizeof(palette_cache.entries[0].tlut);
+    }
+    for (int i = 0; i < PALETTE_CACHE_SIZE; i++) {
+        if (palette_cache.entries[i].addr == addr && palette_cache.entries[i].size_bytes == size_bytes &&
+            memcmp(palette_cache.entries[i].tlut, addr, size_bytes) == 0) {
+            return &palette_cache.entries[i];
+        }
+    }
     
-    uint32_t width = rdp.texture_tile.line_size_bytes;
-    uint32_t height = rdp.loaded_texture[tile].size_bytes / rdp.texture_tile.line_size_bytes;
+    gfx_trace_push("decode_palette", "addr", (uintptr_t)addr, true);
+    struct PaletteCacheEntry *entry = &palette_cache.entries[palette_cache.next];
+    palette_cache.next = (palette_cache.next + 1) % PALETTE_CACHE_SIZE;
+    entry->addr = addr;
+    entry->size_bytes = size_bytes;
+    memcpy(entry->tlut, addr, size_bytes);
+    gfx_decode_rgba16(entry->rgba32, addr, size_bytes / 2);
+    memset(entry->rgba32 + size_bytes * 2, 0, sizeof(entry->rgba32) - size_bytes * 2);
+    entry->texture_uploaded = false;
+    gfx_trace_pop();
+    return entry;
+}
+
+// Binds the palette of the last G_LOADTLUT for the index texture of the tile
+static void gfx_palette_bind(int tile) {
+    struct PaletteCacheEntry *entry = rdp.palette_decoded;
+    struct TextureHashmapNode *tex = rendering_state.textures[tile];
     
-    gfx_rapi->upload_texture(rgba32_buf, width, height);
+    SUPPORT_CHECK(entry != NULL);
+    if (entry == NULL) {
+        return;
+    }
+    if (!entry->texture_created) {
+        entry->texture_id = gfx_rapi->new_texture();
+        entry->texture_created = true;
+    }
+    gfx_rapi->select_palette(tile, entry->texture_id, tex->width, tex->height);
+    if (!entry->texture_uploaded) {
+        gfx_rapi->upload_palette(entry->rgba32);
+        entry->texture_uploaded = true;
+    }
 }
 
-static void import_texture(int tile) {
-    uint8_t fmt = rdp.texture_tile.fmt;
-    uint8_t siz = rdp.texture_tile.siz;
+static void decode_texture_rgba16(const struct TextureDecodeInput *in, struct DecodedTexture *out) {
+    uint32_t width = in->line_size_bytes / 2;
+    uint32_t height = in->size_bytes / in->line_size_bytes;
     
-    if (gfx_texture_cache_lookup(tile, &rendering_state.textures[tile], rdp.loaded_texture[tile].addr, fmt, siz)) {
+    if (compact_textures.enabled) {
+        // The texels already are RGBA 5551, just big endian
+        uint8_t *rgba16_buf = out->data;
+        uint32_t i = 0;
+#ifdef GFX_SIMD_BYTES
+        for (; i + 8 <= in->size_bytes / 2; i += 8) {
+            // Swap the bytes of each 16-bit lane; SIMD hosts are little endian
+            gfx_vb texels = vb_load(in->addr + 2 * i);
+            vb_store(rgba16_buf + 2 * i, vb_or(vb_shl_u16(texels, 8), vb_shr_u16(texels, 8)));
+        }
+#endif
+        for (; i < in->size_bytes / 2; i++) {
+            uint16_t texel = (in->addr[2 * i] << 8) | in->addr[2 * i + 1];
+            memcpy(rgba16_buf + 2 * i, &texel, sizeof(texel));
+        }
+        gfx_decoded_texture(out, DECODED_RGBA5551, rgba16_buf, width, height);
         return;
     }
     
-    int t0 = get_time();
-    if (fmt == G_IM_FMT_RGBA) {
-        if (siz == G_IM_SIZ_16b) {
-            import_texture_rgba16(tile);
-        } else if (siz == G_IM_SIZ_32b) {
-            import_texture_rgba32(tile);
+    uint8_t *rgba32_buf = out->data;
+    gfx_decode_rgba16(rgba32_buf, in->addr, in->size_bytes / 2);
+    
+    gfx_decoded_texture(out, DECODED_RGBA32, rgba32_buf, width, height);
+}
+
+static void decode_texture_rgba32(const struct TextureDecodeInput *in, struct DecodedTexture *out) {
+    uint32_t width = in->line_size_bytes / 2;
+    uint32_t height = (in->size_bytes / 2) / in->line_size_bytes;
+    gfx_decoded_texture(out, DECODED_RGBA32, in->addr, width, height);
+}
+
+static void decode_texture_ia4(const struct TextureDecodeInput *in, struct DecodedTexture *out) {
+    uint32_t width = in->line_size_bytes * 2;
+    uint32_t height = in->size_bytes / in->line_size_bytes;
+    
+    if (compact_textures.enabled) {
+        uint8_t *ia88_buf = out->data;
+        uint32_t i = 0;
+#ifdef GFX_SIMD_BYTES
+        for (; i + 32 <= in->size_bytes * 2; i += 32) {
+            gfx_vb parts[2];
+            gfx_split_nibbles(vb_load(in->addr + i / 2), &parts[0], &parts[1]);
+            for (int j = 0; j < 2; j++) {
+                gfx_vb intensity = vb_and(vb_shr_u16(parts[j], 1), vb_set1_u8(0x07));
+                intensity = vb_or(vb_shl_u16(intensity, 5), vb_shl_u16(intensity, 2));
+                gfx_vb alpha = vb_cmpeq_u8(vb_and(parts[j], vb_set1_u8(1)), vb_set1_u8(1));
+                vb_store(ia88_buf + 2 * i + 32 * j, vb_zip_lo_u8(intensity, alpha));
+                vb_store(ia88_buf + 2 * i + 32 * j + 16, vb_zip_hi_u8(intensity, alpha));
+            }
+        }
+#endif
+        for (; i < in->size_bytes * 2; i++) {
+            uint8_t byte = in->addr[i / 2];
+            uint8_t part = (byte >> (4 - (i % 2) * 4)) & 0xf;
+            ia88_buf[2 * i] = SCALE_3_8(part >> 1);
+            ia88_buf[2 * i + 1] = (part & 1) ? 255 : 0;
+        }
+        gfx_decoded_texture(out, DECODED_IA88, ia88_buf, width, height);
+        return;
+    }
+    
+    uint8_t *rgba32_buf = out->data;
+    uint32_t i = 0;
+    
+#ifdef GFX_SIMD_BYTES
+    for (; i + 32 <= in->size_bytes * 2; i += 32) {
+        gfx_vb parts[2];
+        gfx_split_nibbles(vb_load(in->addr + i / 2), &parts[0], &parts[1]);
+        for (int j = 0; j < 2; j++) {
+            // SCALE_3_8(x) is (x << 5) | (x << 2) for 3-bit x
+            gfx_vb intensity = vb_and(vb_shr_u16(parts[j], 1), vb_set1_u8(0x07));
+            intensity = vb_or(vb_shl_u16(intensity, 5), vb_shl_u16(intensity, 2));
+            gfx_vb alpha = vb_cmpeq_u8(vb_and(parts[j], vb_set1_u8(1)), vb_set1_u8(1));
+            gfx_store_ia_texels(rgba32_buf + 4 * i + 64 * j, intensity, alpha);
+        }
+    }
+#endif
+    for (; i < in->size_bytes * 2; i++) {
+        uint8_t byte = in->addr[i / 2];
+        uint8_t part = (byte >> (4 - (i % 2) * 4)) & 0xf;
+        uint8_t intensity = part >> 1;
+        uint8_t alpha = part & 1;
+        uint8_t r = intensity;
+        uint8_t g = intensity;
+        uint8_t b = intensity;
+        rgba32_buf[4*i + 0] = SCALE_3_8(r);
+        rgba32_buf[4*i + 1] = SCALE_3_8(g);
+        rgba32_buf[4*i + 2] = SCALE_3_8(b);
+        rgba32_buf[4*i + 3] = alpha ? 255 : 0;
+    }
+    
+    gfx_decoded_texture(out, DECODED_RGBA32, rgba32_buf, width, height);
+}
+
+static void decode_texture_ia8(const struct TextureDecodeInput *in, struct DecodedTexture *out) {
+    uint32_t width = in->line_size_bytes;
+    uint32_t height = in->size_bytes / in->line_size_bytes;
+    
+    if (compact_textures.enabled) {
+        uint8_t *ia88_buf = out->data;
+        uint32_t i = 0;
+#ifdef GFX_SIMD_BYTES
+        for (; i + 16 <= in->size_bytes; i += 16) {
+            gfx_vb bytes = vb_load(in->addr + i);
+            gfx_vb high = vb_set1_u8(0xf0), low = vb_set1_u8(0x0f);
+            gfx_vb intensity = vb_or(vb_and(bytes, high), vb_and(vb_shr_u16(bytes, 4), low));
+            gfx_vb alpha = vb_or(vb_and(vb_shl_u16(bytes, 4), high), vb_and(bytes, low));
+            vb_store(ia88_buf + 2 * i, vb_zip_lo_u8(intensity, alpha));
+            vb_store(ia88_buf + 2 * i + 16, vb_zip_hi_u8(intensity, alpha));
+        }
+#endif
+        for (; i < in->size_bytes; i++) {
+            ia88_buf[2 * i] = SCALE_4_8(in->addr[i] >> 4);
+            ia88_buf[2 * i + 1] = SCALE_4_8(in->addr[i] & 0xf);
+        }
+        gfx_decoded_texture(out, DECODED_IA88, ia88_buf, width, height);
+        return;
+    }
+    
+    uint8_t *rgba32_buf = out->data;
+    uint32_t i = 0;
+    
+#ifdef GFX_SIMD_BYTES
+    for (; i + 16 <= in->size_bytes; i += 16) {
+        // SCALE_4_8(x) is (x << 4) | x for 4-bit x
+        gfx_vb bytes = vb_load(in->addr + i);
+        gfx_vb high = vb_set1_u8(0xf0), low = vb_set1_u8(0x0f);
+        gfx_vb intensity = vb_or(vb_and(bytes, high), vb_and(vb_shr_u16(bytes, 4), low));
+        gfx_vb alpha = vb_or(vb_and(vb_shl_u16(bytes, 4), high), vb_and(bytes, low));
+        gfx_store_ia_texels(rgba32_buf + 4 * i, intensity, alpha);
+    }
+#endif
+    for (; i < in->size_bytes; i++) {
+        uint8_t intensity = in->addr[i] >> 4;
+        uint8_t alpha = in->addr[i] & 0xf;
+        uint8_t r = intensity;
+        uint8_t g = intensity;
+        uint8_t b = intensity;
+        rgba32_buf[4*i + 0] = SCALE_4_8(r);
+        rgba32_buf[4*i + 1] = SCALE_4_8(g);
+        rgba32_buf[4*i + 2] = SCALE_4_8(b);
+        rgba32_buf[4*i + 3] = SCALE_4_8(alpha);
+    }
+    
+    gfx_decoded_texture(out, DECODED_RGBA32, rgba32_buf, width, height);
+}
+
+static void decode_texture_ia16(const struct TextureDecodeInput *in, struct DecodedTexture *out) {
+    uint32_t width = in->line_size_bytes / 2;
+    uint32_t height = in->size_bytes / in->line_size_bytes;
+    
+    if (compact_textures.enabled) {
+        // The texels already are an intensity byte followed by an alpha byte
+        gfx_decoded_texture(out, DECODED_IA88, in->addr, width, height);
+        return;
+    }
+    
+    uint8_t *rgba32_buf = out->data;
+    uint32_t i = 0;
+    
+#ifdef GFX_SIMD_BYTES
+    for (; i + 8 <= in->size_bytes / 2; i += 8) {
+        // Each 16-bit lane holds an intensity byte followed by an alpha byte
+        gfx_vb ia = vb_load(in->addr + 2 * i);
+        gfx_vb intensity = vb_and(ia, vb_set1_u16(0xff));
+        gfx_vb ii = vb_or(intensity, vb_shl_u16(intensity, 8));
+        vb_store(rgba32_buf + 4 * i, vb_zip_lo_u16(ii, ia));
+        vb_store(rgba32_buf + 4 * i + 16, vb_zip_hi_u16(ii, ia));
+    }
+#endif
+    for (; i < in->size_bytes / 2; i++) {
+        uint8_t intensity = in->addr[2 * i];
+        uint8_t alpha = in->addr[2 * i + 1];
+        uint8_t r = intensity;
+        uint8_t g = intensity;
+        uint8_t b = intensity;
+        rgba32_buf[4*i + 0] = r;
+        rgba32_buf[4*i + 1] = g;
+        rgba32_buf[4*i + 2] = b;
+        rgba32_buf[4*i + 3] = alpha;
+    }
+    
+    gfx_decoded_texture(out, DECODED_RGBA32, rgba32_buf, width, height);
+}
+
+static void decode_texture_i4(const struct TextureDecodeInput *in, struct DecodedTexture *out) {
+    uint32_t width = in->line_size_bytes * 2;
+    uint32_t height = in->size_bytes / in->line_size_bytes;
+
+    if (compact_textures.enabled) {
+        uint8_t *i8_buf = out->data;
+        uint32_t i = 0;
+#ifdef GFX_SIMD_BYTES
+        for (; i + 32 <= in->size_bytes * 2; i += 32) {
+            gfx_vb parts[2];
+            gfx_split_nibbles(vb_load(in->addr + i / 2), &parts[0], &parts[1]);
+            vb_store(i8_buf + i, vb_or(vb_shl_u16(parts[0], 4), parts[0]));
+            vb_store(i8_buf + i + 16, vb_or(vb_shl_u16(parts[1], 4), parts[1]));
+        }
+#endif
+        for (; i < in->size_bytes * 2; i++) {
+            uint8_t byte = in->addr[i / 2];
+            i8_buf[i] = SCALE_4_8((byte >> (4 - (i % 2) * 4)) & 0xf);
+        }
+        gfx_decoded_texture(out, DECODED_I8, i8_buf, width, height);
+        return;
+    }
+
+    uint8_t *rgba32_buf = out->data;
+    uint32_t i = 0;
+
+#ifdef GFX_SIMD_BYTES
+    for (; i + 32 <= in->size_bytes * 2; i += 32) {
+        gfx_vb parts[2];
+        gfx_split_nibbles(vb_load(in->addr + i / 2), &parts[0], &parts[1]);
+        for (int j = 0; j < 2; j++) {
+            gfx_vb intensity = vb_or(vb_shl_u16(parts[j], 4), parts[j]);
+            gfx_store_ia_texels(rgba32_buf + 4 * i + 64 * j, intensity, vb_set1_u8(0xff));
+        }
+    }
+#endif
+    for (; i < in->size_bytes * 2; i++) {
+        uint8_t byte = in->addr[i / 2];
+        uint8_t part = (byte >> (4 - (i % 2) * 4)) & 0xf;
+        uint8_t intensity = part;
+        uint8_t r = intensity;
+        uint8_t g = intensity;
+        uint8_t b = intensity;
+        rgba32_buf[4*i + 0] = SCALE_4_8(r);
+        rgba32_buf[4*i + 1] = SCALE_4_8(g);
+        rgba32_buf[4*i + 2] = SCALE_4_8(b);
+        rgba32_buf[4*i + 3] = 255;
+    }
+
+    gfx_decoded_texture(out, DECODED_RGBA32, rgba32_buf, width, height);
+}
+
+static void decode_texture_i8(const struct TextureDecodeInput *in, struct DecodedTexture *out) {
+    uint32_t width = in->line_size_bytes;
+    uint32_t height = in->size_bytes / in->line_size_bytes;
+
+    if (compact_textures.enabled) {
+        // The texels already are the intensities
+        gfx_decoded_texture(out, DECODED_I8, in->addr, width, height);
+        return;
+    }
+
+    uint8_t *rgba32_buf = out->data;
+    uint32_t i = 0;
+
+#ifdef GFX_SIMD_BYTES
+    for (; i + 16 <= in->size_bytes; i += 16) {
+        gfx_store_ia_texels(rgba32_buf + 4 * i, vb_load(in->addr + i), vb_set1_u8(0xff));
+    }
+#endif
+    for (; i < in->size_bytes; i++) {
+        uint8_t intensity = in->addr[i];
+        uint8_t r = intensity;
+        uint8_t g = intensity;
+        uint8_t b = intensity;
+        rgba32_buf[4*i + 0] = r;
+        rgba32_buf[4*i + 1] = g;
+        rgba32_buf[4*i + 2] = b;
+        rgba32_buf[4*i + 3] = 255;
+    }
+
+    gfx_decoded_texture(out, DECODED_RGBA32, rgba32_buf, width, height);
+}
+
+
+// Palettes are decoded by G_LOADTLUT (see gfx_palette_cache_lookup), so CI
+// textures only copy one RGBA32 entry per texel. With palette textures, they
+// are uploaded as indices instead.
+
+static void decode_texture_ci4(const struct TextureDecodeInput *in, struct DecodedTexture *out) {
+    uint32_t width = in->line_size_bytes * 2;
+    uint32_t height = in->size_bytes / in->line_size_bytes;
+    
+    if (palette_textures.enabled) {
+        uint8_t *index_buf = out->data;
+        uint32_t i = 0;
+#ifdef GFX_SIMD_BYTES
+        for (; i + 16 <= in->size_bytes; i += 16) {
+            gfx_vb first, second;
+            gfx_split_nibbles(vb_load(in->addr + i), &first, &second);
+            vb_store(index_buf + 2 * i, first);
+            vb_store(index_buf + 2 * i + 16, second);
+        }
+#endif
+        for (; i < in->size_bytes; i++) {
+            uint8_t byte = in->addr[i];
+            index_buf[2 * i] = byte >> 4;
+            index_buf[2 * i + 1] = byte & 0xf;
+        }
+        gfx_decoded_texture(out, DECODED_INDICES, index_buf, width, height);
+        return;
+    }
+    
+    uint8_t *rgba32_buf = out->data;
+    SUPPORT_CHECK(in->palette_rgba32 != NULL);
+    const uint8_t *palette = in->palette_rgba32;
+    for (uint32_t i = 0; i < in->size_bytes; i++) {
+        uint8_t byte = in->addr[i];
+        memcpy(rgba32_buf + 8 * i, palette + 4 * (byte >> 4), 4);
+        memcpy(rgba32_buf + 8 * i + 4, palette + 4 * (byte & 0xf), 4);
+    }
+    
+    gfx_decoded_texture(out, DECODED_RGBA32, rgba32_buf, width, height);
+}
+
+static void decode_texture_ci8(const struct TextureDecodeInput *in, struct DecodedTexture *out) {
+    uint32_t width = in->line_size_bytes;
+    uint32_t height = in->size_bytes / in->line_size_bytes;
+    
+    if (palette_textures.enabled) {
+        // The texels already are the indices
+        gfx_decoded_texture(out, DECODED_INDICES, in->addr, width, height);
+        return;
+    }
+    
+    uint8_t *rgba32_buf = out->data;
+    SUPPORT_CHECK(in->palette_rgba32 != NULL);
+    const uint8_t *palette = in->palette_rgba32;
+    for (uint32_t i = 0; i < in->size_bytes; i++) {
+        memcpy(rgba32_buf + 4 * i, palette + 4 * in->addr[i], 4);
+    }
+    
+    gfx_decoded_texture(out, DECODED_RGBA32, rgba32_buf, width, height);
+}
+
+static void gfx_decode_texture(const struct TextureDecodeInput *in, struct DecodedTexture *out) {
+    if (in->fmt == G_IM_FMT_RGBA) {
+        if (in->siz == G_IM_SIZ_16b) {
+            decode_texture_rgba16(in, out);
+        } else if (in->siz == G_IM_SIZ_32b) {
+            decode_texture_rgba32(in, out);
         } else {
             abort();
         }
-    } else if (fmt == G_IM_FMT_IA) {
-        if (siz == G_IM_SIZ_4b) {
-            import_texture_ia4(tile);
-        } else if (siz == G_IM_SIZ_8b) {
-            import_texture_ia8(tile);
-        } else if (siz == G_IM_SIZ_16b) {
-            import_texture_ia16(tile);
+    } else if (in->fmt == G_IM_FMT_IA) {
+        if (in->siz == G_IM_SIZ_4b) {
+            decode_texture_ia4(in, out);
+        } else if (in->siz == G_IM_SIZ_8b) {
+            decode_texture_ia8(in, out);
+        } else if (in->siz == G_IM_SIZ_16b) {
+            decode_texture_ia16(in, out);
         } else {
             abort();
         }
-    } else if (fmt == G_IM_FMT_CI) {
-        if (siz == G_IM_SIZ_4b) {
-            import_texture_ci4(tile);
-        } else if (siz == G_IM_SIZ_8b) {
-            import_texture_ci8(tile);
+    } else if (in->fmt == G_IM_FMT_CI) {
+        if (in->siz == G_IM_SIZ_4b) {
+            decode_texture_ci4(in, out);
+        } else if (in->siz == G_IM_SIZ_8b) {
+            decode_texture_ci8(in, out);
         } else {
             abort();
         }
-    } else if (fmt == G_IM_FMT_I) {
-        if (siz == G_IM_SIZ_4b) {
-            import_texture_i4(tile);
-        } else if (siz == G_IM_SIZ_8b) {
-            import_texture_i8(tile);
+    } else if (in->fmt == G_IM_FMT_I) {
+        if (in->siz == G_IM_SIZ_4b) {
+            decode_texture_i4(in, out);
+        } else if (in->siz == G_IM_SIZ_8b) {
+            decode_texture_i8(in, out);
         } else {
             abort();
         }
     } else {
         abort();
     }
-    int t1 = get_time();
-    //printf("Time diff: %d\n", t1 - t0);
+}
+
+// Whether textures of the format are decoded, rather than uploaded from their loaded texels
+static bool gfx_texture_needs_decode(uint8_t fmt, uint8_t siz) {
+    switch (fmt) {
+        case G_IM_FMT_RGBA:
+            return siz == G_IM_SIZ_16b;
+        case G_IM_FMT_IA:
+            return siz == G_IM_SIZ_4b || siz == G_IM_SIZ_8b || (siz == G_IM_SIZ_16b && !compact_textures.enabled);
+        case G_IM_FMT_I:
+            return siz == G_IM_SIZ_4b || (siz == G_IM_SIZ_8b && !compact_textures.enabled);
+        case G_IM_FMT_CI:
+            return siz == G_IM_SIZ_4b || (siz == G_IM_SIZ_8b && !palette_textures.enabled);
+    }
+    return false;
+}
+
+// Runs on a worker thread
+static void gfx_texture_decode_job_run(struct GfxWorkerJob *work) {
+    struct TextureDecodeJob *job = (struct TextureDecodeJob *)work;
+    if (job->in.palette != NULL) {
+        // Decoded like gfx_palette_cache_lookup does
+        gfx_decode_rgba16(job->palette_rgba32, job->in.palette, job->in.palette_size / 2);
+        memset(job->palette_rgba32 + job->in.palette_size * 2, 0, sizeof(job->palette_rgba32) - job->in.palette_size * 2);
+        job->in.palette_rgba32 = job->palette_rgba32;
+    }
+    gfx_decode_texture(&job->in, &job->decoded);
+}
+
+static struct TextureDecodeJob *gfx_texture_decode_find(const struct TextureDecodeInput *in) {
+    for (int i = 0; i < TEXTURE_DECODE_JOBS; i++) {
+        struct TextureDecodeJob *job = &texture_decode.jobs[i];
+        if (job->submitted && job->in.addr == in->addr && job->in.size_bytes == in->size_bytes &&
+            job->in.line_size_bytes == in->line_size_bytes && job->in.fmt == in->fmt && job->in.siz == in->siz &&
+            job->in.palette == in->palette && job->in.palette_size == in->palette_size) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// Frees a job whose texture was imported. Jobs submitted before it will likely
+// not be imported anymore, so they are dropped too, unless they are running.
+static void gfx_texture_decode_release(struct TextureDecodeJob *used) {
+    used->submitted = false;
+    for (int i = 0; i < TEXTURE_DECODE_JOBS; i++) {
+        struct TextureDecodeJob *job = &texture_decode.jobs[i];
+        if (job->submitted && (int32_t)(job->seq - used->seq) < 0 && gfx_worker_pool_cancel(&job->work)) {
+            job->submitted = false;
+        }
+    }
+}
+
+// Drops the remaining jobs at the end of the frame
+static void gfx_texture_decode_finish(void) {
+    for (int i = 0; i < TEXTURE_DECODE_JOBS; i++) {
+        struct TextureDecodeJob *job = &texture_decode.jobs[i];
+        if (job->submitted) {
+            if (!gfx_worker_pool_cancel(&job->work)) {
+                gfx_worker_pool_wait(&job->work);
+            }
+            job->submitted = false;
+        }
+    }
+    texture_decode.lookahead.depth = 0;
+}
+
+static uint32_t gfx_decoded_texel_size(enum DecodedTextureFormat format) {
+    switch (format) {
+        case DECODED_RGBA32:
+            return 4;
+        case DECODED_RGBA5551:
+        case DECODED_IA88:
+            return 2;
+        case DECODED_INDICES:
+        case DECODED_I8:
+            break;
+    }
+    return 1;
+}
+
+// Format and size of the loaded texels, as in the keys of the disk cache and texture packs
+static uint64_t gfx_texture_key_params(const struct TextureDecodeInput *in) {
+    return in->size_bytes | ((uint64_t)in->line_size_bytes << 16) | ((uint64_t)in->fmt << 32) | ((uint64_t)in->siz << 36);
+}
+
+static void gfx_texture_disk_cache_key(const struct TextureDecodeInput *in, struct GfxDiskCacheKey *key) {
+    key->hash = gfx_hash64(in->addr, in->size_bytes, 0);
+    if (in->palette != NULL) {
+        key->hash = gfx_hash64(in->palette, in->palette_size, key->hash);
+    }
+    // The texture modes select the decoded format
+    key->params = gfx_texture_key_params(in) | ((uint64_t)compact_textures.enabled << 40) |
+                  ((uint64_t)palette_textures.enabled << 41) | ((uint64_t)TEXTURE_DISK_CACHE_VERSION << 48);
+}
+
+// Points the decoded texture at its texels in the disk cache. Returns false if it isn't there.
+static bool gfx_texture_disk_cache_get(const struct GfxDiskCacheKey *key, struct DecodedTexture *out) {
+    const uint8_t *payload;
+    size_t size;
+    struct TextureDiskCacheHeader header;
+    if (!gfx_disk_cache_lookup(key, &payload, &size) || size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, payload, sizeof(header));
+    if (header.format > DECODED_I8 || header.width > 8192 || header.height > 8192 || header.width * header.height > 8192 ||
+        size - sizeof(header) != header.width * header.height * gfx_decoded_texel_size(header.format)) {
+        return false;
+    }
+    gfx_decoded_texture(out, header.format, payload + sizeof(header), header.width, header.height);
+    return true;
+}
+
+static void gfx_texture_disk_cache_put(const struct GfxDiskCacheKey *key, const struct DecodedTexture *decoded) {
+    static uint8_t payload[sizeof(struct TextureDiskCacheHeader) + DECODED_TEXTURE_MAX_BYTES];
+    struct TextureDiskCacheHeader header = {decoded->format, decoded->width, decoded->height, 0};
+    uint32_t size = decoded->width * decoded->height * gfx_decoded_texel_size(decoded->format);
+    memcpy(payload, &header, sizeof(header));
+    memcpy(payload + sizeof(header), decoded->buf, size);
+    gfx_disk_cache_put(key, payload, sizeof(header) + size);
+}
+
+// Finds the replacement of the texture, keyed as described in gfx_texture_pack.h
+static const struct GfxTexturePackEntry *gfx_texture_pack_lookup(const struct TextureDecodeInput *in) {
+    uint64_t hash = gfx_hash64(in->addr, in->size_bytes, 0);
+    if (in->fmt == G_IM_FMT_CI && rdp.palette != NULL) {
+        // Whatever the palette texture mode
+        uint32_t palette_size = in->siz == G_IM_SIZ_4b ? 16 * 2 : 256 * 2;
+        if (palette_size > rdp.palette_size_bytes) {
+            palette_size = rdp.palette_size_bytes;
+        }
+        hash = gfx_hash64(rdp.palette, palette_size, hash);
+    }
+    return gfx_texture_pack_find(texture_pack.pack, hash, gfx_texture_key_params(in));
+}
+
+static void gfx_texture_pack_upload(int tile, struct TextureHashmapNode *node, const struct GfxTexturePackEntry *entry) {
+    gfx_rapi->select_texture(tile, node->texture_id);
+    gfx_rapi->upload_texture(gfx_texture_pack_payload(texture_pack.pack, entry), entry->width, entry->height);
+    gfx_texture_pack_release(texture_pack.pack, entry);
+    gfx_texture_cache.size_bytes -= node->size_bytes;
+    node->size_bytes = entry->size;
+    gfx_texture_cache.size_bytes += node->size_bytes;
+    node->palette_indexed = false;
+    node->replacement = NULL;
+    texture_pack.frame_bytes += entry->size;
+    frame_stats.texture_replacements++;
+}
+
+// Replaces the texture in a later frame, reading its replacement from disk meanwhile
+static void gfx_texture_pack_queue(struct TextureHashmapNode *node, const struct GfxTexturePackEntry *entry) {
+    if (texture_pack.num_pending == TEXTURE_PACK_MAX_PENDING) {
+        // Replaced when imported again
+        return;
+    }
+    node->replacement = entry;
+    texture_pack.pending[texture_pack.num_pending++] = node;
+    gfx_texture_pack_prefetch(texture_pack.pack, entry);
+}
+
+// Uploads the queued replacements that fit in the budget, oldest first. The
+// first one is uploaded even if it alone exceeds the budget.
+static void gfx_texture_pack_stream(void) {
+    uint32_t kept = 0;
+    bool uploaded = false;
+    for (uint32_t i = 0; i < texture_pack.num_pending; i++) {
+        struct TextureHashmapNode *node = texture_pack.pending[i];
+        const struct GfxTexturePackEntry *entry = node->replacement;
+        if (entry == NULL) {
+            // Evicted, or queued twice. A reused node has the replacement of its new texture.
+            continue;
+        }
+        if (kept == 0 && (texture_pack.frame_bytes == 0 || texture_pack.frame_bytes + entry->size <= texture_pack.budget_bytes)) {
+            gfx_texture_pack_upload(0, node, entry);
+            uploaded = true;
+        } else {
+            texture_pack.pending[kept++] = node;
+        }
+    }
+    texture_pack.num_pending = kept;
+    if (uploaded) {
+        // Bind the textures of the tiles again
+        rdp.textures_changed[0] = true;
+        rdp.textures_changed[1] = true;
+    }
+}
+
+// Whether the texture loaded into the tile can be drawn from the texture image it is a slice of
+static bool gfx_texture_image_sliceable(int tile, uint8_t fmt, uint8_t siz) {
+    const struct LoadedTexture *loaded = &rdp.loaded_texture[tile];
+    uint32_t texel_shift = siz == G_IM_SIZ_32b ? 2 : siz == G_IM_SIZ_16b ? 1 : 0;
+    return loaded->stride_bytes != 0 && fmt != G_IM_FMT_CI && !gfx_texture_needs_decode(fmt, siz) &&
+           loaded->stride_bytes == (uint32_t)loaded->image_width << texel_shift &&
+           ((uint32_t)loaded->x << texel_shift) + loaded->row_bytes <= loaded->stride_bytes && gfx_texture_image_usable(tile);
+}
+
+// Whether the texture loaded into the tile is a slice of the texture image bound to
+// it, within the uploaded rows, so that it is drawn without switching textures
+static bool gfx_texture_image_continued(int tile) {
+    struct TextureImage *image = gfx_texture_image_of(rendering_state.textures[tile]);
+    const struct LoadedTexture *loaded = &rdp.loaded_texture[tile];
+    if (image == NULL || !gfx_texture_image_sliceable(tile, rdp.texture_tile.fmt, rdp.texture_tile.siz) ||
+        loaded->image_addr != image->addr || loaded->image_width != image->width ||
+        rdp.texture_tile.fmt != image->fmt || rdp.texture_tile.siz != image->siz ||
+        loaded->y < image->row_begin || loaded->y + loaded->size_bytes / loaded->row_bytes > image->row_end) {
+        return false;
+    }
+    // A texture cached at its address must be drawn from the image too
+    for (struct TextureHashmapNode *node = gfx_texture_cache.hashmap[gfx_texture_cache_hash(loaded->addr, 0)]; node != NULL; node = node->next) {
+        if (node->texture_addr == loaded->addr && node->fmt == image->fmt && node->siz == image->siz) {
+            return gfx_texture_image_of(node) == image && !node->image_excluded;
+        }
+    }
+    return true;
+}
+
+// Takes the next texture image that the other tile isn't drawn from
+static struct TextureImage *gfx_texture_image_alloc(int tile) {
+    for (int i = 0; i < TEXTURE_IMAGE_COUNT; i++) {
+        struct TextureImage *image = &texture_images.images[texture_images.next];
+        texture_images.next = (texture_images.next + 1) % TEXTURE_IMAGE_COUNT;
+        if (image == gfx_texture_image_of(rendering_state.textures[tile ^ 1])) {
+            continue;
+        }
+        if (image->generation == 0) {
+            image->texture_id = gfx_rapi->new_texture();
+            gfx_rapi->select_texture(tile, image->texture_id);
+            gfx_rapi->set_sampler_parameters(tile, false, 0, 0);
+            image->cms = 0;
+            image->cmt = 0;
+            image->linear_filter = false;
+        }
+        // Invalidates the slices of the image it held
+        image->generation++;
+        return image;
+    }
+    return NULL;
+}
+
+// Draws the texture loaded into the tile from the texture image it is a slice of,
+// uploading the image rows it spans unless they already are. Returns false if it
+// needs a texture of its own.
+static bool gfx_texture_image_share(int tile, uint8_t fmt, uint8_t siz) {
+    if (rendering_state.textures[tile]->image_excluded || !gfx_texture_image_sliceable(tile, fmt, siz)) {
+        return false;
+    }
+    const struct LoadedTexture *loaded = &rdp.loaded_texture[tile];
+    uint32_t row_begin = loaded->y;
+    uint32_t row_end = loaded->y + loaded->size_bytes / loaded->row_bytes;
+    struct TextureImage *image = NULL;
+    for (int i = 0; i < TEXTURE_IMAGE_COUNT && image == NULL; i++) {
+        struct TextureImage *candidate = &texture_images.images[i];
+        if (candidate->addr == loaded->image_addr && candidate->width == loaded->image_width && candidate->fmt == fmt && candidate->siz == siz) {
+            image = candidate;
+        }
+    }
+    if (image != NULL && image->row_begin <= row_begin && row_end <= image->row_end) {
+        gfx_rapi->select_texture(tile, image->texture_id);
+        frame_stats.texture_image_slices++;
+    } else {
+        if (image != NULL) {
+            // Upload the rows of the earlier slices too
+            row_begin = image->row_begin < row_begin ? image->row_begin : row_begin;
+            row_end = image->row_end > row_end ? image->row_end : row_end;
+        }
+        if ((row_end - row_begin) * loaded->stride_bytes > TEXTURE_IMAGE_MAX_BYTES) {
+            return false;
+        }
+        if (image == NULL && (image = gfx_texture_image_alloc(tile)) == NULL) {
+            return false;
+        }
+        image->addr = loaded->image_addr;
+        image->width = loaded->image_width;
+        image->fmt = fmt;
+        image->siz = siz;
+        image->row_begin = row_begin;
+        image->row_end = row_end;
+        gfx_rapi->select_texture(tile, image->texture_id);
+        const uint8_t *rows = loaded->image_addr + row_begin * loaded->stride_bytes;
+        switch (fmt) {
+            case G_IM_FMT_RGBA:
+                gfx_rapi->upload_texture(rows, image->width, row_end - row_begin);
+                break;
+            case G_IM_FMT_IA:
+                gfx_rapi->upload_texture_format(rows, image->width, row_end - row_begin, GFX_TEXTURE_FORMAT_IA88);
+                break;
+            case G_IM_FMT_I:
+                gfx_rapi->upload_texture_format(rows, image->width, row_end - row_begin, GFX_TEXTURE_FORMAT_I8);
+                break;
+        }
+    }
+    struct TextureHashmapNode *node = rendering_state.textures[tile];
+    node->image_index = image - texture_images.images;
+    node->image_generation = image->generation;
+    node->image_x = loaded->x;
+    node->image_y = loaded->y;
+    node->palette_indexed = false;
+    return true;
+}
+
+static void import_texture(int tile) {
+    uint8_t fmt = rdp.texture_tile.fmt;
+    uint8_t siz = rdp.texture_tile.siz;
+    
+    enum GfxStage prev_stage = gfx_stage_enter(GFX_STAGE_TEXTURE_IMPORT);
+    uint64_t content_hash = texture_hashing.enabled ? gfx_texture_content_hash(tile, fmt, siz) : 0;
+    if (gfx_texture_cache_lookup(tile, &rendering_state.textures[tile], rdp.loaded_texture[tile].addr, content_hash, fmt, siz)) {
+        frame_stats.texture_cache_hits++;
+        gfx_stage_leave(prev_stage);
+        return;
+    }
+    frame_stats.texture_cache_misses++;
+    gfx_trace_push("import_texture", "addr", (uintptr_t)rdp.loaded_texture[tile].addr, true);
+    
+    if (write_watch.enabled && !texture_hashing.enabled) {
+        // Protect before decoding, so that no write is missed
+        struct TextureHashmapNode *node = rendering_state.textures[tile];
+        uint32_t palette_size = gfx_texture_palette_size(fmt, siz);
+        node->palette = palette_size != 0 ? rdp.palette : NULL;
+        node->write_stamp = gfx_write_watch_stamp();
+        node->write_watched = gfx_texture_watch(tile, node->palette, palette_size);
+    }
+    if (texture_images.enabled && gfx_texture_image_share(tile, fmt, siz)) {
+        gfx_trace_pop();
+        gfx_stage_leave(prev_stage);
+        return;
+    }
+    
+    // Sub-rectangles that need no decoding are uploaded straight from their rows
+    bool direct = rdp.loaded_texture[tile].stride_bytes != 0 && texture_row_length.enabled && !texture_pack.enabled &&
+                  !gfx_texture_needs_decode(fmt, siz);
+    struct TextureDecodeInput in;
+    in.addr = direct ? rdp.loaded_texture[tile].addr : gfx_loaded_texels(tile);
+    in.size_bytes = rdp.loaded_texture[tile].size_bytes;
+    in.line_size_bytes = rdp.texture_tile.line_size_bytes;
+    in.fmt = fmt;
+    in.siz = siz;
+    in.palette = NULL;
+    in.palette_size = 0;
+    in.palette_rgba32 = rdp.palette_decoded != NULL ? rdp.palette_decoded->rgba32 : NULL;
+    if (fmt == G_IM_FMT_CI && !palette_textures.enabled) {
+        in.palette = rdp.palette;
+        in.palette_size = rdp.palette_size_bytes < 512 ? rdp.palette_size_bytes : 512;
+    }
+    const struct GfxTexturePackEntry *replacement = texture_pack.enabled ? gfx_texture_pack_lookup(&in) : NULL;
+    if (replacement != NULL && texture_pack.frame_bytes + replacement->size <= texture_pack.budget_bytes) {
+        gfx_texture_pack_upload(tile, rendering_state.textures[tile], replacement);
+        gfx_trace_pop();
+        gfx_stage_leave(prev_stage);
+        return;
+    }
+    struct GfxDiskCacheKey disk_key;
+    bool disk_cached = texture_disk_cache.enabled && gfx_texture_needs_decode(fmt, siz);
+    if (disk_cached) {
+        gfx_texture_disk_cache_key(&in, &disk_key);
+    }
+    struct TextureDecodeJob *job = texture_decode.enabled ? gfx_texture_decode_find(&in) : NULL;
+    static struct DecodedTexture decoded;
+    if (job != NULL) {
+        gfx_worker_pool_wait(&job->work);
+        gfx_upload_decoded_texture(tile, &job->decoded);
+        if (disk_cached) {
+            gfx_texture_disk_cache_put(&disk_key, &job->decoded);
+        }
+        gfx_texture_decode_release(job);
+        frame_stats.texture_decodes_ahead++;
+    } else if (disk_cached && gfx_texture_disk_cache_get(&disk_key, &decoded)) {
+        gfx_upload_decoded_texture(tile, &decoded);
+        frame_stats.texture_disk_cache_hits++;
+    } else {
+        static uint8_t decoded_texels[DECODED_TEXTURE_MAX_BYTES];
+        // Texels that go to the disk cache too are read back, so they stay in system memory
+        decoded.data = texture_staging.enabled && !disk_cached && gfx_texture_needs_decode(fmt, siz) ?
+                       gfx_rapi->map_texture_staging(DECODED_TEXTURE_MAX_BYTES) : NULL;
+        if (decoded.data == NULL) {
+            decoded.data = decoded_texels;
+        }
+        gfx_decode_texture(&in, &decoded);
+        if (direct) {
+            decoded.row_length = rdp.loaded_texture[tile].stride_bytes / gfx_decoded_texel_size(decoded.format);
+        }
+        gfx_upload_decoded_texture(tile, &decoded);
+        if (disk_cached) {
+            gfx_texture_disk_cache_put(&disk_key, &decoded);
+        }
+    }
+    if (replacement != NULL) {
+        // The decoded texture stands in until then
+        gfx_texture_pack_queue(rendering_state.textures[tile], replacement);
+    }
+    gfx_trace_pop();
+    gfx_stage_leave(prev_stage);
 }
 
 static void gfx_normalize_vector(float v[3]) {
@@ -551,6 +2245,7 @@ static void gfx_matrix_mul(float res[4][4], const float a[4][4], const float b[4
 
 static void gfx_sp_matrix(uint8_t parameters, const int32_t *addr) {
     float matrix[4][4];
+    gfx_capture_touch(addr, sizeof(Mtx));
 #ifndef GBI_FLOATS
     // Original GBI where fixed point matrices are used
     for (int i = 0; i < 4; i++) {
@@ -596,127 +2291,461 @@ static void gfx_sp_pop_matrix(uint32_t count) {
             }
         }
     }
-}
-
-static float gfx_adjust_x_for_aspect_ratio(float x) {
-    return x * (4.0f / 3.0f) / ((float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height);
-}
-
-static void gfx_sp_vertex(size_t n_vertices, size_t dest_index, const Vtx *vertices) {
-    for (size_t i = 0; i < n_vertices; i++, dest_index++) {
-        const Vtx_t *v = &vertices[i].v;
-        const Vtx_tn *vn = &vertices[i].n;
-        struct LoadedVertex *d = &rsp.loaded_vertices[dest_index];
+}
+
+static float gfx_adjust_x_for_aspect_ratio(float x) {
+    return x * (4.0f / 3.0f) / ((float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height);
+}
+
+static void gfx_update_light_coeffs(void) {
+    for (int i = 0; i < rsp.current_num_lights - 1; i++) {
+        calculate_normal_dir(&rsp.current_lights[i], rsp.current_lights_coeffs[i]);
+    }
+    static const Light_t lookat_x = {{0, 0, 0}, 0, {0, 0, 0}, 0, {127, 0, 0}, 0};
+    static const Light_t lookat_y = {{0, 0, 0}, 0, {0, 0, 0}, 0, {0, 127, 0}, 0};
+    calculate_normal_dir(&lookat_x, rsp.current_lookat_coeffs[0]);
+    calculate_normal_dir(&lookat_y, rsp.current_lookat_coeffs[1]);
+    rsp.lights_changed = false;
+}
+
+// Transforms, lights and clip tests n vertices from the SoA input arrays of
+// vtx_batch, GFX_SIMD_WIDTH at a time. Every lane performs exactly the same
+// float operations in the same order as a straightforward scalar loop, so clip
+// flags, fog and colors don't depend on the vector width.
+static void gfx_transform_vertex_batch(size_t n) {
+    const float (*m)[4] = rsp.MP_matrix;
+    const gfx_vf zero = vf_set1(0.0f);
+    const gfx_vf aspect = vf_set1((float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height);
+    const bool lighting = (rsp.geometry_mode & G_LIGHTING) != 0;
+    const bool texture_gen = lighting && (rsp.geometry_mode & G_TEXTURE_GEN) != 0;
+    const bool fog = (rsp.geometry_mode & G_FOG) != 0;
+    
+    for (size_t i = 0; i < n; i += GFX_SIMD_WIDTH) {
+        gfx_vf obx = vf_load(&vtx_batch.ob[0][i]);
+        gfx_vf oby = vf_load(&vtx_batch.ob[1][i]);
+        gfx_vf obz = vf_load(&vtx_batch.ob[2][i]);
+        gfx_vf c[4];
+        for (int j = 0; j < 4; j++) {
+            c[j] = vf_add(vf_add(vf_add(vf_mul(obx, vf_set1(m[0][j])), vf_mul(oby, vf_set1(m[1][j]))),
+                                 vf_mul(obz, vf_set1(m[2][j]))), vf_set1(m[3][j]));
+        }
+        gfx_vf x = vf_div(vf_mul(c[0], vf_set1(4.0f / 3.0f)), aspect); // as gfx_adjust_x_for_aspect_ratio
+        gfx_vf y = c[1], z = c[2], w = c[3];
+        
+        // trivial clip rejection
+        gfx_vf neg_w = vf_neg(w);
+        gfx_vi clip_rej = vm_to_bit(vf_lt(x, neg_w), 1);
+        clip_rej = vi_or(clip_rej, vm_to_bit(vf_gt(x, w), 2));
+        clip_rej = vi_or(clip_rej, vm_to_bit(vf_lt(y, neg_w), 4));
+        clip_rej = vi_or(clip_rej, vm_to_bit(vf_gt(y, w), 8));
+        clip_rej = vi_or(clip_rej, vm_to_bit(vf_lt(z, neg_w), 16));
+        clip_rej = vi_or(clip_rej, vm_to_bit(vf_gt(z, w), 32));
+        
+        vf_store(&vtx_batch.x[i], x);
+        vf_store(&vtx_batch.y[i], y);
+        vf_store(&vtx_batch.z[i], z);
+        vf_store(&vtx_batch.w[i], w);
+        vi_store(&vtx_batch.clip_rej[i], clip_rej);
+        
+        if (fog) {
+            // To avoid division by zero
+            w = vf_select(vf_lt(vf_abs(w), vf_set1(0.001f)), vf_set1(0.001f), w);
+            gfx_vf winv = vf_div(vf_set1(1.0f), w);
+            winv = vf_select(vf_lt(winv, zero), vf_set1(32767.0f), winv);
+            gfx_vf fog_z = vf_add(vf_mul(vf_mul(z, winv), vf_set1(rsp.fog_mul)), vf_set1(rsp.fog_offset));
+            fog_z = vf_select(vf_lt(fog_z, zero), zero, fog_z);
+            fog_z = vf_select(vf_gt(fog_z, vf_set1(255.0f)), vf_set1(255.0f), fog_z);
+            vi_store(&vtx_batch.fog[i], vf_to_vi(fog_z));
+        }
+        
+        if (lighting) {
+            gfx_vf nx = vf_load(&vtx_batch.n[0][i]);
+            gfx_vf ny = vf_load(&vtx_batch.n[1][i]);
+            gfx_vf nz = vf_load(&vtx_batch.n[2][i]);
+            gfx_vf rgb[3];
+            for (int k = 0; k < 3; k++) {
+                rgb[k] = vf_set1(rsp.current_lights[rsp.current_num_lights - 1].col[k]);
+            }
+            for (int l = 0; l < rsp.current_num_lights - 1; l++) {
+                const float *lc = rsp.current_lights_coeffs[l];
+                gfx_vf intensity = vf_add(vf_add(vf_mul(nx, vf_set1(lc[0])), vf_mul(ny, vf_set1(lc[1]))), vf_mul(nz, vf_set1(lc[2])));
+                intensity = vf_div(intensity, vf_set1(127.0f));
+                gfx_vm lit = vf_gt(intensity, zero);
+                for (int k = 0; k < 3; k++) {
+                    // Color channels are accumulated as integers, truncating after every light
+                    gfx_vf sum = vi_to_vf(vf_to_vi(vf_add(rgb[k], vf_mul(intensity, vf_set1(rsp.current_lights[l].col[k])))));
+                    rgb[k] = vf_select(lit, sum, rgb[k]);
+                }
+            }
+            for (int k = 0; k < 3; k++) {
+                rgb[k] = vf_select(vf_gt(rgb[k], vf_set1(255.0f)), vf_set1(255.0f), rgb[k]);
+                vi_store(&vtx_batch.rgb[k][i], vf_to_vi(rgb[k]));
+            }
+            
+            if (texture_gen) {
+                for (int k = 0; k < 2; k++) {
+                    const float *lc = rsp.current_lookat_coeffs[k];
+                    float scale = k == 0 ? rsp.texture_scaling_factor.s : rsp.texture_scaling_factor.t;
+                    gfx_vf dot = vf_add(vf_add(vf_mul(nx, vf_set1(lc[0])), vf_mul(ny, vf_set1(lc[1]))), vf_mul(nz, vf_set1(lc[2])));
+                    gfx_vf tc = vf_mul(vf_div(vf_add(vf_div(dot, vf_set1(127.0f)), vf_set1(1.0f)), vf_set1(4.0f)), vf_set1(scale));
+                    vi_store(&vtx_batch.texgen[k][i], vf_to_vi(tc));
+                }
+            }
+        }
+    }
+}
+
+static void gfx_sp_vertex(size_t n_vertices, size_t dest_index, const Vtx *vertices) {
+    enum GfxStage prev_stage = gfx_stage_enter(GFX_STAGE_VERTEX);
+    gfx_capture_touch(vertices, n_vertices * sizeof(Vtx));
+    
+    const bool lighting = (rsp.geometry_mode & G_LIGHTING) != 0;
+    const bool texture_gen = lighting && (rsp.geometry_mode & G_TEXTURE_GEN) != 0;
+    const bool fog = (rsp.geometry_mode & G_FOG) != 0;
+    if (lighting && rsp.lights_changed) {
+        gfx_update_light_coeffs();
+    }
+    
+    while (n_vertices > 0) {
+        size_t n = n_vertices < VERTEX_BATCH_SIZE ? n_vertices : VERTEX_BATCH_SIZE;
+        
+        for (size_t i = 0; i < n; i++) {
+            const Vtx_t *v = &vertices[i].v;
+            const Vtx_tn *vn = &vertices[i].n;
+            vtx_batch.ob[0][i] = v->ob[0];
+            vtx_batch.ob[1][i] = v->ob[1];
+            vtx_batch.ob[2][i] = v->ob[2];
+            if (lighting) {
+                vtx_batch.n[0][i] = vn->n[0];
+                vtx_batch.n[1][i] = vn->n[1];
+                vtx_batch.n[2][i] = vn->n[2];
+            }
+        }
+        
+        gfx_transform_vertex_batch(n);
+        
+        for (size_t i = 0; i < n; i++, dest_index++) {
+            const Vtx_t *v = &vertices[i].v;
+            struct LoadedVertex *d = &rsp.loaded_vertices[dest_index];
+            gfx_invalidate_emitted_vertex(dest_index);
+            
+            d->x = vtx_batch.x[i];
+            d->y = vtx_batch.y[i];
+            d->z = vtx_batch.z[i];
+            d->w = vtx_batch.w[i];
+            d->clip_rej = vtx_batch.clip_rej[i];
+            
+            short U, V;
+            if (texture_gen) {
+                U = vtx_batch.texgen[0][i];
+                V = vtx_batch.texgen[1][i];
+            } else {
+                U = v->tc[0] * rsp.texture_scaling_factor.s >> 16;
+                V = v->tc[1] * rsp.texture_scaling_factor.t >> 16;
+            }
+            d->u = U;
+            d->v = V;
+            
+            if (lighting) {
+                d->color.r = vtx_batch.rgb[0][i];
+                d->color.g = vtx_batch.rgb[1][i];
+                d->color.b = vtx_batch.rgb[2][i];
+            } else {
+                d->color.r = v->cn[0];
+                d->color.g = v->cn[1];
+                d->color.b = v->cn[2];
+            }
+            d->color.a = fog ? vtx_batch.fog[i] : v->cn[3]; // Use alpha variable to store fog factor
+        }
+        
+        vertices += n;
+        n_vertices -= n;
+    }
+    gfx_stage_leave(prev_stage);
+}
+
+// Resolves the render state derived from the RSP/RDP state that changed since
+// the last triangle (rdp.state_dirty), flushing and updating the backend where
+// it differs. Each section is idempotent, so skipping it while its inputs are
+// unchanged gives the same result as evaluating it for every triangle.
+static void gfx_update_render_state(void) {
+    uint32_t dirty = rdp.state_dirty;
+    rdp.state_dirty = 0;
+    
+    if (dirty & DIRTY_GEOMETRY_MODE) {
+        bool depth_test = (rsp.geometry_mode & G_ZBUFFER) == G_ZBUFFER;
+        if (depth_test != rendering_state.depth_test) {
+            gfx_flush(GFX_FLUSH_DEPTH_TEST);
+            gfx_rapi->set_depth_test(depth_test);
+            rendering_state.depth_test = depth_test;
+        }
+    }
+    
+    if (dirty & DIRTY_OTHER_MODE) {
+        bool z_upd = (rdp.other_mode_l & Z_UPD) == Z_UPD;
+        if (z_upd != rendering_state.depth_mask) {
+            gfx_flush(GFX_FLUSH_DEPTH_MASK);
+            gfx_rapi->set_depth_mask(z_upd);
+            rendering_state.depth_mask = z_upd;
+        }
+        
+        bool zmode_decal = (rdp.other_mode_l & ZMODE_DEC) == ZMODE_DEC;
+        if (zmode_decal != rendering_state.decal_mode) {
+            gfx_flush(GFX_FLUSH_DECAL);
+            gfx_rapi->set_zmode_decal(zmode_decal);
+            rendering_state.decal_mode = zmode_decal;
+        }
+        
+        tri_state.linear_filter = (rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT;
+    }
+    
+    if (dirty & DIRTY_VIEWPORT_SCISSOR) {
+        struct XYWidthHeight viewport = rdp.viewport;
+        struct XYWidthHeight scissor = rdp.scissor;
+        if (baked_viewport.enabled) {
+            float width = gfx_current_dimensions.width;
+            float height = gfx_current_dimensions.height;
+            tri_state.viewport_scale[0] = viewport.width / width;
+            tri_state.viewport_scale[1] = viewport.height / height;
+            tri_state.viewport_offset[0] = (2 * viewport.x + viewport.width) / width - 1.0f;
+            tri_state.viewport_offset[1] = (2 * viewport.y + viewport.height) / height - 1.0f;
+            
+            int32_t x0 = scissor.x > viewport.x ? scissor.x : viewport.x;
+            int32_t y0 = scissor.y > viewport.y ? scissor.y : viewport.y;
+            int32_t x1 = scissor.x + scissor.width < viewport.x + viewport.width ? scissor.x + scissor.width : viewport.x + viewport.width;
+            int32_t y1 = scissor.y + scissor.height < viewport.y + viewport.height ? scissor.y + scissor.height : viewport.y + viewport.height;
+            scissor.x = x0;
+            scissor.y = y0;
+            scissor.width = x1 > x0 ? x1 - x0 : 0;
+            scissor.height = y1 > y0 ? y1 - y0 : 0;
+            
+            viewport.x = 0;
+            viewport.y = 0;
+            viewport.width = gfx_current_dimensions.width;
+            viewport.height = gfx_current_dimensions.height;
+        }
+        if (memcmp(&viewport, &rendering_state.viewport, sizeof(viewport)) != 0) {
+            gfx_flush(GFX_FLUSH_VIEWPORT);
+            gfx_rapi->set_viewport(viewport.x, viewport.y, viewport.width, viewport.height);
+            rendering_state.viewport = viewport;
+        }
+        if (memcmp(&scissor, &rendering_state.scissor, sizeof(scissor)) != 0) {
+            gfx_flush(GFX_FLUSH_SCISSOR);
+            gfx_rapi->set_scissor(scissor.x, scissor.y, scissor.width, scissor.height);
+            rendering_state.scissor = scissor;
+        }
+    }
+    
+    if (dirty & (DIRTY_OTHER_MODE | DIRTY_COMBINE_MODE)) {
+        uint64_t cc_id = rdp.combine_mode;
+        
+        bool use_alpha = (rdp.other_mode_l & (G_BL_A_MEM << 18)) == 0;
+        bool use_fog = (rdp.other_mode_l >> 30) == G_BL_CLR_FOG;
+        bool texture_edge = (rdp.other_mode_l & CVG_X_ALPHA) == CVG_X_ALPHA;
+        bool use_noise = (rdp.other_mode_l & G_AC_DITHER) == G_AC_DITHER;
+        
+        if (texture_edge) {
+            use_alpha = true;
+        }
         
-        float x = v->ob[0] * rsp.MP_matrix[0][0] + v->ob[1] * rsp.MP_matrix[1][0] + v->ob[2] * rsp.MP_matrix[2][0] + rsp.MP_matrix[3][0];
-        float y = v->ob[0] * rsp.MP_matrix[0][1] + v->ob[1] * rsp.MP_matrix[1][1] + v->ob[2] * rsp.MP_matrix[2][1] + rsp.MP_matrix[3][1];
-        float z = v->ob[0] * rsp.MP_matrix[0][2] + v->ob[1] * rsp.MP_matrix[1][2] + v->ob[2] * rsp.MP_matrix[2][2] + rsp.MP_matrix[3][2];
-        float w = v->ob[0] * rsp.MP_matrix[0][3] + v->ob[1] * rsp.MP_matrix[1][3] + v->ob[2] * rsp.MP_matrix[2][3] + rsp.MP_matrix[3][3];
+        if (use_alpha) cc_id |= SHADER_OPT_ALPHA;
+        if (use_fog) cc_id |= SHADER_OPT_FOG;
+        if (texture_edge) cc_id |= SHADER_OPT_TEXTURE_EDGE;
+        if (use_noise) cc_id |= SHADER_OPT_NOISE;
+        if (packed_vertices.enabled) cc_id |= SHADER_OPT_PACKED_VERTICES;
+        if (texture_atlas.enabled) cc_id |= SHADER_OPT_TEXTURE_ATLAS;
+        if (texture_arrays.enabled) cc_id |= SHADER_OPT_TEXTURE_ARRAYS;
+        if (uber_shader.enabled) cc_id |= SHADER_OPT_UBER;
+        cc_id |= tri_state.palette_opts; // updated below if the textures change
         
-        x = gfx_adjust_x_for_aspect_ratio(x);
+        if (!use_alpha) {
+            cc_id &= ~0xfff000;
+        }
         
-        short U = v->tc[0] * rsp.texture_scaling_factor.s >> 16;
-        short V = v->tc[1] * rsp.texture_scaling_factor.t >> 16;
+        struct ColorCombiner *comb = gfx_lookup_or_create_color_combiner(cc_id);
+        gfx_switch_shader(comb->prg);
+        if (use_alpha != rendering_state.alpha_blend) {
+            gfx_flush(GFX_FLUSH_ALPHA);
+            gfx_rapi->set_use_alpha(use_alpha);
+            rendering_state.alpha_blend = use_alpha;
+        }
         
-        if (rsp.geometry_mode & G_LIGHTING) {
-            if (rsp.lights_changed) {
-                for (int i = 0; i < rsp.current_num_lights - 1; i++) {
-                    calculate_normal_dir(&rsp.current_lights[i], rsp.current_lights_coeffs[i]);
+        tri_state.comb = comb;
+        tri_state.use_alpha = use_alpha;
+        tri_state.use_fog = use_fog;
+        tri_state.use_texture = comb->used_textures[0] || comb->used_textures[1];
+    }
+    
+    if (dirty & (DIRTY_OTHER_MODE | DIRTY_COMBINE_MODE | DIRTY_TILE | DIRTY_TEXTURE)) {
+        for (int i = 0; i < 2; i++) {
+            if (tri_state.comb->used_textures[i]) {
+                struct TextureHashmapNode *tex = rendering_state.textures[i];
+                if (rdp.textures_changed[i] || (tex->image_generation != 0 && (tex->image_excluded || !gfx_texture_image_usable(i)))) {
+                    if (!texture_atlas.enabled && !texture_arrays.enabled && !(texture_images.enabled && gfx_texture_image_continued(i))) {
+                        // Otherwise only switching to another page or array flushes, and
+                        // slices of the bound texture image are drawn from it as well
+                        gfx_flush(GFX_FLUSH_TEXTURE);
+                    }
+                    import_texture(i);
+                    rdp.textures_changed[i] = false;
+                    if (rendering_state.textures[i]->palette_indexed) {
+                        gfx_palette_bind(i);
+                    }
+                }
+                if (texture_atlas.enabled) {
+                    struct TextureHashmapNode *tex = rendering_state.textures[i];
+                    tri_state.atlas_rect[i][0] = tex->atlas_x;
+                    tri_state.atlas_rect[i][1] = tex->atlas_y;
+                    tri_state.atlas_rect[i][2] = tex->width;
+                    tri_state.atlas_rect[i][3] = tex->height;
+                    tri_state.atlas_mode[0] = rdp.texture_tile.cms;
+                    tri_state.atlas_mode[1] = rdp.texture_tile.cmt;
+                    tri_state.atlas_mode[2] = tri_state.linear_filter;
+                    continue;
+                }
+                // Index textures are filtered by the shader
+                bool linear_filter = tri_state.linear_filter && !rendering_state.textures[i]->palette_indexed;
+                if (texture_arrays.enabled) {
+                    struct TextureArray *arr = &texture_arrays.arrays[rendering_state.textures[i]->array_index];
+                    if (linear_filter != arr->linear_filter || rdp.texture_tile.cms != arr->cms || rdp.texture_tile.cmt != arr->cmt) {
+                        gfx_flush(GFX_FLUSH_SAMPLER);
+                        gfx_rapi->set_sampler_parameters(i, linear_filter, rdp.texture_tile.cms, rdp.texture_tile.cmt);
+                        arr->linear_filter = linear_filter;
+                        arr->cms = rdp.texture_tile.cms;
+                        arr->cmt = rdp.texture_tile.cmt;
+                    }
+                    tri_state.texture_layer[i] = rendering_state.textures[i]->array_layer;
+                    continue;
+                }
+                struct TextureImage *image = gfx_texture_image_of(rendering_state.textures[i]);
+                if (image != NULL) {
+                    // The sampler is shared by the slices of the image
+                    if (linear_filter != image->linear_filter || rdp.texture_tile.cms != image->cms || rdp.texture_tile.cmt != image->cmt) {
+                        gfx_flush(GFX_FLUSH_SAMPLER);
+                        gfx_rapi->set_sampler_parameters(i, linear_filter, rdp.texture_tile.cms, rdp.texture_tile.cmt);
+                        image->linear_filter = linear_filter;
+                        image->cms = rdp.texture_tile.cms;
+                        image->cmt = rdp.texture_tile.cmt;
+                    }
+                    continue;
+                }
+                if (linear_filter != rendering_state.textures[i]->linear_filter || rdp.texture_tile.cms != rendering_state.textures[i]->cms || rdp.texture_tile.cmt != rendering_state.textures[i]->cmt) {
+                    gfx_flush(GFX_FLUSH_SAMPLER);
+                    gfx_rapi->set_sampler_parameters(i, linear_filter, rdp.texture_tile.cms, rdp.texture_tile.cmt);
+                    rendering_state.textures[i]->linear_filter = linear_filter;
+                    rendering_state.textures[i]->cms = rdp.texture_tile.cms;
+                    rendering_state.textures[i]->cmt = rdp.texture_tile.cmt;
                 }
-                static const Light_t lookat_x = {{0, 0, 0}, 0, {0, 0, 0}, 0, {127, 0, 0}, 0};
-                static const Light_t lookat_y = {{0, 0, 0}, 0, {0, 0, 0}, 0, {0, 127, 0}, 0};
-                calculate_normal_dir(&lookat_x, rsp.current_lookat_coeffs[0]);
-                calculate_normal_dir(&lookat_y, rsp.current_lookat_coeffs[1]);
-                rsp.lights_changed = false;
             }
-            
-            int r = rsp.current_lights[rsp.current_num_lights - 1].col[0];
-            int g = rsp.current_lights[rsp.current_num_lights - 1].col[1];
-            int b = rsp.current_lights[rsp.current_num_lights - 1].col[2];
-            
-            for (int i = 0; i < rsp.current_num_lights - 1; i++) {
-                float intensity = 0;
-                intensity += vn->n[0] * rsp.current_lights_coeffs[i][0];
-                intensity += vn->n[1] * rsp.current_lights_coeffs[i][1];
-                intensity += vn->n[2] * rsp.current_lights_coeffs[i][2];
-                intensity /= 127.0f;
-                if (intensity > 0.0f) {
-                    r += intensity * rsp.current_lights[i].col[0];
-                    g += intensity * rsp.current_lights[i].col[1];
-                    b += intensity * rsp.current_lights[i].col[2];
+        }
+        if (palette_textures.enabled) {
+            uint64_t palette_opts = 0;
+            for (int i = 0; i < 2; i++) {
+                if (tri_state.comb->used_textures[i] && rendering_state.textures[i]->palette_indexed) {
+                    palette_opts |= i == 0 ? SHADER_OPT_PALETTE_TEXEL0 : SHADER_OPT_PALETTE_TEXEL1;
                 }
             }
-            
-            d->color.r = r > 255 ? 255 : r;
-            d->color.g = g > 255 ? 255 : g;
-            d->color.b = b > 255 ? 255 : b;
-            
-            if (rsp.geometry_mode & G_TEXTURE_GEN) {
-                float dotx = 0, doty = 0;
-                dotx += vn->n[0] * rsp.current_lookat_coeffs[0][0];
-                dotx += vn->n[1] * rsp.current_lookat_coeffs[0][1];
-                dotx += vn->n[2] * rsp.current_lookat_coeffs[0][2];
-                doty += vn->n[0] * rsp.current_lookat_coeffs[1][0];
-                doty += vn->n[1] * rsp.current_lookat_coeffs[1][1];
-                doty += vn->n[2] * rsp.current_lookat_coeffs[1][2];
-                
-                U = (int32_t)((dotx / 127.0f + 1.0f) / 4.0f * rsp.texture_scaling_factor.s);
-                V = (int32_t)((doty / 127.0f + 1.0f) / 4.0f * rsp.texture_scaling_factor.t);
+            if (palette_opts != 0 && tri_state.linear_filter) {
+                palette_opts |= SHADER_OPT_PALETTE_LINEAR;
             }
-        } else {
-            d->color.r = v->cn[0];
-            d->color.g = v->cn[1];
-            d->color.b = v->cn[2];
-        }
-        
-        d->u = U;
-        d->v = V;
-        
-        // trivial clip rejection
-        d->clip_rej = 0;
-        if (x < -w) d->clip_rej |= 1;
-        if (x > w) d->clip_rej |= 2;
-        if (y < -w) d->clip_rej |= 4;
-        if (y > w) d->clip_rej |= 8;
-        if (z < -w) d->clip_rej |= 16;
-        if (z > w) d->clip_rej |= 32;
-        
-        d->x = x;
-        d->y = y;
-        d->z = z;
-        d->w = w;
-        
-        if (rsp.geometry_mode & G_FOG) {
-            if (fabsf(w) < 0.001f) {
-                // To avoid division by zero
-                w = 0.001f;
+            if (palette_opts != tri_state.palette_opts) {
+                uint64_t cc_id = tri_state.comb->cc_id & ~(SHADER_OPT_PALETTE_TEXEL0 | SHADER_OPT_PALETTE_TEXEL1 | SHADER_OPT_PALETTE_LINEAR);
+                tri_state.comb = gfx_lookup_or_create_color_combiner(cc_id | palette_opts);
+                gfx_switch_shader(tri_state.comb->prg);
+                tri_state.palette_opts = palette_opts;
             }
-            
-            float winv = 1.0f / w;
-            if (winv < 0.0f) {
-                winv = 32767.0f;
+        }
+    }
+    
+    if (dirty & (DIRTY_OTHER_MODE | DIRTY_COMBINE_MODE | DIRTY_TILE | DIRTY_TEXTURE)) {
+        tri_state.uls = rdp.texture_tile.uls;
+        tri_state.ult = rdp.texture_tile.ult;
+        tri_state.tex_width = (rdp.texture_tile.lrs - rdp.texture_tile.uls + 4) / 4;
+        tri_state.tex_height = (rdp.texture_tile.lrt - rdp.texture_tile.ult + 4) / 4;
+        tri_state.image_tile = -1;
+        for (int i = 0; i < 2 && texture_images.enabled; i++) {
+            struct TextureImage *image = tri_state.comb->used_textures[i] ? gfx_texture_image_of(rendering_state.textures[i]) : NULL;
+            if (image != NULL) {
+                tri_state.image_tile = i;
+                tri_state.slice_uls = tri_state.uls;
+                tri_state.slice_ult = tri_state.ult;
+                tri_state.slice_width = tri_state.tex_width;
+                tri_state.slice_height = tri_state.tex_height;
+                // Coordinates in the uploaded rows of the image instead of in the slice
+                tri_state.uls -= rendering_state.textures[i]->image_x << 2;
+                tri_state.ult -= (rendering_state.textures[i]->image_y - image->row_begin) << 2;
+                tri_state.tex_width = image->width;
+                tri_state.tex_height = image->row_end - image->row_begin;
             }
-            
-            float fog_z = z * winv * rsp.fog_mul + rsp.fog_offset;
-            if (fog_z < 0) fog_z = 0;
-            if (fog_z > 255) fog_z = 255;
-            d->color.a = fog_z; // Use alpha variable to store fog factor
-        } else {
-            d->color.a = v->cn[3];
+        }
+    }
+    
+    if (indexed_draws.enabled) {
+        struct VertexEmitKey key;
+        memset(&key, 0, sizeof(key));
+        key.comb = tri_state.comb;
+        key.prim_color = rdp.prim_color;
+        key.env_color = rdp.env_color;
+        key.fog_color = rdp.fog_color;
+        key.uls = tri_state.uls;
+        key.ult = tri_state.ult;
+        key.tex_width = tri_state.tex_width;
+        key.tex_height = tri_state.tex_height;
+        key.linear_filter = tri_state.linear_filter;
+        key.z_is_from_0_to_1 = tri_state.z_is_from_0_to_1;
+        if (texture_atlas.enabled) {
+            memcpy(key.atlas_rect, tri_state.atlas_rect, sizeof(key.atlas_rect));
+            memcpy(key.atlas_mode, tri_state.atlas_mode, sizeof(key.atlas_mode));
+        }
+        if (texture_arrays.enabled) {
+            memcpy(key.texture_layer, tri_state.texture_layer, sizeof(key.texture_layer));
+        }
+        if (baked_viewport.enabled) {
+            memcpy(key.viewport_scale, tri_state.viewport_scale, sizeof(key.viewport_scale));
+            memcpy(key.viewport_offset, tri_state.viewport_offset, sizeof(key.viewport_offset));
+        }
+        if (memcmp(&key, &indexed_draws.key, sizeof(key)) != 0) {
+            indexed_draws.key = key;
+            gfx_new_vertex_generation();
         }
     }
 }
 
-static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
+static float gfx_lod_fraction(float w) {
+    float distance_frac = (w - 3000.0f) / 3000.0f;
+    if (distance_frac < 0.0f) distance_frac = 0.0f;
+    if (distance_frac > 1.0f) distance_frac = 1.0f;
+    return distance_frac;
+}
+
+// Whether the texture coordinates of the triangle stay within the slice drawn from a
+// shared texture image. Those interpolated in between do too, and the far edges of
+// the slice are only sampled by fragments centered on them.
+static bool gfx_texture_image_covers(struct LoadedVertex *v_arr[3]) {
+    for (int i = 0; i < 3; i++) {
+        float u = (v_arr[i]->u - tri_state.slice_uls * 8) / 32.0f;
+        float v = (v_arr[i]->v - tri_state.slice_ult * 8) / 32.0f;
+        if (u < 0 || u > tri_state.slice_width || v < 0 || v > tri_state.slice_height) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void gfx_sp_tri1_internal(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
     struct LoadedVertex *v1 = &rsp.loaded_vertices[vtx1_idx];
     struct LoadedVertex *v2 = &rsp.loaded_vertices[vtx2_idx];
     struct LoadedVertex *v3 = &rsp.loaded_vertices[vtx3_idx];
     struct LoadedVertex *v_arr[3] = {v1, v2, v3};
+    uint8_t idx_arr[3] = {vtx1_idx, vtx2_idx, vtx3_idx};
     
     //if (rand()%2) return;
     
+    frame_stats.triangles_submitted++;
+    
     if (v1->clip_rej & v2->clip_rej & v3->clip_rej) {
         // The whole triangle lies outside the visible area
+        frame_stats.triangles_rejected++;
         return;
     }
     
@@ -735,145 +2764,145 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
         
         switch (rsp.geometry_mode & G_CULL_BOTH) {
             case G_CULL_FRONT:
-                if (cross <= 0) return;
+                if (cross <= 0) {
+                    frame_stats.triangles_culled++;
+                    return;
+                }
                 break;
             case G_CULL_BACK:
-                if (cross >= 0) return;
+                if (cross >= 0) {
+                    frame_stats.triangles_culled++;
+                    return;
+                }
                 break;
             case G_CULL_BOTH:
                 // Why is this even an option?
+                frame_stats.triangles_culled++;
                 return;
         }
     }
     
-    bool depth_test = (rsp.geometry_mode & G_ZBUFFER) == G_ZBUFFER;
-    if (depth_test != rendering_state.depth_test) {
-        gfx_flush();
-        gfx_rapi->set_depth_test(depth_test);
-        rendering_state.depth_test = depth_test;
-    }
-    
-    bool z_upd = (rdp.other_mode_l & Z_UPD) == Z_UPD;
-    if (z_upd != rendering_state.depth_mask) {
-        gfx_flush();
-        gfx_rapi->set_depth_mask(z_upd);
-        rendering_state.depth_mask = z_upd;
-    }
-    
-    bool zmode_decal = (rdp.other_mode_l & ZMODE_DEC) == ZMODE_DEC;
-    if (zmode_decal != rendering_state.decal_mode) {
-        gfx_flush();
-        gfx_rapi->set_zmode_decal(zmode_decal);
-        rendering_state.decal_mode = zmode_decal;
-    }
-    
-    if (rdp.viewport_or_scissor_changed) {
-        if (memcmp(&rdp.viewport, &rendering_state.viewport, sizeof(rdp.viewport)) != 0) {
-            gfx_flush();
-            gfx_rapi->set_viewport(rdp.viewport.x, rdp.viewport.y, rdp.viewport.width, rdp.viewport.height);
-            rendering_state.viewport = rdp.viewport;
-        }
-        if (memcmp(&rdp.scissor, &rendering_state.scissor, sizeof(rdp.scissor)) != 0) {
-            gfx_flush();
-            gfx_rapi->set_scissor(rdp.scissor.x, rdp.scissor.y, rdp.scissor.width, rdp.scissor.height);
-            rendering_state.scissor = rdp.scissor;
-        }
-        rdp.viewport_or_scissor_changed = false;
+    if (rdp.state_dirty) {
+        gfx_update_render_state();
     }
-    
-    uint32_t cc_id = rdp.combine_mode;
-    
-    bool use_alpha = (rdp.other_mode_l & (G_BL_A_MEM << 18)) == 0;
-    bool use_fog = (rdp.other_mode_l >> 30) == G_BL_CLR_FOG;
-    bool texture_edge = (rdp.other_mode_l & CVG_X_ALPHA) == CVG_X_ALPHA;
-    bool use_noise = (rdp.other_mode_l & G_AC_DITHER) == G_AC_DITHER;
-    
-    if (texture_edge) {
-        use_alpha = true;
+    if (tri_state.image_tile >= 0 && !gfx_texture_image_covers(v_arr)) {
+        // Sampling outside the slice would read the rest of the image
+        rendering_state.textures[tri_state.image_tile]->image_excluded = true;
+        rdp.state_dirty |= DIRTY_TEXTURE;
+        gfx_update_render_state();
     }
     
-    if (use_alpha) cc_id |= SHADER_OPT_ALPHA;
-    if (use_fog) cc_id |= SHADER_OPT_FOG;
-    if (texture_edge) cc_id |= SHADER_OPT_TEXTURE_EDGE;
-    if (use_noise) cc_id |= SHADER_OPT_NOISE;
-    
-    if (!use_alpha) {
-        cc_id &= ~0xfff000;
-    }
+    struct ColorCombiner *comb = tri_state.comb;
+    bool uber = uber_shader.enabled;
+    uint8_t num_inputs = uber ? 0 : comb->num_inputs; // the uber shader has fixed inputs
+    bool use_alpha = tri_state.use_alpha;
+    bool use_fog = tri_state.use_fog;
+    bool use_texture = tri_state.use_texture || uber;
+    uint32_t tex_width = tri_state.tex_width;
+    uint32_t tex_height = tri_state.tex_height;
+    bool z_is_from_0_to_1 = tri_state.z_is_from_0_to_1;
     
-    struct ColorCombiner *comb = gfx_lookup_or_create_color_combiner(cc_id);
-    struct ShaderProgram *prg = comb->prg;
-    if (prg != rendering_state.shader_program) {
-        gfx_flush();
-        gfx_rapi->unload_shader(rendering_state.shader_program);
-        gfx_rapi->load_shader(prg);
-        rendering_state.shader_program = prg;
-    }
-    if (use_alpha != rendering_state.alpha_blend) {
-        gfx_flush();
-        gfx_rapi->set_use_alpha(use_alpha);
-        rendering_state.alpha_blend = use_alpha;
-    }
-    uint8_t num_inputs;
-    bool used_textures[2];
-    gfx_rapi->shader_get_info(prg, &num_inputs, used_textures);
+    // The LOD fraction is taken from the triangle's first vertex, so it differs per triangle
+    bool reuse_vertices = indexed_draws.enabled && !comb->uses_lod;
     
-    for (int i = 0; i < 2; i++) {
-        if (used_textures[i]) {
-            if (rdp.textures_changed[i]) {
-                gfx_flush();
-                import_texture(i);
-                rdp.textures_changed[i] = false;
-            }
-            bool linear_filter = (rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT;
-            if (linear_filter != rendering_state.textures[i]->linear_filter || rdp.texture_tile.cms != rendering_state.textures[i]->cms || rdp.texture_tile.cmt != rendering_state.textures[i]->cmt) {
-                gfx_flush();
-                gfx_rapi->set_sampler_parameters(i, linear_filter, rdp.texture_tile.cms, rdp.texture_tile.cmt);
-                rendering_state.textures[i]->linear_filter = linear_filter;
-                rendering_state.textures[i]->cms = rdp.texture_tile.cms;
-                rendering_state.textures[i]->cmt = rdp.texture_tile.cmt;
+    for (int i = 0; i < 3; i++) {
+        if (indexed_draws.enabled) {
+            uint8_t idx = idx_arr[i];
+            if (reuse_vertices && indexed_draws.vertex_generation[idx] == indexed_draws.generation) {
+                buf_ibo[buf_ibo_len++] = indexed_draws.vertex_index[idx];
+                continue;
             }
+            indexed_draws.vertex_generation[idx] = indexed_draws.generation;
+            indexed_draws.vertex_index[idx] = buf_vbo_num_verts;
+            buf_ibo[buf_ibo_len++] = buf_vbo_num_verts;
+        }
+        buf_vbo_num_verts++;
+        frame_stats.vertices_emitted++;
+        
+        float x = v_arr[i]->x, y = v_arr[i]->y, z = v_arr[i]->z, w = v_arr[i]->w;
+        if (baked_viewport.enabled) {
+            x = x * tri_state.viewport_scale[0] + w * tri_state.viewport_offset[0];
+            y = y * tri_state.viewport_scale[1] + w * tri_state.viewport_offset[1];
         }
-    }
-    
-    bool use_texture = used_textures[0] || used_textures[1];
-    uint32_t tex_width = (rdp.texture_tile.lrs - rdp.texture_tile.uls + 4) / 4;
-    uint32_t tex_height = (rdp.texture_tile.lrt - rdp.texture_tile.ult + 4) / 4;
-    
-    bool z_is_from_0_to_1 = gfx_rapi->z_is_from_0_to_1();
-    
-    for (int i = 0; i < 3; i++) {
-        float z = v_arr[i]->z, w = v_arr[i]->w;
         if (z_is_from_0_to_1) {
             z = (z + w) / 2.0f;
         }
-        buf_vbo[buf_vbo_len++] = v_arr[i]->x;
-        buf_vbo[buf_vbo_len++] = v_arr[i]->y;
+        buf_vbo[buf_vbo_len++] = x;
+        buf_vbo[buf_vbo_len++] = y;
         buf_vbo[buf_vbo_len++] = z;
         buf_vbo[buf_vbo_len++] = w;
         
         if (use_texture) {
-            float u = (v_arr[i]->u - rdp.texture_tile.uls * 8) / 32.0f;
-            float v = (v_arr[i]->v - rdp.texture_tile.ult * 8) / 32.0f;
-            if ((rdp.other_mode_h & (3U << G_MDSFT_TEXTFILT)) != G_TF_POINT) {
+            float u = (v_arr[i]->u - tri_state.uls * 8) / 32.0f;
+            float v = (v_arr[i]->v - tri_state.ult * 8) / 32.0f;
+            if (tri_state.linear_filter) {
                 // Linear filter adds 0.5f to the coordinates
                 u += 0.5f;
                 v += 0.5f;
             }
             buf_vbo[buf_vbo_len++] = u / tex_width;
             buf_vbo[buf_vbo_len++] = v / tex_height;
+            
+            if (texture_atlas.enabled) {
+                for (int t = 0; t < 2; t++) {
+                    if (comb->used_textures[t] || uber) {
+                        memcpy(&buf_vbo[buf_vbo_len], tri_state.atlas_rect[t], sizeof(tri_state.atlas_rect[t]));
+                        buf_vbo_len += 4;
+                    }
+                }
+                memcpy(&buf_vbo[buf_vbo_len], tri_state.atlas_mode, sizeof(tri_state.atlas_mode));
+                buf_vbo_len += 3;
+            }
+            if (texture_arrays.enabled) {
+                for (int t = 0; t < 2; t++) {
+                    if (comb->used_textures[t] || uber) {
+                        buf_vbo[buf_vbo_len++] = tri_state.texture_layer[t];
+                    }
+                }
+            }
+        }
+        
+        if (use_fog || uber) {
+            // The uber shader always applies fog, with a factor of 0 when it's off
+            uint8_t fog_factor = use_fog ? v_arr[i]->color.a : 0;
+            if (packed_vertices.enabled) {
+                struct RGBA fog = {rdp.fog_color.r, rdp.fog_color.g, rdp.fog_color.b, fog_factor};
+                memcpy(&buf_vbo[buf_vbo_len++], &fog, sizeof(fog));
+            } else {
+                buf_vbo[buf_vbo_len++] = rdp.fog_color.r / 255.0f;
+                buf_vbo[buf_vbo_len++] = rdp.fog_color.g / 255.0f;
+                buf_vbo[buf_vbo_len++] = rdp.fog_color.b / 255.0f;
+                buf_vbo[buf_vbo_len++] = fog_factor / 255.0f; // fog factor (not alpha)
+            }
         }
         
-        if (use_fog) {
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.r / 255.0f;
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.g / 255.0f;
-            buf_vbo[buf_vbo_len++] = rdp.fog_color.b / 255.0f;
-            buf_vbo[buf_vbo_len++] = v_arr[i]->color.a / 255.0f; // fog factor (not alpha)
+        if (uber) {
+            struct RGBA shade = v_arr[i]->color;
+            if (use_fog) {
+                // Shade alpha is 100% for fog
+                shade.a = 0xff;
+            }
+            const struct RGBA *colors[3] = {&rdp.prim_color, &shade, &rdp.env_color};
+            for (int j = 0; j < 3; j++) {
+                if (packed_vertices.enabled) {
+                    memcpy(&buf_vbo[buf_vbo_len++], colors[j], sizeof(struct RGBA));
+                } else {
+                    buf_vbo[buf_vbo_len++] = colors[j]->r / 255.0f;
+                    buf_vbo[buf_vbo_len++] = colors[j]->g / 255.0f;
+                    buf_vbo[buf_vbo_len++] = colors[j]->b / 255.0f;
+                    buf_vbo[buf_vbo_len++] = colors[j]->a / 255.0f;
+                }
+            }
+            memcpy(&buf_vbo[buf_vbo_len], comb->uber_combiner, sizeof(comb->uber_combiner));
+            buf_vbo_len += 3;
+            uint8_t lod = comb->uses_lod ? gfx_lod_fraction(v1->w) * 255.0f : 0;
+            buf_vbo[buf_vbo_len++] = lod / 255.0f;
         }
         
         for (int j = 0; j < num_inputs; j++) {
             struct RGBA *color;
             struct RGBA tmp;
+            struct RGBA packed = {0, 0, 0, 0xff};
             for (int k = 0; k < 1 + (use_alpha ? 1 : 0); k++) {
                 switch (comb->shader_input_mapping[k][j]) {
                     case CC_PRIM:
@@ -887,9 +2916,7 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
                         break;
                     case CC_LOD:
                     {
-                        float distance_frac = (v1->w - 3000.0f) / 3000.0f;
-                        if (distance_frac < 0.0f) distance_frac = 0.0f;
-                        if (distance_frac > 1.0f) distance_frac = 1.0f;
+                        float distance_frac = gfx_lod_fraction(v1->w);
                         tmp.r = tmp.g = tmp.b = tmp.a = distance_frac * 255.0f;
                         color = &tmp;
                         break;
@@ -900,18 +2927,28 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
                         break;
                 }
                 if (k == 0) {
-                    buf_vbo[buf_vbo_len++] = color->r / 255.0f;
-                    buf_vbo[buf_vbo_len++] = color->g / 255.0f;
-                    buf_vbo[buf_vbo_len++] = color->b / 255.0f;
+                    if (packed_vertices.enabled) {
+                        packed.r = color->r;
+                        packed.g = color->g;
+                        packed.b = color->b;
+                    } else {
+                        buf_vbo[buf_vbo_len++] = color->r / 255.0f;
+                        buf_vbo[buf_vbo_len++] = color->g / 255.0f;
+                        buf_vbo[buf_vbo_len++] = color->b / 255.0f;
+                    }
                 } else {
-                    if (use_fog && color == &v_arr[i]->color) {
-                        // Shade alpha is 100% for fog
-                        buf_vbo[buf_vbo_len++] = 1.0f;
+                    // Shade alpha is 100% for fog
+                    uint8_t a = use_fog && color == &v_arr[i]->color ? 0xff : color->a;
+                    if (packed_vertices.enabled) {
+                        packed.a = a;
                     } else {
-                        buf_vbo[buf_vbo_len++] = color->a / 255.0f;
+                        buf_vbo[buf_vbo_len++] = a / 255.0f;
                     }
                 }
             }
+            if (packed_vertices.enabled) {
+                memcpy(&buf_vbo[buf_vbo_len++], &packed, sizeof(packed));
+            }
         }
         /*struct RGBA *color = &v_arr[i]->color;
         buf_vbo[buf_vbo_len++] = color->r / 255.0f;
@@ -919,14 +2956,22 @@ static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
         buf_vbo[buf_vbo_len++] = color->b / 255.0f;
         buf_vbo[buf_vbo_len++] = color->a / 255.0f;*/
     }
+    frame_stats.triangles_drawn++;
     if (++buf_vbo_num_tris == MAX_BUFFERED) {
-        gfx_flush();
+        gfx_flush(GFX_FLUSH_BUFFER_FULL);
     }
 }
 
+static void gfx_sp_tri1(uint8_t vtx1_idx, uint8_t vtx2_idx, uint8_t vtx3_idx) {
+    enum GfxStage prev_stage = gfx_stage_enter(GFX_STAGE_TRIANGLE);
+    gfx_sp_tri1_internal(vtx1_idx, vtx2_idx, vtx3_idx);
+    gfx_stage_leave(prev_stage);
+}
+
 static void gfx_sp_geometry_mode(uint32_t clear, uint32_t set) {
     rsp.geometry_mode &= ~clear;
     rsp.geometry_mode |= set;
+    rdp.state_dirty |= DIRTY_GEOMETRY_MODE;
 }
 
 static void gfx_calc_and_set_viewport(const Vp_t *viewport) {
@@ -946,12 +2991,13 @@ static void gfx_calc_and_set_viewport(const Vp_t *viewport) {
     rdp.viewport.width = width;
     rdp.viewport.height = height;
     
-    rdp.viewport_or_scissor_changed = true;
+    rdp.state_dirty |= DIRTY_VIEWPORT_SCISSOR;
 }
 
 static void gfx_sp_movemem(uint8_t index, uint8_t offset, const void* data) {
     switch (index) {
         case G_MV_VIEWPORT:
+            gfx_capture_touch(data, sizeof(Vp_t));
             gfx_calc_and_set_viewport((const Vp_t *) data);
             break;
 #if 0
@@ -966,6 +3012,7 @@ static void gfx_sp_movemem(uint8_t index, uint8_t offset, const void* data) {
             int lightidx = offset / 24 - 2;
             if (lightidx >= 0 && lightidx <= MAX_LIGHTS) { // skip lookat
                 // NOTE: reads out of bounds if it is an ambient light
+                gfx_capture_touch(data, sizeof(Light_t));
                 memcpy(rsp.current_lights + lightidx, data, sizeof(Light_t));
             }
             break;
@@ -975,6 +3022,7 @@ static void gfx_sp_movemem(uint8_t index, uint8_t offset, const void* data) {
         case G_MV_L1:
         case G_MV_L2:
             // NOTE: reads out of bounds if it is an ambient light
+            gfx_capture_touch(data, sizeof(Light_t));
             memcpy(rsp.current_lights + (index - G_MV_L0) / 2, data, sizeof(Light_t));
             break;
 #endif
@@ -1016,12 +3064,13 @@ static void gfx_dp_set_scissor(uint32_t mode, uint32_t ulx, uint32_t uly, uint32
     rdp.scissor.width = width;
     rdp.scissor.height = height;
     
-    rdp.viewport_or_scissor_changed = true;
+    rdp.state_dirty |= DIRTY_VIEWPORT_SCISSOR;
 }
 
 static void gfx_dp_set_texture_image(uint32_t format, uint32_t size, uint32_t width, const void* addr) {
     rdp.texture_to_load.addr = addr;
     rdp.texture_to_load.siz = size;
+    rdp.texture_to_load.width = width + 1;
 }
 
 static void gfx_dp_set_tile(uint8_t fmt, uint32_t siz, uint32_t line, uint32_t tmem, uint8_t tile, uint32_t palette, uint32_t cmt, uint32_t maskt, uint32_t shiftt, uint32_t cms, uint32_t masks, uint32_t shifts) {
@@ -1034,6 +3083,7 @@ static void gfx_dp_set_tile(uint8_t fmt, uint32_t siz, uint32_t line, uint32_t t
         rdp.texture_tile.line_size_bytes = line * 8;
         rdp.textures_changed[0] = true;
         rdp.textures_changed[1] = true;
+        rdp.state_dirty |= DIRTY_TILE | DIRTY_TEXTURE;
     }
     
     if (tile == G_TX_LOADTILE) {
@@ -1049,6 +3099,7 @@ static void gfx_dp_set_tile_size(uint8_t tile, uint16_t uls, uint16_t ult, uint1
         rdp.texture_tile.lrt = lrt;
         rdp.textures_changed[0] = true;
         rdp.textures_changed[1] = true;
+        rdp.state_dirty |= DIRTY_TILE | DIRTY_TEXTURE;
     }
 }
 
@@ -1056,6 +3107,9 @@ static void gfx_dp_load_tlut(uint8_t tile, uint32_t high_index) {
     SUPPORT_CHECK(tile == G_TX_LOADTILE);
     SUPPORT_CHECK(rdp.texture_to_load.siz == G_IM_SIZ_16b);
     rdp.palette = rdp.texture_to_load.addr;
+    rdp.palette_size_bytes = (high_index + 1) * 2;
+    gfx_capture_touch(rdp.palette, rdp.palette_size_bytes);
+    rdp.palette_decoded = gfx_palette_cache_lookup(rdp.palette, rdp.palette_size_bytes);
 }
 
 static void gfx_dp_load_block(uint8_t tile, uint32_t uls, uint32_t ult, uint32_t lrs, uint32_t dxt) {
@@ -1081,18 +3135,21 @@ static void gfx_dp_load_block(uint8_t tile, uint32_t uls, uint32_t ult, uint32_t
             break;
     }
     uint32_t size_bytes = (lrs + 1) << word_size_shift;
-    rdp.loaded_texture[rdp.texture_to_load.tile_number].size_bytes = size_bytes;
+    struct LoadedTexture *loaded = &rdp.loaded_texture[rdp.texture_to_load.tile_number];
+    loaded->size_bytes = size_bytes;
     assert(size_bytes <= 4096 && "bug: too big texture");
-    rdp.loaded_texture[rdp.texture_to_load.tile_number].addr = rdp.texture_to_load.addr;
+    loaded->addr = rdp.texture_to_load.addr;
+    loaded->stride_bytes = 0;
+    loaded->image_addr = NULL;
+    gfx_capture_touch(rdp.texture_to_load.addr, size_bytes);
     
     rdp.textures_changed[rdp.texture_to_load.tile_number] = true;
+    rdp.state_dirty |= DIRTY_TEXTURE;
 }
 
 static void gfx_dp_load_tile(uint8_t tile, uint32_t uls, uint32_t ult, uint32_t lrs, uint32_t lrt) {
     if (tile == 1) return;
     SUPPORT_CHECK(tile == G_TX_LOADTILE);
-    SUPPORT_CHECK(uls == 0);
-    SUPPORT_CHECK(ult == 0);
 
     uint32_t word_size_shift;
     switch (rdp.texture_to_load.siz) {
@@ -1110,17 +3167,40 @@ static void gfx_dp_load_tile(uint8_t tile, uint32_t uls, uint32_t ult, uint32_t
             break;
     }
 
-    uint32_t size_bytes = (((lrs >> G_TEXTURE_IMAGE_FRAC) + 1) * ((lrt >> G_TEXTURE_IMAGE_FRAC) + 1)) << word_size_shift;
-    rdp.loaded_texture[rdp.texture_to_load.tile_number].size_bytes = size_bytes;
+    // The rectangle from (uls, ult) to (lrs, lrt) of the texture image
+    uint32_t x = uls >> G_TEXTURE_IMAGE_FRAC, y = ult >> G_TEXTURE_IMAGE_FRAC;
+    uint32_t width = (lrs >> G_TEXTURE_IMAGE_FRAC) - x + 1, height = (lrt >> G_TEXTURE_IMAGE_FRAC) - y + 1;
+    uint32_t row_bytes = width << word_size_shift;
+    uint32_t stride_bytes = rdp.texture_to_load.width << word_size_shift;
+    uint32_t size_bytes = row_bytes * height;
+    struct LoadedTexture *loaded = &rdp.loaded_texture[rdp.texture_to_load.tile_number];
+    loaded->size_bytes = size_bytes;
 
     assert(size_bytes <= 4096 && "bug: too big texture");
-    rdp.loaded_texture[rdp.texture_to_load.tile_number].addr = rdp.texture_to_load.addr;
+    loaded->addr = rdp.texture_to_load.addr + y * stride_bytes + (x << word_size_shift);
+    if (stride_bytes > row_bytes && height > 1) {
+        loaded->row_bytes = row_bytes;
+        loaded->stride_bytes = stride_bytes;
+        loaded->gathered = false;
+        loaded->image_addr = rdp.texture_to_load.addr;
+        loaded->image_width = rdp.texture_to_load.width;
+        loaded->x = x;
+        loaded->y = y;
+        // Whole rows, as a texture image shared by the slices is uploaded from them
+        gfx_capture_touch(rdp.texture_to_load.addr + y * stride_bytes, height * stride_bytes);
+    } else {
+        // A single row, or rows as wide as the image, follow each other
+        loaded->stride_bytes = 0;
+        loaded->image_addr = NULL;
+        gfx_capture_touch(loaded->addr, size_bytes);
+    }
     rdp.texture_tile.uls = uls;
     rdp.texture_tile.ult = ult;
     rdp.texture_tile.lrs = lrs;
     rdp.texture_tile.lrt = lrt;
 
     rdp.textures_changed[rdp.texture_to_load.tile_number] = true;
+    rdp.state_dirty |= DIRTY_TILE | DIRTY_TEXTURE;
 }
 
 
@@ -1154,6 +3234,7 @@ static inline uint32_t color_comb(uint32_t a, uint32_t b, uint32_t c, uint32_t d
 
 static void gfx_dp_set_combine_mode(uint32_t rgb, uint32_t alpha) {
     rdp.combine_mode = rgb | (alpha << 12);
+    rdp.state_dirty |= DIRTY_COMBINE_MODE;
 }
 
 static void gfx_dp_set_env_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
@@ -1161,6 +3242,7 @@ static void gfx_dp_set_env_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
     rdp.env_color.g = g;
     rdp.env_color.b = b;
     rdp.env_color.a = a;
+    rdp.state_dirty |= DIRTY_COLORS;
 }
 
 static void gfx_dp_set_prim_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
@@ -1168,6 +3250,7 @@ static void gfx_dp_set_prim_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
     rdp.prim_color.g = g;
     rdp.prim_color.b = b;
     rdp.prim_color.a = a;
+    rdp.state_dirty |= DIRTY_COLORS;
 }
 
 static void gfx_dp_set_fog_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
@@ -1175,6 +3258,7 @@ static void gfx_dp_set_fog_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
     rdp.fog_color.g = g;
     rdp.fog_color.b = b;
     rdp.fog_color.a = a;
+    rdp.state_dirty |= DIRTY_COLORS;
 }
 
 static void gfx_dp_set_fill_color(uint32_t packed_color) {
@@ -1195,6 +3279,7 @@ static void gfx_draw_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lr
     
     if (cycle_type == G_CYC_COPY) {
         rdp.other_mode_h = (rdp.other_mode_h & ~(3U << G_MDSFT_TEXTFILT)) | G_TF_POINT;
+        rdp.state_dirty |= DIRTY_OTHER_MODE;
     }
     
     // U10.2 coordinates
@@ -1216,6 +3301,10 @@ static void gfx_draw_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lr
     struct LoadedVertex* lr = &rsp.loaded_vertices[MAX_VERTICES + 2];
     struct LoadedVertex* ur = &rsp.loaded_vertices[MAX_VERTICES + 3];
     
+    for (int i = MAX_VERTICES; i < MAX_VERTICES + 4; i++) {
+        gfx_invalidate_emitted_vertex(i);
+    }
+    
     ul->x = ulxf;
     ul->y = ulyf;
     ul->z = -1.0f;
@@ -1242,18 +3331,19 @@ static void gfx_draw_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lr
     uint32_t geometry_mode_saved = rsp.geometry_mode;
     
     rdp.viewport = default_viewport;
-    rdp.viewport_or_scissor_changed = true;
     rsp.geometry_mode = 0;
+    rdp.state_dirty |= DIRTY_VIEWPORT_SCISSOR | DIRTY_GEOMETRY_MODE;
     
     gfx_sp_tri1(MAX_VERTICES + 0, MAX_VERTICES + 1, MAX_VERTICES + 3);
     gfx_sp_tri1(MAX_VERTICES + 1, MAX_VERTICES + 2, MAX_VERTICES + 3);
     
     rsp.geometry_mode = geometry_mode_saved;
     rdp.viewport = viewport_saved;
-    rdp.viewport_or_scissor_changed = true;
+    rdp.state_dirty |= DIRTY_VIEWPORT_SCISSOR | DIRTY_GEOMETRY_MODE;
     
     if (cycle_type == G_CYC_COPY) {
         rdp.other_mode_h = saved_other_mode_h;
+        rdp.state_dirty |= DIRTY_OTHER_MODE;
     }
 }
 
@@ -1307,6 +3397,7 @@ static void gfx_dp_texture_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int3
     
     gfx_draw_rectangle(ulx, uly, lrx, lry);
     rdp.combine_mode = saved_combine_mode;
+    rdp.state_dirty |= DIRTY_COMBINE_MODE;
 }
 
 static void gfx_dp_fill_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t lry) {
@@ -1331,6 +3422,7 @@ static void gfx_dp_fill_rectangle(int32_t ulx, int32_t uly, int32_t lrx, int32_t
     gfx_dp_set_combine_mode(color_comb(0, 0, 0, G_CCMUX_SHADE), color_comb(0, 0, 0, G_ACMUX_SHADE));
     gfx_draw_rectangle(ulx, uly, lrx, lry);
     rdp.combine_mode = saved_combine_mode;
+    rdp.state_dirty |= DIRTY_COMBINE_MODE;
 }
 
 static void gfx_dp_set_z_image(void *z_buf_address) {
@@ -1347,17 +3439,211 @@ static void gfx_sp_set_other_mode(uint32_t shift, uint32_t num_bits, uint64_t mo
     om = (om & ~mask) | mode;
     rdp.other_mode_l = (uint32_t)om;
     rdp.other_mode_h = (uint32_t)(om >> 32);
+    rdp.state_dirty |= DIRTY_OTHER_MODE;
 }
 
 static inline void *seg_addr(uintptr_t w1) {
+    if (gfx_capture_replaying) {
+        return gfx_capture_translate_addr(w1);
+    }
     return (void *) w1;
 }
 
 #define C0(pos, width) ((cmd->words.w0 >> (pos)) & ((1U << width) - 1))
 #define C1(pos, width) ((cmd->words.w1 >> (pos)) & ((1U << width) - 1))
 
+// Whether the texture is cached, as far as can be told without hashing it
+static bool gfx_texture_decode_cached(const struct TextureDecodeInput *in) {
+    if (texture_hashing.enabled) {
+        // Assume that textures hashed before are still cached, and others aren't
+        size_t i = gfx_texture_hash_memo_index(in->addr, in->palette);
+        return texture_hashing.memo[i].addr == in->addr && texture_hashing.memo[i].palette == in->palette &&
+               texture_hashing.memo[i].size_bytes == in->size_bytes && texture_hashing.memo[i].line_size_bytes == in->line_size_bytes &&
+               texture_hashing.memo[i].stride_bytes == 0 &&
+               texture_hashing.memo[i].fmt == in->fmt && texture_hashing.memo[i].siz == in->siz;
+    }
+    for (struct TextureHashmapNode *node = gfx_texture_cache.hashmap[gfx_texture_cache_hash(in->addr, 0)]; node != NULL; node = node->next) {
+        if (node->texture_addr == in->addr && node->fmt == in->fmt && node->siz == in->siz) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Submits a job for the texture loaded into the tile, unless it doesn't need one.
+// Returns false if all jobs are in use.
+static bool gfx_texture_decode_submit(int tile) {
+    struct TextureDecodeJob *job = NULL;
+    for (int i = 0; i < TEXTURE_DECODE_JOBS && job == NULL; i++) {
+        if (!texture_decode.jobs[i].submitted) {
+            job = &texture_decode.jobs[i];
+        }
+    }
+    if (job == NULL) {
+        return false;
+    }
+    
+    struct TextureDecodeInput in;
+    in.addr = texture_decode.lookahead.tiles[tile].addr;
+    in.size_bytes = texture_decode.lookahead.tiles[tile].size_bytes;
+    in.line_size_bytes = texture_decode.lookahead.line_size_bytes;
+    in.fmt = texture_decode.lookahead.fmt;
+    in.siz = texture_decode.lookahead.siz;
+    in.palette = NULL;
+    in.palette_size = 0;
+    in.palette_rgba32 = NULL;
+    if (in.addr == NULL || in.line_size_bytes == 0 || in.size_bytes > 4096 || !gfx_texture_needs_decode(in.fmt, in.siz)) {
+        return true;
+    }
+    if (in.fmt == G_IM_FMT_CI && !palette_textures.enabled) {
+        if (texture_decode.lookahead.palette == NULL) {
+            return true;
+        }
+        in.palette = texture_decode.lookahead.palette;
+        in.palette_size = texture_decode.lookahead.palette_size;
+    }
+    if (gfx_texture_decode_find(&in) != NULL || gfx_texture_decode_cached(&in)) {
+        return true;
+    }
+    if (texture_disk_cache.enabled) {
+        struct GfxDiskCacheKey key;
+        gfx_texture_disk_cache_key(&in, &key);
+        if (gfx_disk_cache_contains(&key)) {
+            return true;
+        }
+    }
+    
+    job->in = in;
+    job->decoded.data = job->texels;
+    job->submitted = true;
+    job->seq = texture_decode.next_seq++;
+    job->work.run = gfx_texture_decode_job_run;
+    gfx_worker_pool_submit(&job->work);
+    return true;
+}
+
+// Scans the display list ahead of the interpreter until all jobs are in use
+static void gfx_texture_decode_lookahead(void) {
+    if (!texture_decode.enabled) {
+        return;
+    }
+    
+    while (texture_decode.lookahead.depth > 0) {
+        const Gfx *cmd = texture_decode.lookahead.stack[texture_decode.lookahead.depth - 1];
+        uint32_t opcode = cmd->words.w0 >> 24;
+        
+        switch (opcode) {
+            case G_DL:
+                texture_decode.lookahead.stack[texture_decode.lookahead.depth - 1] = cmd + 1;
+                if (C0(16, 1) == 0) {
+                    if (texture_decode.lookahead.depth == TEXTURE_DECODE_STACK_SIZE) {
+                        texture_decode.lookahead.depth = 0;
+                        return;
+                    }
+                    texture_decode.lookahead.depth++;
+                }
+                texture_decode.lookahead.stack[texture_decode.lookahead.depth - 1] = (const Gfx *)seg_addr(cmd->words.w1);
+                continue;
+            case (uint8_t)G_ENDDL:
+                texture_decode.lookahead.depth--;
+                continue;
+            case G_SETTIMG:
+                texture_decode.lookahead.image_addr = seg_addr(cmd->words.w1);
+                texture_decode.lookahead.image_siz = C0(19, 2);
+                texture_decode.lookahead.image_width = C0(0, 10) + 1;
+                break;
+            case G_SETTILE:
+                if (C1(24, 3) == G_TX_RENDERTILE) {
+                    texture_decode.lookahead.fmt = C0(21, 3);
+                    texture_decode.lookahead.siz = C0(19, 2);
+                    texture_decode.lookahead.line_size_bytes = C0(9, 9) * 8;
+                }
+                if (C1(24, 3) == G_TX_LOADTILE) {
+                    texture_decode.lookahead.load_tile_number = C0(0, 9) / 256;
+                }
+                break;
+            case G_LOADBLOCK:
+            case G_LOADTILE:
+                if (C1(24, 3) == G_TX_LOADTILE) {
+                    uint8_t siz = texture_decode.lookahead.image_siz;
+                    uint32_t word_size_shift = siz == G_IM_SIZ_16b ? 1 : siz == G_IM_SIZ_32b ? 2 : 0;
+                    uint32_t size_bytes;
+                    const uint8_t *addr = texture_decode.lookahead.image_addr;
+                    if (opcode == G_LOADBLOCK) {
+                        size_bytes = (C1(12, 12) + 1) << word_size_shift;
+                    } else {
+                        uint32_t x = C0(12, 12) >> G_TEXTURE_IMAGE_FRAC, y = C0(0, 12) >> G_TEXTURE_IMAGE_FRAC;
+                        uint32_t width = (C1(12, 12) >> G_TEXTURE_IMAGE_FRAC) - x + 1, height = (C1(0, 12) >> G_TEXTURE_IMAGE_FRAC) - y + 1;
+                        size_bytes = (width * height) << word_size_shift;
+                        if (texture_decode.lookahead.image_width > width && height > 1) {
+                            // Sub-rectangles are gathered from their rows when imported
+                            addr = NULL;
+                        } else if (addr != NULL) {
+                            addr += ((y * texture_decode.lookahead.image_width) + x) << word_size_shift;
+                        }
+                    }
+                    int tile = texture_decode.lookahead.load_tile_number;
+                    texture_decode.lookahead.tiles[tile].addr = addr;
+                    texture_decode.lookahead.tiles[tile].size_bytes = size_bytes;
+                    texture_decode.lookahead.tiles[tile].loaded = true;
+                }
+                break;
+            case G_LOADTLUT:
+                texture_decode.lookahead.palette = texture_decode.lookahead.image_addr;
+                texture_decode.lookahead.palette_size = (C1(14, 10) + 1) * 2;
+                if (texture_decode.lookahead.palette_size > 512) {
+                    texture_decode.lookahead.palette_size = 512;
+                }
+                break;
+            case (uint8_t)G_TRI1:
+#if defined(F3DEX_GBI) || defined(F3DLP_GBI)
+            case (uint8_t)G_TRI2:
+#endif
+            case G_TEXRECT:
+            case G_TEXRECTFLIP:
+                for (int i = 0; i < 2; i++) {
+                    if (texture_decode.lookahead.tiles[i].loaded) {
+                        if (!gfx_texture_decode_submit(i)) {
+                            // Continue from this command once a job is free
+                            return;
+                        }
+                        texture_decode.lookahead.tiles[i].loaded = false;
+                    }
+                }
+                if (opcode == G_TEXRECT || opcode == G_TEXRECTFLIP) {
+                    cmd += 2;
+                }
+                break;
+        }
+        texture_decode.lookahead.stack[texture_decode.lookahead.depth - 1] = cmd + 1;
+    }
+}
+
+// Starts the lookahead at the display list of the frame, from the current RDP state
+static void gfx_texture_decode_start(Gfx *commands) {
+    texture_decode.lookahead.stack[0] = commands;
+    texture_decode.lookahead.depth = 1;
+    texture_decode.lookahead.image_addr = rdp.texture_to_load.addr;
+    texture_decode.lookahead.image_siz = rdp.texture_to_load.siz;
+    texture_decode.lookahead.image_width = rdp.texture_to_load.width;
+    texture_decode.lookahead.load_tile_number = rdp.texture_to_load.tile_number;
+    for (int i = 0; i < 2; i++) {
+        texture_decode.lookahead.tiles[i].addr = rdp.loaded_texture[i].stride_bytes == 0 ? rdp.loaded_texture[i].addr : NULL;
+        texture_decode.lookahead.tiles[i].size_bytes = rdp.loaded_texture[i].size_bytes;
+        texture_decode.lookahead.tiles[i].loaded = true;
+    }
+    texture_decode.lookahead.fmt = rdp.texture_tile.fmt;
+    texture_decode.lookahead.siz = rdp.texture_tile.siz;
+    texture_decode.lookahead.line_size_bytes = rdp.texture_tile.line_size_bytes;
+    texture_decode.lookahead.palette = rdp.palette;
+    texture_decode.lookahead.palette_size = rdp.palette_size_bytes < 512 ? rdp.palette_size_bytes : 512;
+    gfx_texture_decode_lookahead();
+}
+
 static void gfx_run_dl(Gfx* cmd) {
     int dummy = 0;
+    Gfx *dl_start = cmd;
+    gfx_trace_push("gfx_run_dl", "addr", (uintptr_t)cmd, true);
     for (;;) {
         uint32_t opcode = cmd->words.w0 >> 24;
         
@@ -1412,11 +3698,15 @@ static void gfx_run_dl(Gfx* cmd) {
                     // Push return address
                     gfx_run_dl((Gfx *)seg_addr(cmd->words.w1));
                 } else {
+                    gfx_capture_touch(dl_start, (cmd - dl_start + 1) * sizeof(Gfx));
                     cmd = (Gfx *)seg_addr(cmd->words.w1);
+                    dl_start = cmd;
                     --cmd; // increase after break
                 }
                 break;
             case (uint8_t)G_ENDDL:
+                gfx_capture_touch(dl_start, (cmd - dl_start + 1) * sizeof(Gfx));
+                gfx_trace_pop();
                 return;
 #ifdef F3DEX_GBI_2
             case G_GEOMETRYMODE:
@@ -1466,9 +3756,12 @@ static void gfx_run_dl(Gfx* cmd) {
                 break;
             case G_LOADBLOCK:
                 gfx_dp_load_block(C1(24, 3), C0(12, 12), C0(0, 12), C1(12, 12), C1(0, 12));
+                // Imports since the last load may have freed decode jobs
+                gfx_texture_decode_lookahead();
                 break;
             case G_LOADTILE:
                 gfx_dp_load_tile(C1(24, 3), C0(12, 12), C0(0, 12), C1(12, 12), C1(0, 12));
+                gfx_texture_decode_lookahead();
                 break;
             case G_SETTILE:
                 gfx_dp_set_tile(C0(21, 3), C0(19, 2), C0(9, 9), C0(0, 9), C1(24, 3), C1(20, 4), C1(18, 2), C1(14, 4), C1(10, 4), C1(8, 2), C1(4, 4), C1(0, 4));
@@ -1577,6 +3870,7 @@ void gfx_init(struct GfxWindowManagerAPI *wapi, struct GfxRenderingAPI *rapi, co
     gfx_rapi = rapi;
     gfx_wapi->init(game_name, start_in_fullscreen);
     gfx_rapi->init();
+    tri_state.z_is_from_0_to_1 = gfx_rapi->z_is_from_0_to_1();
     
     // Used in the 120 star TAS
     static uint32_t precomp_shaders[] = {
@@ -1616,7 +3910,106 @@ struct GfxRenderingAPI *gfx_get_current_rendering_api(void) {
     return gfx_rapi;
 }
 
+void gfx_set_stage_timing(bool enable) {
+    stage_timing.enabled = enable;
+}
+
+void gfx_get_frame_stats(struct GfxFrameStats *stats) {
+    *stats = last_frame_stats;
+}
+
+void gfx_set_indexed_draws(bool enable) {
+    indexed_draws.requested = enable;
+}
+
+void gfx_set_packed_vertices(bool enable) {
+    packed_vertices.requested = enable;
+}
+
+void gfx_set_baked_viewport(bool enable) {
+    baked_viewport.requested = enable;
+}
+
+void gfx_set_texture_atlas(bool enable) {
+    texture_atlas.requested = enable;
+}
+
+void gfx_set_texture_arrays(bool enable) {
+    texture_arrays.requested = enable;
+}
+
+void gfx_set_uber_shader(bool enable) {
+    uber_shader.requested = enable;
+}
+
+void gfx_set_texture_hashing(bool enable) {
+    texture_hashing.requested = enable;
+}
+
+void gfx_set_palette_textures(bool enable) {
+    palette_textures.requested = enable;
+}
+
+void gfx_set_compact_textures(bool enable) {
+    compact_textures.requested = enable;
+}
+
+void gfx_set_texture_staging(bool enable) {
+    texture_staging.requested = enable;
+}
+
+void gfx_set_texture_image_sharing(bool enable) {
+    texture_images.requested = enable;
+}
+
+void gfx_set_texture_write_watch(bool enable) {
+    write_watch.requested = enable;
+}
+
+bool gfx_add_texture_write_watch_region(const void *addr, size_t size) {
+    return gfx_write_watch_add_region(addr, size);
+}
+
+void gfx_clear_texture_write_watch_regions(void) {
+    gfx_write_watch_clear_regions();
+}
+
+void gfx_set_texture_decode_threads(uint32_t num_threads) {
+    texture_decode.requested_threads = num_threads;
+}
+
+void gfx_set_texture_disk_cache(const char *filename) {
+    free(texture_disk_cache.filename);
+    texture_disk_cache.filename = NULL;
+    if (filename != NULL) {
+        size_t len = strlen(filename) + 1;
+        texture_disk_cache.filename = malloc(len);
+        memcpy(texture_disk_cache.filename, filename, len);
+    }
+    texture_disk_cache.changed = true;
+}
+
+void gfx_set_texture_pack(const char *filename) {
+    free(texture_pack.filename);
+    texture_pack.filename = NULL;
+    if (filename != NULL) {
+        size_t len = strlen(filename) + 1;
+        texture_pack.filename = malloc(len);
+        memcpy(texture_pack.filename, filename, len);
+    }
+    texture_pack.changed = true;
+}
+
+void gfx_set_texture_pack_budget(uint32_t bytes_per_frame) {
+    texture_pack.budget_bytes = bytes_per_frame;
+}
+
+void gfx_set_texture_cache_capacity(uint32_t max_textures) {
+    gfx_texture_cache.requested_capacity = max_textures;
+}
+
 void gfx_start_frame(void) {
+    gfx_trace_push("gfx_start_frame", NULL, 0, false);
     gfx_wapi->handle_events();
     gfx_wapi->get_dimensions(&gfx_current_dimensions.width, &gfx_current_dimensions.height);
     if (gfx_current_dimensions.height == 0) {
@@ -1624,6 +4017,7 @@ void gfx_start_frame(void) {
         gfx_current_dimensions.height = 1;
     }
     gfx_current_dimensions.aspect_ratio = (float)gfx_current_dimensions.width / (float)gfx_current_dimensions.height;
+    gfx_trace_pop();
 }
 
 void gfx_run(Gfx *commands) {
@@ -1637,19 +4031,146 @@ void gfx_run(Gfx *commands) {
     }
     dropped_frame = false;
     
-    double t0 = gfx_wapi->get_time();
+    gfx_trace_push("gfx_run", NULL, 0, false);
+    if (gfx_capture_recording) {
+        gfx_capture_record_frame_begin(commands);
+    }
+    memset(&frame_stats, 0, sizeof(frame_stats));
+    indexed_draws.enabled = indexed_draws.requested && gfx_rapi->draw_triangles_indexed != NULL;
+    packed_vertices.enabled = packed_vertices.requested && gfx_rapi->supports_packed_vertices != NULL && gfx_rapi->supports_packed_vertices();
+    baked_viewport.enabled = baked_viewport.requested;
+    uber_shader.enabled = uber_shader.requested && gfx_rapi->supports_uber_shader != NULL && gfx_rapi->supports_uber_shader();
+    bool texture_atlas_enabled = texture_atlas.requested && gfx_rapi->upload_texture_region != NULL;
+    bool texture_arrays_enabled = texture_arrays.requested && !texture_atlas_enabled &&
+                                  gfx_rapi->supports_texture_arrays != NULL && gfx_rapi->supports_texture_arrays();
+    if (texture_atlas_enabled != texture_atlas.enabled || texture_arrays_enabled != texture_arrays.enabled) {
+        // Cached textures are either in the atlas, in texture arrays or in their own texture
+        gfx_texture_cache_clear();
+        texture_atlas.enabled = texture_atlas_enabled;
+        texture_arrays.enabled = texture_arrays_enabled;
+    }
+    bool palette_textures_enabled = palette_textures.requested && !texture_atlas.enabled && !texture_arrays.enabled &&
+                                    gfx_rapi->upload_index_texture != NULL;
+    if (palette_textures_enabled != palette_textures.enabled) {
+        // Cached CI textures hold either colors or indices
+        gfx_texture_cache_clear();
+        palette_textures.enabled = palette_textures_enabled;
+        tri_state.palette_opts = 0;
+    }
+    compact_textures.enabled = compact_textures.requested && !texture_atlas.enabled && !texture_arrays.enabled &&
+                               gfx_rapi->upload_texture_format != NULL;
+    texture_staging.enabled = texture_staging.requested && !texture_atlas.enabled && !texture_arrays.enabled &&
+                              gfx_rapi->map_texture_staging != NULL;
+    if (write_watch.requested != write_watch.enabled) {
+        if (write_watch.requested) {
+            write_watch.enabled = gfx_write_watch_start();
+        } else {
+            gfx_write_watch_stop();
+            write_watch.enabled = false;
+        }
+        write_watch.frame_stamp = gfx_write_watch_stamp();
+    }
+    if (texture_decode.requested_threads != texture_decode.threads) {
+        gfx_worker_pool_stop();
+        if (texture_decode.requested_threads > 0) {
+            gfx_worker_pool_start(texture_decode.requested_threads);
+        }
+        texture_decode.threads = texture_decode.requested_threads;
+    }
+    texture_decode.enabled = gfx_worker_pool_num_threads() > 0;
+    if (texture_disk_cache.changed) {
+        gfx_disk_cache_close();
+        texture_disk_cache.enabled = texture_disk_cache.filename != NULL && gfx_disk_cache_open(texture_disk_cache.filename);
+        texture_disk_cache.changed = false;
+    }
+    if (texture_disk_cache.enabled) {
+        gfx_disk_cache_new_frame();
+    }
+    if (texture_pack.changed) {
+        if (texture_pack.pack != NULL) {
+            gfx_texture_pack_close(texture_pack.pack);
+        }
+        texture_pack.pack = texture_pack.filename != NULL ? gfx_texture_pack_open(texture_pack.filename) : NULL;
+        texture_pack.changed = false;
+        // Cached textures may have been replaced
+        gfx_texture_cache_clear();
+    }
+    texture_pack.enabled = texture_pack.pack != NULL && !texture_atlas.enabled && !texture_arrays.enabled;
+    texture_row_length.enabled = !texture_atlas.enabled && !texture_arrays.enabled && gfx_rapi->supports_texture_row_length != NULL &&
+                                 gfx_rapi->supports_texture_row_length();
+    // Slices of an image are keyed by their address and are uploaded as they are
+    bool texture_images_enabled = texture_images.requested && !texture_atlas.enabled && !texture_arrays.enabled &&
+                                  !texture_hashing.requested && !write_watch.enabled && !texture_pack.enabled;
+    if (texture_images_enabled != texture_images.enabled) {
+        gfx_texture_cache_clear();
+        texture_images.enabled = texture_images_enabled;
+    }
+    texture_pack.frame_bytes = 0;
+    if (texture_hashing.requested != texture_hashing.enabled) {
+        // Cached textures are keyed either by address or by content
+        gfx_texture_cache_clear();
+        texture_hashing.enabled = texture_hashing.requested;
+    }
+    if (texture_hashing.enabled) {
+        // Textures may have been written since the last frame, so hash them again
+        texture_hashing.frame++;
+        rdp.textures_changed[0] = true;
+        rdp.textures_changed[1] = true;
+    }
+    if (texture_atlas.enabled || texture_arrays.enabled) {
+        // Look the current textures up again, as their pages or layers may have
+        // been reused or other textures bound since the last frame
+        texture_atlas.bound_page[0] = -1;
+        texture_atlas.bound_page[1] = -1;
+        texture_arrays.bound_array[0] = -1;
+        texture_arrays.bound_array[1] = -1;
+        rdp.textures_changed[0] = true;
+        rdp.textures_changed[1] = true;
+    }
+    gfx_texture_cache_set_capacity(gfx_texture_cache.requested_capacity);
+    gfx_new_vertex_generation();
+    rdp.state_dirty = DIRTY_ALL;
+    stage_timing.current = GFX_STAGE_FLUSH;
+    stage_timing.last_time = stage_timing.enabled ? get_time() : 0;
     gfx_rapi->start_frame();
+    if (texture_pack.enabled && texture_pack.num_pending != 0) {
+        gfx_stage_enter(GFX_STAGE_TEXTURE_IMPORT);
+        gfx_texture_pack_stream();
+    }
+    gfx_stage_enter(GFX_STAGE_DL_PARSE);
+    if (texture_decode.enabled) {
+        gfx_texture_decode_start(commands);
+    }
     gfx_run_dl(commands);
-    gfx_flush();
-    double t1 = gfx_wapi->get_time();
-    //printf("Process %f %f\n", t1, t1 - t0);
+    if (texture_decode.enabled) {
+        gfx_texture_decode_finish();
+    }
+    gfx_stage_enter(GFX_STAGE_FLUSH);
+    gfx_flush(GFX_FLUSH_END_OF_FRAME);
     gfx_rapi->end_frame();
+    gfx_stage_update();
+    frame_stats.texture_cache_bytes = gfx_texture_cache.size_bytes;
+    frame_stats.texture_replacements_pending = texture_pack.num_pending;
+    // The game writes its textures between frames, so count from the end of the previous one
+    frame_stats.texture_pages_written = gfx_write_watch_stamp() - write_watch.frame_stamp;
+    write_watch.frame_stamp = gfx_write_watch_stamp();
+    last_frame_stats = frame_stats;
+    if (gfx_capture_recording) {
+        gfx_capture_record_frame_end();
+    }
+    gfx_trace_pop();
+    gfx_trace_push("swap_buffers_begin", NULL, 0, false);
     gfx_wapi->swap_buffers_begin();
+    gfx_trace_pop();
 }
 
 void gfx_end_frame(void) {
     if (!dropped_frame) {
+        gfx_trace_push("finish_render", NULL, 0, false);
         gfx_rapi->finish_render();
+        gfx_trace_pop();
+        gfx_trace_push("swap_buffers_end", NULL, 0, false);
         gfx_wapi->swap_buffers_end();
+        gfx_trace_pop();
     }
 }
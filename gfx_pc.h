@@ -1,6 +1,8 @@
 #ifndef GFX_PC_H
 #define GFX_PC_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 struct GfxRenderingAPI;
@@ -13,6 +15,56 @@ struct GfxDimensions {
 
 extern struct GfxDimensions gfx_current_dimensions;
 
+// Stages that gfx_run's CPU time is split into when stage timing is enabled
+enum GfxStage {
+    GFX_STAGE_DL_PARSE,       // display list interpretation and state commands
+    GFX_STAGE_VERTEX,         // vertex transform and lighting (gfx_sp_vertex)
+    GFX_STAGE_TRIANGLE,       // triangle setup and vertex emission (gfx_sp_tri1)
+    GFX_STAGE_TEXTURE_IMPORT, // texture cache lookup, decoding and upload
+    GFX_STAGE_FLUSH,          // backend submission (draw calls, frame start/end)
+    GFX_STAGE_COUNT
+};
+
+// Why a batch of buffered triangles was submitted as a draw call
+enum GfxFlushReason {
+    GFX_FLUSH_DEPTH_TEST,
+    GFX_FLUSH_DEPTH_MASK,
+    GFX_FLUSH_DECAL,
+    GFX_FLUSH_VIEWPORT,
+    GFX_FLUSH_SCISSOR,
+    GFX_FLUSH_SHADER,
+    GFX_FLUSH_ALPHA,
+    GFX_FLUSH_TEXTURE,
+    GFX_FLUSH_SAMPLER,
+    GFX_FLUSH_BUFFER_FULL,
+    GFX_FLUSH_END_OF_FRAME,
+    GFX_FLUSH_REASON_COUNT
+};
+
+struct GfxFrameStats {
+    uint32_t triangles_submitted;
+    uint32_t triangles_rejected; // all vertices outside the same clip plane
+    uint32_t triangles_culled;   // backface (or frontface) culled
+    uint32_t triangles_drawn;
+    uint32_t vertices_emitted;   // vertices written to the vertex buffer
+    uint32_t draw_calls;
+    uint32_t draw_calls_by_reason[GFX_FLUSH_REASON_COUNT];
+    uint32_t texture_cache_hits;
+    uint32_t texture_cache_misses;
+    uint32_t texture_cache_evictions;
+    uint32_t texture_bytes_hashed; // when texture hashing is enabled
+    uint32_t texture_pages_written; // write faults caught when write watching is enabled
+    uint32_t texture_decodes_ahead; // cache misses decoded by the texture decode threads
+    uint32_t texture_disk_cache_hits; // cache misses uploaded from the texture disk cache
+    uint32_t texture_replacements; // textures replaced from the texture pack
+    uint32_t texture_replacements_pending; // waiting for the upload budget at the end of the frame
+    uint32_t texture_image_slices; // cache misses drawn from a texture image uploaded before
+    uint64_t texture_cache_bytes; // decoded size of the cached textures at the end of the frame
+    uint32_t shader_switches;
+    uint32_t shaders_created;
+    uint64_t stage_ns[GFX_STAGE_COUNT]; // only filled in when stage timing is enabled
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -22,6 +74,116 @@ struct GfxRenderingAPI *gfx_get_current_rendering_api(void);
 void gfx_start_frame(void);
 void gfx_run(Gfx *commands);
 void gfx_end_frame(void);
+void gfx_set_stage_timing(bool enable);
+void gfx_get_frame_stats(struct GfxFrameStats *stats); // of the last gfx_run
+
+// Emit each loaded vertex once per batch and draw with an index buffer, if the
+// rendering API supports it. Takes effect at the next gfx_run.
+void gfx_set_indexed_draws(bool enable);
+
+// Send colors and fog as 8-bit normalized values instead of floats (see
+// SHADER_OPT_PACKED_VERTICES), if the rendering API supports it. Takes effect
+// at the next gfx_run.
+void gfx_set_packed_vertices(bool enable);
+
+// Apply the viewport transform on the CPU so that viewport changes, such as
+// the full screen viewport of every texture and fill rectangle, don't split
+// batches. Takes effect at the next gfx_run.
+void gfx_set_baked_viewport(bool enable);
+
+// Pack textures into a few large atlas pages (see SHADER_OPT_TEXTURE_ATLAS), so
+// that texture changes don't split batches, if the rendering API supports it.
+// Takes effect at the next gfx_run.
+void gfx_set_texture_atlas(bool enable);
+
+// Keep textures of the same size as layers of texture arrays (see
+// SHADER_OPT_TEXTURE_ARRAYS), so that switching between them doesn't split
+// batches, if the rendering API supports it and the texture atlas is off.
+// Takes effect at the next gfx_run.
+void gfx_set_texture_arrays(bool enable);
+
+// Draw with a single uber shader that takes the color combiner and options
+// from each vertex (see SHADER_OPT_UBER), so that combiner changes neither
+// split batches nor compile shaders, if the rendering API supports it. Takes
+// effect at the next gfx_run.
+void gfx_set_uber_shader(bool enable);
+
+// Key the texture cache on a 64-bit hash of the loaded texels and, for CI
+// textures, the palette, instead of the texture address. Textures written in
+// place are then imported again, and identical textures are uploaded once.
+// Hashes are memoized per address for the rest of the frame. Takes effect at
+// the next gfx_run.
+void gfx_set_texture_hashing(bool enable);
+
+// Upload CI textures as 8-bit color indices and their palettes as 256x1
+// textures, and look the colors up in the shader (see
+// SHADER_OPT_PALETTE_TEXEL0/1), if the rendering API supports it and neither
+// the texture atlas nor texture arrays are on. Takes effect at the next gfx_run.
+void gfx_set_palette_textures(bool enable);
+
+// Upload RGBA16 textures as 16-bit RGBA 5551 and IA and I textures as 8-bit
+// intensity (and alpha) texels instead of RGBA32, if the rendering API
+// supports it and neither the texture atlas nor texture arrays are on. Takes
+// effect at the next gfx_run.
+void gfx_set_compact_textures(bool enable);
+
+// Decode textures imported on the rendering thread straight into staging
+// memory of the rendering API, if it supports it and neither the texture atlas
+// nor texture arrays are on. Takes effect at the next gfx_run.
+void gfx_set_texture_staging(bool enable);
+
+// Upload textures loaded with G_LOADTILE as rows of the image they are cut
+// from, and draw the slices of an image from that one texture, so that drawing
+// the next slice neither uploads it again nor splits batches. Only RGBA32
+// textures, and IA16 and I8 textures with compact textures on, are shared,
+// when they are clamped, point sampled, drawn without a second texture and
+// with texture coordinates within the slice. Others get their own texture, so
+// that the rest of the image is never sampled. Off with the texture atlas,
+// texture arrays, texture hashing, write watching or a texture pack. Takes
+// effect at the next gfx_run, clearing the texture cache.
+void gfx_set_texture_image_sharing(bool enable);
+
+// Write protect the pages of imported textures and palettes, and only import
+// or hash cached textures again after the game wrote to their pages (see
+// gfx_write_watch.h). Linux only; elsewhere this has no effect. Takes effect
+// at the next gfx_run.
+//
+// Only textures inside regions added with gfx_add_texture_write_watch_region
+// are protected; all others are imported or hashed every time they are used.
+// Register only memory that the game writes from the CPU, such as its RDRAM:
+// system calls writing into a protected page (read, recv, ...) fail with
+// EFAULT instead of faulting, so never register I/O buffers.
+void gfx_set_texture_write_watch(bool enable);
+// Returns false if too many regions were added
+bool gfx_add_texture_write_watch_region(const void *addr, size_t size);
+// Also makes all protected pages writable again
+void gfx_clear_texture_write_watch_regions(void);
+
+// Decode textures on this many worker threads, ahead of the draw commands that
+// import them (0, the default, decodes them when they are imported). Takes
+// effect at the next gfx_run.
+void gfx_set_texture_decode_threads(uint32_t num_threads);
+
+// Keep decoded textures in this file across runs (see gfx_disk_cache.h), keyed
+// by a hash of their loaded texels and palette, and upload textures found there
+// without decoding them (NULL, the default, disables it). Takes effect at the
+// next gfx_run.
+void gfx_set_texture_disk_cache(const char *filename);
+
+// Replace textures with those of this texture pack (see gfx_texture_pack.h),
+// if neither the texture atlas nor texture arrays are on (NULL, the default,
+// disables it). Takes effect at the next gfx_run, clearing the texture cache.
+void gfx_set_texture_pack(const char *filename);
+
+// Bytes of replacement textures uploaded per frame at most (4 MB by default).
+// Textures whose replacement doesn't fit are drawn as usual until it is uploaded
+// in a later frame.
+void gfx_set_texture_pack_budget(uint32_t bytes_per_frame);
+
+// Maximum number of textures kept in the texture cache (512 by default). When
+// it is full, the least recently used texture is evicted. Takes effect at the
+// next gfx_run, clearing the cache if the capacity changed.
+void gfx_set_texture_cache_capacity(uint32_t max_textures);
 
 #ifdef __cplusplus
 }
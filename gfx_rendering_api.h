@@ -7,12 +7,19 @@
 
 struct ShaderProgram;
 
+// Texel formats for upload_texture_format, besides the RGBA32 of upload_texture
+enum GfxTextureFormat {
+    GFX_TEXTURE_FORMAT_RGBA5551, // 16 bits in host byte order, red in the top bits and alpha in bit 0
+    GFX_TEXTURE_FORMAT_IA88,     // intensity byte then alpha byte, sampled as (I, I, I, A)
+    GFX_TEXTURE_FORMAT_I8        // intensity byte, sampled as (I, I, I, 1)
+};
+
 struct GfxRenderingAPI {
     bool (*z_is_from_0_to_1)(void);
     void (*unload_shader)(struct ShaderProgram *old_prg);
     void (*load_shader)(struct ShaderProgram *new_prg);
-    struct ShaderProgram *(*create_and_load_new_shader)(uint32_t shader_id);
-    struct ShaderProgram *(*lookup_shader)(uint32_t shader_id);
+    struct ShaderProgram *(*create_and_load_new_shader)(uint64_t shader_id);
+    struct ShaderProgram *(*lookup_shader)(uint64_t shader_id);
     void (*shader_get_info)(struct ShaderProgram *prg, uint8_t *num_inputs, bool used_textures[2]);
     uint32_t (*new_texture)(void);
     void (*select_texture)(int tile, uint32_t texture_id);
@@ -25,6 +32,47 @@ struct GfxRenderingAPI {
     void (*set_scissor)(int x, int y, int width, int height);
     void (*set_use_alpha)(bool use_alpha);
     void (*draw_triangles)(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_tris);
+    // Optional (may be NULL): draws indexed triangles from buf_vbo_num_verts unique vertices
+    void (*draw_triangles_indexed)(float buf_vbo[], size_t buf_vbo_len, size_t buf_vbo_num_verts, const uint16_t buf_ibo[], size_t buf_ibo_len);
+    // Optional (may be NULL): whether shaders with SHADER_OPT_PACKED_VERTICES are supported
+    bool (*supports_packed_vertices)(void);
+    // Optional (may be NULL): uploads to a region of the selected texture. Required for
+    // shaders with SHADER_OPT_TEXTURE_ATLAS.
+    void (*upload_texture_region)(const uint8_t *rgba32_buf, int x, int y, int width, int height);
+    // Optional (may be NULL): texture arrays for shaders with SHADER_OPT_TEXTURE_ARRAYS, used if
+    // supports_texture_arrays returns true. Their ids come from new_texture, and the other
+    // functions operate on the texture array selected for the tile.
+    bool (*supports_texture_arrays)(void);
+    void (*select_texture_array)(int tile, uint32_t texture_id);
+    void (*allocate_texture_array)(int width, int height, int layers);
+    void (*upload_texture_layer)(const uint8_t *rgba32_buf, int width, int height, int layer);
+    // Optional (may be NULL): whether shaders with SHADER_OPT_UBER are supported
+    bool (*supports_uber_shader)(void);
+    // Optional (may be NULL): frees a texture from new_texture. Without it, textures
+    // evicted from the texture cache are reused instead of freed.
+    void (*delete_texture)(uint32_t texture_id);
+    // Optional (may be NULL): CI textures as color indices for shaders with
+    // SHADER_OPT_PALETTE_TEXEL0/1. upload_index_texture uploads 8-bit indices to the
+    // selected texture. Palettes are textures from new_texture too: select_palette
+    // binds the palette of the tile, given the size of its index texture for
+    // SHADER_OPT_PALETTE_LINEAR, and upload_palette uploads 256 RGBA32 entries to it.
+    void (*upload_index_texture)(const uint8_t *index_buf, int width, int height);
+    void (*select_palette)(int tile, uint32_t texture_id, int width, int height);
+    void (*upload_palette)(const uint8_t *rgba32_buf);
+    // Optional (may be NULL): uploads texels in one of the smaller formats to the
+    // selected texture. Must support all of enum GfxTextureFormat.
+    void (*upload_texture_format)(const uint8_t *buf, int width, int height, enum GfxTextureFormat format);
+    // Optional (may be NULL): returns write-only memory of at least size bytes for the
+    // texels of the next upload, or NULL if none is available. If that upload reads
+    // from it, the texels are not copied on the way to the GPU. The memory is valid
+    // until the next call to the rendering API.
+    uint8_t *(*map_texture_staging)(size_t size);
+    // Optional (may be NULL): texels from the start of one row to the start of the next
+    // in the buffers of the following uploads, used if supports_texture_row_length returns
+    // true. 0, the default, means the rows follow each other. Lets a rectangle of a larger
+    // image be uploaded straight from it.
+    bool (*supports_texture_row_length)(void);
+    void (*set_texture_row_length)(int row_length);
     void (*init)(void);
     void (*on_resize)(void);
     void (*start_frame)(void);
@@ -0,0 +1,407 @@
+// Replays a display list capture (see gfx_capture.h) as fast as possible and
+// reports frame rate and how gfx_run's CPU time is split between stages.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _LANGUAGE_C
+#define _LANGUAGE_C
+#endif
+#include <PR/gbi.h>
+
+#include "gfx_pc.h"
+#include "gfx_capture.h"
+#include "gfx_trace.h"
+#include "gfx_null.h"
+#include "gfx_window_manager_api.h"
+#include "gfx_rendering_api.h"
+
+#ifdef ENABLE_OPENGL
+#include "gfx_opengl.h"
+#ifdef __linux__
+#include "gfx_glx.h"
+#else
+#include "gfx_sdl.h"
+#endif
+#endif
+
+#if defined(ENABLE_DX11) || defined(ENABLE_DX12)
+#include "gfx_dxgi.h"
+#include "gfx_direct3d11.h"
+#include "gfx_direct3d12.h"
+#endif
+
+static const struct {
+    const char *name;
+    struct GfxWindowManagerAPI *wapi;
+    struct GfxRenderingAPI *rapi;
+} backends[] = {
+    {"null", &gfx_null_wapi, &gfx_null_api},
+#ifdef ENABLE_OPENGL
+#ifdef __linux__
+    {"opengl", &gfx_glx, &gfx_opengl_api},
+#else
+    {"opengl", &gfx_sdl, &gfx_opengl_api},
+#endif
+#endif
+#ifdef ENABLE_DX11
+    {"dx11", &gfx_dxgi_api, &gfx_direct3d11_api},
+#endif
+#ifdef ENABLE_DX12
+    {"dx12", &gfx_dxgi_api, &gfx_direct3d12_api},
+#endif
+};
+
+static const char *stage_names[GFX_STAGE_COUNT] = {
+    "DL parsing",
+    "Vertex transform",
+    "Triangle setup",
+    "Texture import",
+    "Backend submission"
+};
+
+static const char *flush_reason_names[GFX_FLUSH_REASON_COUNT] = {
+    "Depth test",
+    "Depth mask",
+    "Decal",
+    "Viewport",
+    "Scissor",
+    "Shader",
+    "Alpha",
+    "Texture",
+    "Sampler",
+    "Buffer full",
+    "End of frame"
+};
+
+static struct GfxWindowManagerAPI replay_wapi;
+
+static bool replay_start_frame(void) {
+    // Never let the window manager skip frames to keep up with the display
+    return true;
+}
+
+static void replay_swap_buffers(void) {
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options] capture_file\n", argv0);
+    fprintf(stderr, "  --backend NAME  rendering backend, one of:");
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        fprintf(stderr, " %s", backends[i].name);
+    }
+    fprintf(stderr, " (default: null)\n");
+    fprintf(stderr, "  --loops N       replay the capture N times (default: 1)\n");
+    fprintf(stderr, "  --warmup N      run N frames before measuring (default: 0)\n");
+    fprintf(stderr, "  --indexed       draw with index buffers if the backend supports them\n");
+    fprintf(stderr, "  --packed        use the packed vertex format if the backend supports it\n");
+    fprintf(stderr, "  --bake-viewport apply the viewport transform on the CPU\n");
+    fprintf(stderr, "  --atlas         pack textures into atlas pages if the backend supports it\n");
+    fprintf(stderr, "  --texture-arrays keep textures in texture arrays if the backend supports them\n");
+    fprintf(stderr, "  --uber-shader   draw with a single uber shader if the backend supports it\n");
+    fprintf(stderr, "  --texture-hashing key textures by the hash of their contents instead of their address\n");
+    fprintf(stderr, "  --write-watch   only import or hash textures again when their memory was written (Linux)\n");
+    fprintf(stderr, "  --palette-textures upload CI textures as indices and look up their palette in the shader\n");
+    fprintf(stderr, "  --compact-textures upload 16-bit and intensity textures without expanding them to RGBA32\n");
+    fprintf(stderr, "  --staging       decode textures straight into the backend's staging memory if it supports it\n");
+    fprintf(stderr, "  --share-images  draw G_LOADTILE slices of the same image from one texture\n");
+    fprintf(stderr, "  --decode-threads N decode textures ahead on N worker threads (0: none, the default)\n");
+    fprintf(stderr, "  --disk-cache FILE keep decoded textures in FILE across runs\n");
+    fprintf(stderr, "  --texture-pack FILE replace textures with those of the texture pack FILE\n");
+    fprintf(stderr, "  --pack-budget MB upload at most MB megabytes of replacement textures per frame (default: 4)\n");
+    fprintf(stderr, "  --texture-cache N keep at most N textures in the texture cache (default: 512)\n");
+    fprintf(stderr, "  --vsync         present frames through the window manager instead of running uncapped\n");
+    fprintf(stderr, "  --csv FILE      write per-frame timings to FILE\n");
+    fprintf(stderr, "  --trace FILE    write a Chrome trace event timeline of the measured frames to FILE\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *backend_name = "null";
+    const char *capture_filename = NULL;
+    const char *csv_filename = NULL;
+    const char *trace_filename = NULL;
+    const char *disk_cache_filename = NULL;
+    const char *texture_pack_filename = NULL;
+    uint32_t pack_budget_mb = 4;
+    uint32_t loops = 1;
+    uint32_t warmup = 0;
+    bool vsync = false;
+    bool indexed = false;
+    bool packed = false;
+    bool bake_viewport = false;
+    bool atlas = false;
+    bool texture_arrays = false;
+    bool uber = false;
+    bool texture_hashing = false;
+    bool write_watch = false;
+    bool palette_textures = false;
+    bool compact_textures = false;
+    bool staging = false;
+    bool share_images = false;
+    uint32_t texture_cache_capacity = 512;
+    uint32_t decode_threads = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+            backend_name = argv[++i];
+        } else if (strcmp(argv[i], "--loops") == 0 && i + 1 < argc) {
+            loops = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--indexed") == 0) {
+            indexed = true;
+        } else if (strcmp(argv[i], "--packed") == 0) {
+            packed = true;
+        } else if (strcmp(argv[i], "--bake-viewport") == 0) {
+            bake_viewport = true;
+        } else if (strcmp(argv[i], "--atlas") == 0) {
+            atlas = true;
+        } else if (strcmp(argv[i], "--texture-arrays") == 0) {
+            texture_arrays = true;
+        } else if (strcmp(argv[i], "--uber-shader") == 0) {
+            uber = true;
+        } else if (strcmp(argv[i], "--texture-hashing") == 0) {
+            texture_hashing = true;
+        } else if (strcmp(argv[i], "--write-watch") == 0) {
+            write_watch = true;
+        } else if (strcmp(argv[i], "--palette-textures") == 0) {
+            palette_textures = true;
+        } else if (strcmp(argv[i], "--compact-textures") == 0) {
+            compact_textures = true;
+        } else if (strcmp(argv[i], "--staging") == 0) {
+            staging = true;
+        } else if (strcmp(argv[i], "--share-images") == 0) {
+            share_images = true;
+        } else if (strcmp(argv[i], "--texture-cache") == 0 && i + 1 < argc) {
+            texture_cache_capacity = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--decode-threads") == 0 && i + 1 < argc) {
+            decode_threads = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--disk-cache") == 0 && i + 1 < argc) {
+            disk_cache_filename = argv[++i];
+        } else if (strcmp(argv[i], "--texture-pack") == 0 && i + 1 < argc) {
+            texture_pack_filename = argv[++i];
+        } else if (strcmp(argv[i], "--pack-budget") == 0 && i + 1 < argc) {
+            pack_budget_mb = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--vsync") == 0) {
+            vsync = true;
+        } else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            csv_filename = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_filename = argv[++i];
+        } else if (argv[i][0] != '-' && capture_filename == NULL) {
+            capture_filename = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (capture_filename == NULL || loops == 0) {
+        usage(argv[0]);
+    }
+
+    size_t backend = 0;
+    while (backend < sizeof(backends) / sizeof(backends[0]) && strcmp(backends[backend].name, backend_name) != 0) {
+        backend++;
+    }
+    if (backend == sizeof(backends) / sizeof(backends[0])) {
+        fprintf(stderr, "Backend %s is not available in this build\n", backend_name);
+        return 1;
+    }
+
+    struct GfxCapture *capture = gfx_capture_open(capture_filename);
+    if (capture == NULL) {
+        fprintf(stderr, "Could not open capture %s\n", capture_filename);
+        return 1;
+    }
+    uint32_t num_frames = gfx_capture_get_num_frames(capture);
+    if (num_frames == 0) {
+        fprintf(stderr, "Capture %s contains no frames\n", capture_filename);
+        return 1;
+    }
+
+    FILE *csv = NULL;
+    if (csv_filename != NULL) {
+        csv = fopen(csv_filename, "w");
+        if (csv == NULL) {
+            fprintf(stderr, "Could not open %s\n", csv_filename);
+            return 1;
+        }
+        fprintf(csv, "frame,total_ns");
+        for (int s = 0; s < GFX_STAGE_COUNT; s++) {
+            fprintf(csv, ",%s", stage_names[s]);
+        }
+        fprintf(csv, "\n");
+    }
+
+    replay_wapi = *backends[backend].wapi;
+    replay_wapi.start_frame = replay_start_frame;
+    if (!vsync) {
+        replay_wapi.swap_buffers_begin = replay_swap_buffers;
+        replay_wapi.swap_buffers_end = replay_swap_buffers;
+    }
+
+    gfx_init(&replay_wapi, backends[backend].rapi, "gfx_replay", false);
+    gfx_set_stage_timing(true);
+    gfx_set_indexed_draws(indexed);
+    gfx_set_packed_vertices(packed);
+    gfx_set_baked_viewport(bake_viewport);
+    gfx_set_texture_atlas(atlas);
+    gfx_set_texture_arrays(texture_arrays);
+    gfx_set_uber_shader(uber);
+    gfx_set_texture_hashing(texture_hashing);
+    gfx_set_texture_write_watch(write_watch);
+    if (write_watch) {
+        size_t capture_size;
+        const void *capture_data = gfx_capture_get_data(capture, &capture_size);
+        gfx_add_texture_write_watch_region(capture_data, capture_size);
+    }
+    gfx_set_palette_textures(palette_textures);
+    gfx_set_compact_textures(compact_textures);
+    gfx_set_texture_staging(staging);
+    gfx_set_texture_image_sharing(share_images);
+    gfx_set_texture_cache_capacity(texture_cache_capacity);
+    gfx_set_texture_decode_threads(decode_threads);
+    gfx_set_texture_disk_cache(disk_cache_filename);
+    gfx_set_texture_pack(texture_pack_filename);
+    gfx_set_texture_pack_budget(pack_budget_mb << 20);
+
+    uint64_t total_frames = (uint64_t)num_frames * loops;
+    uint64_t stage_ns[GFX_STAGE_COUNT] = {0};
+    uint64_t draw_calls_by_reason[GFX_FLUSH_REASON_COUNT] = {0};
+    uint64_t tris_submitted = 0, tris_rejected = 0, tris_culled = 0, tris_drawn = 0, vertices = 0, draw_calls = 0;
+    uint64_t texture_hits = 0, texture_misses = 0, texture_evictions = 0, texture_bytes = 0, texture_bytes_hashed = 0, texture_decodes_ahead = 0, texture_disk_cache_hits = 0, texture_replacements = 0, texture_replacements_pending = 0, texture_image_slices = 0, shader_switches = 0, shaders_created = 0;
+    uint64_t total_ns = 0, max_frame_ns = 0;
+    uint64_t measured_frames = 0;
+
+    for (uint64_t i = 0; i < warmup + total_frames; i++) {
+        if (i == warmup && trace_filename != NULL && !gfx_trace_start(trace_filename)) {
+            fprintf(stderr, "Could not open %s\n", trace_filename);
+            return 1;
+        }
+        uint64_t t0 = now_ns();
+        Gfx *commands = gfx_capture_select_frame(capture, i % num_frames);
+        gfx_start_frame();
+        gfx_run(commands);
+        gfx_end_frame();
+        uint64_t t1 = now_ns();
+
+        if (i < warmup) {
+            continue;
+        }
+
+        struct GfxFrameStats stats;
+        gfx_get_frame_stats(&stats);
+        for (int s = 0; s < GFX_STAGE_COUNT; s++) {
+            stage_ns[s] += stats.stage_ns[s];
+        }
+        for (int r = 0; r < GFX_FLUSH_REASON_COUNT; r++) {
+            draw_calls_by_reason[r] += stats.draw_calls_by_reason[r];
+        }
+        tris_submitted += stats.triangles_submitted;
+        tris_rejected += stats.triangles_rejected;
+        tris_culled += stats.triangles_culled;
+        tris_drawn += stats.triangles_drawn;
+        vertices += stats.vertices_emitted;
+        draw_calls += stats.draw_calls;
+        texture_hits += stats.texture_cache_hits;
+        texture_decodes_ahead += stats.texture_decodes_ahead;
+        texture_disk_cache_hits += stats.texture_disk_cache_hits;
+        texture_replacements += stats.texture_replacements;
+        texture_replacements_pending += stats.texture_replacements_pending;
+        texture_image_slices += stats.texture_image_slices;
+        texture_misses += stats.texture_cache_misses;
+        texture_evictions += stats.texture_cache_evictions;
+        texture_bytes = stats.texture_cache_bytes;
+        texture_bytes_hashed += stats.texture_bytes_hashed;
+        shader_switches += stats.shader_switches;
+        shaders_created += stats.shaders_created;
+        total_ns += t1 - t0;
+        if (t1 - t0 > max_frame_ns) {
+            max_frame_ns = t1 - t0;
+        }
+        measured_frames++;
+
+        if (csv != NULL) {
+            fprintf(csv, "%llu,%llu", (unsigned long long)(i - warmup), (unsigned long long)(t1 - t0));
+            for (int s = 0; s < GFX_STAGE_COUNT; s++) {
+                fprintf(csv, ",%llu", (unsigned long long)stats.stage_ns[s]);
+            }
+            fprintf(csv, "\n");
+        }
+    }
+
+    gfx_trace_stop();
+    if (csv != NULL) {
+        fclose(csv);
+    }
+
+    double total_ms = total_ns / 1e6;
+    printf("Backend: %s, capture: %s (%u frames)\n", backend_name, capture_filename, num_frames);
+    printf("%llu frames in %.3f ms: %.1f fps, %.3f ms/frame avg, %.3f ms worst\n",
+           (unsigned long long)measured_frames, total_ms, measured_frames / (total_ms / 1000.0),
+           total_ms / measured_frames, max_frame_ns / 1e6);
+    printf("%-20s %12s %10s %7s\n", "Stage", "total ms", "ms/frame", "%");
+    uint64_t stages_total_ns = 0;
+    for (int s = 0; s < GFX_STAGE_COUNT; s++) {
+        stages_total_ns += stage_ns[s];
+        printf("%-20s %12.3f %10.4f %6.1f%%\n", stage_names[s], stage_ns[s] / 1e6,
+               stage_ns[s] / 1e6 / measured_frames, 100.0 * stage_ns[s] / total_ns);
+    }
+    printf("%-20s %12.3f %10.4f %6.1f%%\n", "Outside gfx_run", (total_ns - stages_total_ns) / 1e6,
+           (total_ns - stages_total_ns) / 1e6 / measured_frames, 100.0 * (total_ns - stages_total_ns) / total_ns);
+
+    double n = measured_frames;
+    printf("Triangles per frame: %.1f submitted, %.1f trivially rejected, %.1f culled, %.1f drawn\n",
+           tris_submitted / n, tris_rejected / n, tris_culled / n, tris_drawn / n);
+    printf("Vertices emitted per frame: %.1f (%.2f per triangle)\n", vertices / n,
+           tris_drawn != 0 ? (double)vertices / tris_drawn : 0.0);
+    printf("Textures per frame: %.1f cache hits, %.1f misses, %.2f evictions (%.1f MB cached at the end)\n",
+           texture_hits / n, texture_misses / n, texture_evictions / n, texture_bytes / (1024.0 * 1024.0));
+    if (texture_hashing) {
+        printf("Texture bytes hashed per frame: %.1f KB\n", texture_bytes_hashed / 1024.0 / n);
+    }
+    if (decode_threads != 0) {
+        printf("Textures decoded ahead per frame: %.1f of %.1f misses\n", texture_decodes_ahead / n, texture_misses / n);
+    }
+    if (disk_cache_filename != NULL) {
+        printf("Textures from the disk cache per frame: %.1f of %.1f misses\n", texture_disk_cache_hits / n, texture_misses / n);
+    }
+    if (texture_pack_filename != NULL) {
+        printf("Textures replaced per frame: %.1f (%.1f waiting for the budget)\n", texture_replacements / n, texture_replacements_pending / n);
+    }
+    if (share_images) {
+        printf("Textures drawn from a shared image per frame: %.1f of %.1f misses\n", texture_image_slices / n, texture_misses / n);
+    }
+    printf("Shaders per frame: %.1f switches, %.2f created\n", shader_switches / n, shaders_created / n);
+    printf("Draw calls per frame: %.1f (%.1f triangles per draw call)\n", draw_calls / n,
+           draw_calls != 0 ? (double)tris_drawn / draw_calls : 0.0);
+    printf("%-20s %10s %7s\n", "Flush reason", "per frame", "%");
+    for (int r = 0; r < GFX_FLUSH_REASON_COUNT; r++) {
+        if (draw_calls_by_reason[r] != 0) {
+            printf("%-20s %10.1f %6.1f%%\n", flush_reason_names[r], draw_calls_by_reason[r] / n,
+                   100.0 * draw_calls_by_reason[r] / draw_calls);
+        }
+    }
+
+    if (backends[backend].rapi == &gfx_null_api) {
+        struct GfxNullCounters counters;
+        gfx_null_get_counters(&counters);
+        printf("Backend counters per frame: %.1f draw calls, %.1f triangles, %.1f KB vertex data, %.2f texture uploads, %.2f shader creations\n",
+               (double)counters.draw_calls / counters.frames, (double)counters.triangles / counters.frames,
+               counters.vertex_bytes / 1024.0 / counters.frames, (double)counters.texture_uploads / counters.frames,
+               (double)counters.shaders_created / counters.frames);
+    }
+
+    gfx_capture_close(capture);
+    return 0;
+}
@@ -0,0 +1,180 @@
+#ifndef GFX_SIMD_H
+#define GFX_SIMD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Minimal vector abstraction for the renderer's hot loops. The widest
+// instruction set enabled at compile time is used: AVX2 (e.g. -mavx2 or
+// /arch:AVX2), SSE2 (always available on x86-64), NEON on AArch64, or plain
+// scalar code with a width of 1. 32-bit ARM NEON is not used because it has
+// no division and flushes denormals, so its results would differ from the
+// scalar code.
+//
+// All operations are plain IEEE single precision operations, so the same
+// sequence of operations gives bit-identical results on every path. Note that
+// when FMA instructions are enabled (e.g. -mfma), compilers may fuse multiplies
+// and adds here just as in scalar code; build with -ffp-contract=off if results
+// must match other builds exactly.
+//
+// gfx_vf holds GFX_SIMD_WIDTH floats, gfx_vi as many int32_t and gfx_vm a
+// comparison result per lane. Loads and stores don't need to be aligned.
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+#define GFX_SIMD_WIDTH 8
+
+typedef __m256 gfx_vf;
+typedef __m256i gfx_vi;
+typedef __m256 gfx_vm;
+
+static inline gfx_vf vf_load(const float *p) { return _mm256_loadu_ps(p); }
+static inline void vf_store(float *p, gfx_vf a) { _mm256_storeu_ps(p, a); }
+static inline gfx_vf vf_set1(float a) { return _mm256_set1_ps(a); }
+static inline gfx_vf vf_add(gfx_vf a, gfx_vf b) { return _mm256_add_ps(a, b); }
+static inline gfx_vf vf_mul(gfx_vf a, gfx_vf b) { return _mm256_mul_ps(a, b); }
+static inline gfx_vf vf_div(gfx_vf a, gfx_vf b) { return _mm256_div_ps(a, b); }
+static inline gfx_vf vf_neg(gfx_vf a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+static inline gfx_vf vf_abs(gfx_vf a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+static inline gfx_vm vf_lt(gfx_vf a, gfx_vf b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline gfx_vm vf_gt(gfx_vf a, gfx_vf b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+static inline gfx_vf vf_select(gfx_vm m, gfx_vf a, gfx_vf b) { return _mm256_blendv_ps(b, a, m); }
+static inline gfx_vi vf_to_vi(gfx_vf a) { return _mm256_cvttps_epi32(a); }
+static inline gfx_vf vi_to_vf(gfx_vi a) { return _mm256_cvtepi32_ps(a); }
+static inline void vi_store(int32_t *p, gfx_vi a) { _mm256_storeu_si256((__m256i *)p, a); }
+static inline gfx_vi vi_or(gfx_vi a, gfx_vi b) { return _mm256_or_si256(a, b); }
+static inline gfx_vi vm_to_bit(gfx_vm m, int32_t bit) { return _mm256_and_si256(_mm256_castps_si256(m), _mm256_set1_epi32(bit)); }
+
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#include <emmintrin.h>
+#define GFX_SIMD_WIDTH 4
+
+typedef __m128 gfx_vf;
+typedef __m128i gfx_vi;
+typedef __m128 gfx_vm;
+
+static inline gfx_vf vf_load(const float *p) { return _mm_loadu_ps(p); }
+static inline void vf_store(float *p, gfx_vf a) { _mm_storeu_ps(p, a); }
+static inline gfx_vf vf_set1(float a) { return _mm_set1_ps(a); }
+static inline gfx_vf vf_add(gfx_vf a, gfx_vf b) { return _mm_add_ps(a, b); }
+static inline gfx_vf vf_mul(gfx_vf a, gfx_vf b) { return _mm_mul_ps(a, b); }
+static inline gfx_vf vf_div(gfx_vf a, gfx_vf b) { return _mm_div_ps(a, b); }
+static inline gfx_vf vf_neg(gfx_vf a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+static inline gfx_vf vf_abs(gfx_vf a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+static inline gfx_vm vf_lt(gfx_vf a, gfx_vf b) { return _mm_cmplt_ps(a, b); }
+static inline gfx_vm vf_gt(gfx_vf a, gfx_vf b) { return _mm_cmpgt_ps(a, b); }
+static inline gfx_vf vf_select(gfx_vm m, gfx_vf a, gfx_vf b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+static inline gfx_vi vf_to_vi(gfx_vf a) { return _mm_cvttps_epi32(a); }
+static inline gfx_vf vi_to_vf(gfx_vi a) { return _mm_cvtepi32_ps(a); }
+static inline void vi_store(int32_t *p, gfx_vi a) { _mm_storeu_si128((__m128i *)p, a); }
+static inline gfx_vi vi_or(gfx_vi a, gfx_vi b) { return _mm_or_si128(a, b); }
+static inline gfx_vi vm_to_bit(gfx_vm m, int32_t bit) { return _mm_and_si128(_mm_castps_si128(m), _mm_set1_epi32(bit)); }
+
+#elif defined(__aarch64__) || defined(_M_ARM64)
+
+#include <arm_neon.h>
+#define GFX_SIMD_WIDTH 4
+
+typedef float32x4_t gfx_vf;
+typedef int32x4_t gfx_vi;
+typedef uint32x4_t gfx_vm;
+
+static inline gfx_vf vf_load(const float *p) { return vld1q_f32(p); }
+static inline void vf_store(float *p, gfx_vf a) { vst1q_f32(p, a); }
+static inline gfx_vf vf_set1(float a) { return vdupq_n_f32(a); }
+static inline gfx_vf vf_add(gfx_vf a, gfx_vf b) { return vaddq_f32(a, b); }
+static inline gfx_vf vf_mul(gfx_vf a, gfx_vf b) { return vmulq_f32(a, b); }
+static inline gfx_vf vf_div(gfx_vf a, gfx_vf b) { return vdivq_f32(a, b); }
+static inline gfx_vf vf_neg(gfx_vf a) { return vnegq_f32(a); }
+static inline gfx_vf vf_abs(gfx_vf a) { return vabsq_f32(a); }
+static inline gfx_vm vf_lt(gfx_vf a, gfx_vf b) { return vcltq_f32(a, b); }
+static inline gfx_vm vf_gt(gfx_vf a, gfx_vf b) { return vcgtq_f32(a, b); }
+static inline gfx_vf vf_select(gfx_vm m, gfx_vf a, gfx_vf b) { return vbslq_f32(m, a, b); }
+static inline gfx_vi vf_to_vi(gfx_vf a) { return vcvtq_s32_f32(a); }
+static inline gfx_vf vi_to_vf(gfx_vi a) { return vcvtq_f32_s32(a); }
+static inline void vi_store(int32_t *p, gfx_vi a) { vst1q_s32(p, a); }
+static inline gfx_vi vi_or(gfx_vi a, gfx_vi b) { return vorrq_s32(a, b); }
+static inline gfx_vi vm_to_bit(gfx_vm m, int32_t bit) { return vandq_s32(vreinterpretq_s32_u32(m), vdupq_n_s32(bit)); }
+
+#else
+
+#include <math.h>
+#define GFX_SIMD_WIDTH 1
+
+typedef float gfx_vf;
+typedef int32_t gfx_vi;
+typedef bool gfx_vm;
+
+static inline gfx_vf vf_load(const float *p) { return *p; }
+static inline void vf_store(float *p, gfx_vf a) { *p = a; }
+static inline gfx_vf vf_set1(float a) { return a; }
+static inline gfx_vf vf_add(gfx_vf a, gfx_vf b) { return a + b; }
+static inline gfx_vf vf_mul(gfx_vf a, gfx_vf b) { return a * b; }
+static inline gfx_vf vf_div(gfx_vf a, gfx_vf b) { return a / b; }
+static inline gfx_vf vf_neg(gfx_vf a) { return -a; }
+static inline gfx_vf vf_abs(gfx_vf a) { return fabsf(a); }
+static inline gfx_vm vf_lt(gfx_vf a, gfx_vf b) { return a < b; }
+static inline gfx_vm vf_gt(gfx_vf a, gfx_vf b) { return a > b; }
+static inline gfx_vf vf_select(gfx_vm m, gfx_vf a, gfx_vf b) { return m ? a : b; }
+static inline gfx_vi vf_to_vi(gfx_vf a) { return (int32_t)a; }
+static inline gfx_vf vi_to_vf(gfx_vi a) { return (float)a; }
+static inline void vi_store(int32_t *p, gfx_vi a) { *p = a; }
+static inline gfx_vi vi_or(gfx_vi a, gfx_vi b) { return a | b; }
+static inline gfx_vi vm_to_bit(gfx_vm m, int32_t bit) { return m ? bit : 0; }
+
+#endif
+
+// gfx_vb holds 16 bytes, which the texture decoders also treat as 8 uint16_t
+// lanes in little endian order. GFX_SIMD_BYTES is only defined where they are
+// available (SSE2 and NEON); otherwise the decoders only use their scalar loops.
+// Shift counts must be less than 16.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#include <emmintrin.h>
+#define GFX_SIMD_BYTES 16
+
+typedef __m128i gfx_vb;
+
+static inline gfx_vb vb_load(const uint8_t *p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline void vb_store(uint8_t *p, gfx_vb a) { _mm_storeu_si128((__m128i *)p, a); }
+static inline gfx_vb vb_set1_u8(uint8_t a) { return _mm_set1_epi8((char)a); }
+static inline gfx_vb vb_set1_u16(uint16_t a) { return _mm_set1_epi16((short)a); }
+static inline gfx_vb vb_and(gfx_vb a, gfx_vb b) { return _mm_and_si128(a, b); }
+static inline gfx_vb vb_or(gfx_vb a, gfx_vb b) { return _mm_or_si128(a, b); }
+static inline gfx_vb vb_cmpeq_u8(gfx_vb a, gfx_vb b) { return _mm_cmpeq_epi8(a, b); }
+static inline gfx_vb vb_shl_u16(gfx_vb a, int n) { return _mm_sll_epi16(a, _mm_cvtsi32_si128(n)); }
+static inline gfx_vb vb_shr_u16(gfx_vb a, int n) { return _mm_srl_epi16(a, _mm_cvtsi32_si128(n)); }
+static inline gfx_vb vb_mul_u16(gfx_vb a, gfx_vb b) { return _mm_mullo_epi16(a, b); }
+static inline gfx_vb vb_zip_lo_u8(gfx_vb a, gfx_vb b) { return _mm_unpacklo_epi8(a, b); }
+static inline gfx_vb vb_zip_hi_u8(gfx_vb a, gfx_vb b) { return _mm_unpackhi_epi8(a, b); }
+static inline gfx_vb vb_zip_lo_u16(gfx_vb a, gfx_vb b) { return _mm_unpacklo_epi16(a, b); }
+static inline gfx_vb vb_zip_hi_u16(gfx_vb a, gfx_vb b) { return _mm_unpackhi_epi16(a, b); }
+
+#elif defined(__aarch64__) || defined(_M_ARM64)
+
+#include <arm_neon.h>
+#define GFX_SIMD_BYTES 16
+
+typedef uint8x16_t gfx_vb;
+
+static inline gfx_vb vb_load(const uint8_t *p) { return vld1q_u8(p); }
+static inline void vb_store(uint8_t *p, gfx_vb a) { vst1q_u8(p, a); }
+static inline gfx_vb vb_set1_u8(uint8_t a) { return vdupq_n_u8(a); }
+static inline gfx_vb vb_set1_u16(uint16_t a) { return vreinterpretq_u8_u16(vdupq_n_u16(a)); }
+static inline gfx_vb vb_and(gfx_vb a, gfx_vb b) { return vandq_u8(a, b); }
+static inline gfx_vb vb_or(gfx_vb a, gfx_vb b) { return vorrq_u8(a, b); }
+static inline gfx_vb vb_cmpeq_u8(gfx_vb a, gfx_vb b) { return vceqq_u8(a, b); }
+static inline gfx_vb vb_shl_u16(gfx_vb a, int n) { return vreinterpretq_u8_u16(vshlq_u16(vreinterpretq_u16_u8(a), vdupq_n_s16(n))); }
+static inline gfx_vb vb_shr_u16(gfx_vb a, int n) { return vreinterpretq_u8_u16(vshlq_u16(vreinterpretq_u16_u8(a), vdupq_n_s16(-n))); }
+static inline gfx_vb vb_mul_u16(gfx_vb a, gfx_vb b) { return vreinterpretq_u8_u16(vmulq_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b))); }
+static inline gfx_vb vb_zip_lo_u8(gfx_vb a, gfx_vb b) { return vzip1q_u8(a, b); }
+static inline gfx_vb vb_zip_hi_u8(gfx_vb a, gfx_vb b) { return vzip2q_u8(a, b); }
+static inline gfx_vb vb_zip_lo_u16(gfx_vb a, gfx_vb b) { return vreinterpretq_u8_u16(vzip1q_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b))); }
+static inline gfx_vb vb_zip_hi_u16(gfx_vb a, gfx_vb b) { return vreinterpretq_u8_u16(vzip2q_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b))); }
+
+#endif
+
+#endif
@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "gfx_texture_pack.h"
+
+struct GfxTexturePack {
+    uint8_t *data;
+    uint64_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    uintptr_t page_size;
+#endif
+    const struct GfxTexturePackHeader *header;
+    const struct GfxTexturePackEntry *index;
+};
+
+static bool gfx_texture_pack_validate(const struct GfxTexturePack *pack) {
+    if (pack->size < sizeof(struct GfxTexturePackHeader)) {
+        return false;
+    }
+    const struct GfxTexturePackHeader *header = pack->header;
+    if (header->magic != GFX_TEXTURE_PACK_MAGIC || header->version != GFX_TEXTURE_PACK_VERSION) {
+        return false;
+    }
+    uint32_t capacity = header->index_capacity;
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        return false;
+    }
+    return sizeof(struct GfxTexturePackHeader) + (uint64_t)capacity * sizeof(struct GfxTexturePackEntry) <= pack->size;
+}
+
+struct GfxTexturePack *gfx_texture_pack_open(const char *filename) {
+    struct GfxTexturePack *pack = calloc(1, sizeof(struct GfxTexturePack));
+
+#ifdef _WIN32
+    pack->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (pack->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(pack->file, &size) || size.QuadPart == 0) {
+        if (pack->file != INVALID_HANDLE_VALUE) {
+            CloseHandle(pack->file);
+        }
+        free(pack);
+        return NULL;
+    }
+    pack->mapping = CreateFileMappingA(pack->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    pack->data = pack->mapping != NULL ? (uint8_t *)MapViewOfFile(pack->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    pack->size = size.QuadPart;
+    if (pack->data == NULL) {
+        if (pack->mapping != NULL) {
+            CloseHandle(pack->mapping);
+        }
+        CloseHandle(pack->file);
+        free(pack);
+        return NULL;
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(pack);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        free(pack);
+        return NULL;
+    }
+    pack->data = data;
+    pack->size = st.st_size;
+    pack->page_size = sysconf(_SC_PAGESIZE);
+#endif
+
+    pack->header = (const struct GfxTexturePackHeader *)pack->data;
+    pack->index = (const struct GfxTexturePackEntry *)(pack->data + sizeof(struct GfxTexturePackHeader));
+    if (!gfx_texture_pack_validate(pack)) {
+        gfx_texture_pack_close(pack);
+        return NULL;
+    }
+    return pack;
+}
+
+void gfx_texture_pack_close(struct GfxTexturePack *pack) {
+#ifdef _WIN32
+    UnmapViewOfFile(pack->data);
+    CloseHandle(pack->mapping);
+    CloseHandle(pack->file);
+#else
+    munmap(pack->data, pack->size);
+#endif
+    free(pack);
+}
+
+const struct GfxTexturePackEntry *gfx_texture_pack_find(const struct GfxTexturePack *pack, uint64_t hash, uint64_t params) {
+    uint32_t mask = pack->header->index_capacity - 1;
+    uint32_t slot = hash & mask;
+    for (uint32_t probes = 0; probes <= mask; probes++, slot = (slot + 1) & mask) {
+        const struct GfxTexturePackEntry *entry = &pack->index[slot];
+        if (entry->size == 0) {
+            break;
+        }
+        if (entry->hash == hash && entry->params == params) {
+            bool valid = entry->width != 0 && entry->height != 0 && entry->width <= GFX_TEXTURE_PACK_MAX_SIZE &&
+                         entry->height <= GFX_TEXTURE_PACK_MAX_SIZE && entry->size == (uint64_t)entry->width * entry->height * 4 &&
+                         entry->offset <= pack->size && entry->size <= pack->size - entry->offset;
+            if (!valid) {
+                static bool logged;
+                if (!logged) {
+                    fprintf(stderr, "Texture pack: ignoring entries with an invalid size or offset\n");
+                    logged = true;
+                }
+                return NULL;
+            }
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+const uint8_t *gfx_texture_pack_payload(const struct GfxTexturePack *pack, const struct GfxTexturePackEntry *entry) {
+    return pack->data + entry->offset;
+}
+
+// The prefetch and release hints are only given through madvise
+void gfx_texture_pack_prefetch(const struct GfxTexturePack *pack, const struct GfxTexturePackEntry *entry) {
+#ifndef _WIN32
+    // Whole pages around the payload
+    uintptr_t start = (uintptr_t)(pack->data + entry->offset) & ~(pack->page_size - 1);
+    uintptr_t end = (uintptr_t)(pack->data + entry->offset + entry->size);
+    madvise((void *)start, end - start, MADV_WILLNEED);
+#endif
+}
+
+void gfx_texture_pack_release(const struct GfxTexturePack *pack, const struct GfxTexturePackEntry *entry) {
+#ifndef _WIN32
+    // Only pages within the payload, as the others may hold prefetched payloads
+    uintptr_t start = ((uintptr_t)(pack->data + entry->offset) + pack->page_size - 1) & ~(pack->page_size - 1);
+    uintptr_t end = (uintptr_t)(pack->data + entry->offset + entry->size) & ~(pack->page_size - 1);
+    if (start < end) {
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+#endif
+}
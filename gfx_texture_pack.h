@@ -0,0 +1,71 @@
+#ifndef GFX_TEXTURE_PACK_H
+#define GFX_TEXTURE_PACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Read-only container of replacement textures, such as upscaled ones. The
+// file is memory mapped, and its index is a hash table that is probed in
+// place, so opening a pack and looking textures up take constant time and
+// memory whatever its size, and payloads are only read when they are used.
+//
+// File layout (native endianness):
+//
+//   struct GfxTexturePackHeader
+//   struct GfxTexturePackEntry index[index_capacity]
+//   payloads: RGBA32 texels, row by row, at the offsets of the entries
+//
+// Entries are placed by linear probing from slot key.hash & (index_capacity - 1),
+// and empty slots have a size of 0. The capacity must be a power of two larger
+// than the number of entries.
+//
+// Keys of N64 textures (see gfx_pc.c):
+//   hash: XXH64, seed 0, of the texels as loaded by G_LOADBLOCK or G_LOADTILE.
+//         For CI textures, followed by XXH64 of their palette seeded with that
+//         hash: 16 colors for CI4 and 256 for CI8 from the start of the loaded
+//         TLUT, or fewer if fewer were loaded, as big-endian RGBA 5551.
+//   params: size of the loaded texels in bytes | line size in bytes << 16 |
+//           G_IM_FMT_* << 32 | G_IM_SIZ_* << 36
+// A replacement should keep the aspect ratio of the texture it replaces.
+
+#define GFX_TEXTURE_PACK_MAGIC 0x50543346 // "F3TP"
+#define GFX_TEXTURE_PACK_VERSION 1
+#define GFX_TEXTURE_PACK_MAX_SIZE 8192 // texels per side of a replacement, larger ones are ignored
+
+struct GfxTexturePackHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t index_capacity;
+    uint32_t padding;
+};
+
+struct GfxTexturePackEntry {
+    uint64_t hash;
+    uint64_t params;
+    uint64_t offset; // of the payload, from the start of the file
+    uint32_t size; // of the payload, width * height * 4
+    uint16_t width, height;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct GfxTexturePack;
+
+struct GfxTexturePack *gfx_texture_pack_open(const char *filename);
+void gfx_texture_pack_close(struct GfxTexturePack *pack);
+
+// Returns NULL if the pack has no replacement for the key
+const struct GfxTexturePackEntry *gfx_texture_pack_find(const struct GfxTexturePack *pack, uint64_t hash, uint64_t params);
+const uint8_t *gfx_texture_pack_payload(const struct GfxTexturePack *pack, const struct GfxTexturePackEntry *entry);
+// Starts reading the payload from disk in the background, before it is used
+void gfx_texture_pack_prefetch(const struct GfxTexturePack *pack, const struct GfxTexturePackEntry *entry);
+// Drops the pages of the payload from the process, once it has been uploaded
+void gfx_texture_pack_release(const struct GfxTexturePack *pack, const struct GfxTexturePackEntry *entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "gfx_trace.h"
+
+#define TRACE_BUFFER_EVENTS 8192
+
+struct TraceEvent {
+    const char *name; // NULL for end events
+    const char *arg_name;
+    uint64_t arg;
+    uint64_t time;
+    bool arg_hex;
+};
+
+static struct {
+    FILE *file;
+    uint64_t start_time;
+    struct TraceEvent events[TRACE_BUFFER_EVENTS];
+    uint32_t num_events;
+    uint32_t depth; // open begin events
+} trace;
+
+bool gfx_trace_enabled;
+
+static uint64_t gfx_trace_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void gfx_trace_write_events(void) {
+    for (uint32_t i = 0; i < trace.num_events; i++) {
+        const struct TraceEvent *ev = &trace.events[i];
+        uint64_t t = ev->time - trace.start_time;
+        // Timestamps are in microseconds
+        fprintf(trace.file, ",\n{\"ph\":\"%c\",\"pid\":1,\"tid\":1,\"ts\":%llu.%03u",
+                ev->name != NULL ? 'B' : 'E', (unsigned long long)(t / 1000), (unsigned)(t % 1000));
+        if (ev->name != NULL) {
+            fprintf(trace.file, ",\"name\":\"%s\"", ev->name);
+            if (ev->arg_name != NULL && ev->arg_hex) {
+                fprintf(trace.file, ",\"args\":{\"%s\":\"0x%llx\"}", ev->arg_name, (unsigned long long)ev->arg);
+            } else if (ev->arg_name != NULL) {
+                fprintf(trace.file, ",\"args\":{\"%s\":%llu}", ev->arg_name, (unsigned long long)ev->arg);
+            }
+        }
+        fputc('}', trace.file);
+    }
+    trace.num_events = 0;
+}
+
+static void gfx_trace_add(const char *name, const char *arg_name, uint64_t arg, bool arg_hex) {
+    if (trace.num_events == TRACE_BUFFER_EVENTS) {
+        // Make the time spent writing the trace itself visible in the timeline
+        uint64_t t0 = gfx_trace_get_time();
+        gfx_trace_write_events();
+        trace.events[0] = (struct TraceEvent){"gfx_trace_write", NULL, 0, t0, false};
+        trace.events[1] = (struct TraceEvent){NULL, NULL, 0, gfx_trace_get_time(), false};
+        trace.num_events = 2;
+    }
+    struct TraceEvent *ev = &trace.events[trace.num_events++];
+    ev->name = name;
+    ev->arg_name = arg_name;
+    ev->arg = arg;
+    ev->arg_hex = arg_hex;
+    ev->time = gfx_trace_get_time();
+}
+
+void gfx_trace_begin(const char *name, const char *arg_name, uint64_t arg, bool arg_hex) {
+    trace.depth++;
+    gfx_trace_add(name, arg_name, arg, arg_hex);
+}
+
+void gfx_trace_end(void) {
+    // Ignore ends of events that began before tracing was started
+    if (trace.depth > 0) {
+        trace.depth--;
+        gfx_trace_add(NULL, NULL, 0, false);
+    }
+}
+
+bool gfx_trace_start(const char *filename) {
+    gfx_trace_stop();
+    trace.file = fopen(filename, "w");
+    if (trace.file == NULL) {
+        return false;
+    }
+    fprintf(trace.file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(trace.file, "{\"ph\":\"M\",\"pid\":1,\"tid\":1,\"name\":\"thread_name\",\"args\":{\"name\":\"gfx\"}}");
+    trace.start_time = gfx_trace_get_time();
+    trace.num_events = 0;
+    trace.depth = 0;
+    gfx_trace_enabled = true;
+    return true;
+}
+
+void gfx_trace_stop(void) {
+    if (trace.file == NULL) {
+        return;
+    }
+    while (trace.depth > 0) {
+        gfx_trace_end();
+    }
+    gfx_trace_enabled = false;
+    gfx_trace_write_events();
+    fprintf(trace.file, "\n]}\n");
+    fclose(trace.file);
+    trace.file = NULL;
+}
@@ -0,0 +1,32 @@
+#ifndef GFX_TRACE_H
+#define GFX_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Timeline tracing of the frame pipeline in the Chrome trace event format.
+// The output file can be opened in chrome://tracing or https://ui.perfetto.dev.
+//
+// Events are buffered in memory and written out in batches, so a trace can be
+// left running for a long session. When tracing is off, every trace point in
+// the renderer costs a single predictable branch on gfx_trace_enabled.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool gfx_trace_start(const char *filename);
+void gfx_trace_stop(void);
+
+// Used by gfx_pc.c. name and arg_name must be string literals (only the
+// pointers are stored). arg_name may be NULL if the event has no argument,
+// arg_hex shows the argument as a hexadecimal string (addresses, ids).
+extern bool gfx_trace_enabled;
+void gfx_trace_begin(const char *name, const char *arg_name, uint64_t arg, bool arg_hex);
+void gfx_trace_end(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
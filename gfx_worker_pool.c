@@ -0,0 +1,238 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "gfx_worker_pool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define MAX_THREADS 16
+
+enum {
+    JOB_IDLE, // not submitted, or finished
+    JOB_QUEUED,
+    JOB_RUNNING
+};
+
+static struct {
+    uint32_t num_threads;
+    bool stopping;
+    struct GfxWorkerJob *head, *tail;
+#ifdef _WIN32
+    SRWLOCK lock;
+    CONDITION_VARIABLE work_available, job_finished;
+    HANDLE threads[MAX_THREADS];
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t work_available, job_finished;
+    pthread_t threads[MAX_THREADS];
+#endif
+} pool = {
+#ifdef _WIN32
+    .lock = SRWLOCK_INIT,
+    .work_available = CONDITION_VARIABLE_INIT,
+    .job_finished = CONDITION_VARIABLE_INIT,
+#else
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_available = PTHREAD_COND_INITIALIZER,
+    .job_finished = PTHREAD_COND_INITIALIZER,
+#endif
+};
+
+#ifdef _WIN32
+
+static void pool_lock(void) {
+    AcquireSRWLockExclusive(&pool.lock);
+}
+
+static void pool_unlock(void) {
+    ReleaseSRWLockExclusive(&pool.lock);
+}
+
+static void pool_sleep(CONDITION_VARIABLE *cond) {
+    SleepConditionVariableSRW(cond, &pool.lock, INFINITE, 0);
+}
+
+static void pool_wake_one(CONDITION_VARIABLE *cond) {
+    WakeConditionVariable(cond);
+}
+
+static void pool_wake_all(CONDITION_VARIABLE *cond) {
+    WakeAllConditionVariable(cond);
+}
+
+#else
+
+static void pool_lock(void) {
+    pthread_mutex_lock(&pool.lock);
+}
+
+static void pool_unlock(void) {
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void pool_sleep(pthread_cond_t *cond) {
+    pthread_cond_wait(cond, &pool.lock);
+}
+
+static void pool_wake_one(pthread_cond_t *cond) {
+    pthread_cond_signal(cond);
+}
+
+static void pool_wake_all(pthread_cond_t *cond) {
+    pthread_cond_broadcast(cond);
+}
+
+#endif
+
+static void gfx_worker_pool_run_jobs(void) {
+    pool_lock();
+    for (;;) {
+        while (pool.head == NULL && !pool.stopping) {
+            pool_sleep(&pool.work_available);
+        }
+        if (pool.head == NULL) {
+            break;
+        }
+        struct GfxWorkerJob *job = pool.head;
+        pool.head = job->next;
+        if (pool.head == NULL) {
+            pool.tail = NULL;
+        }
+        job->state = JOB_RUNNING;
+        pool_unlock();
+        job->run(job);
+        pool_lock();
+        job->state = JOB_IDLE;
+        pool_wake_all(&pool.job_finished);
+    }
+    pool_unlock();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI gfx_worker_pool_thread(LPVOID arg) {
+    gfx_worker_pool_run_jobs();
+    return 0;
+}
+#else
+static void *gfx_worker_pool_thread(void *arg) {
+    gfx_worker_pool_run_jobs();
+    return NULL;
+}
+#endif
+
+// Removes a queued job, with the lock held
+static void gfx_worker_pool_unlink(struct GfxWorkerJob *job) {
+    struct GfxWorkerJob *prev = NULL;
+    struct GfxWorkerJob *cur = pool.head;
+    while (cur != job) {
+        prev = cur;
+        cur = cur->next;
+    }
+    if (prev != NULL) {
+        prev->next = job->next;
+    } else {
+        pool.head = job->next;
+    }
+    if (pool.tail == job) {
+        pool.tail = prev;
+    }
+}
+
+bool gfx_worker_pool_start(uint32_t num_threads) {
+    if (num_threads > MAX_THREADS) {
+        num_threads = MAX_THREADS;
+    }
+    pool.stopping = false;
+    while (pool.num_threads < num_threads) {
+#ifdef _WIN32
+        HANDLE thread = CreateThread(NULL, 0, gfx_worker_pool_thread, NULL, 0, NULL);
+        if (thread == NULL) {
+            break;
+        }
+        pool.threads[pool.num_threads++] = thread;
+#else
+        if (pthread_create(&pool.threads[pool.num_threads], NULL, gfx_worker_pool_thread, NULL) != 0) {
+            break;
+        }
+        pool.num_threads++;
+#endif
+    }
+    return pool.num_threads > 0;
+}
+
+void gfx_worker_pool_stop(void) {
+    pool_lock();
+    pool.stopping = true;
+    pool_wake_all(&pool.work_available);
+    pool_unlock();
+    for (uint32_t i = 0; i < pool.num_threads; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(pool.threads[i], INFINITE);
+        CloseHandle(pool.threads[i]);
+#else
+        pthread_join(pool.threads[i], NULL);
+#endif
+    }
+    pool.num_threads = 0;
+}
+
+uint32_t gfx_worker_pool_num_threads(void) {
+    return pool.num_threads;
+}
+
+uint32_t gfx_worker_pool_num_processors(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long n = info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return n > 0 ? n : 1;
+}
+
+void gfx_worker_pool_submit(struct GfxWorkerJob *job) {
+    job->next = NULL;
+    pool_lock();
+    job->state = JOB_QUEUED;
+    if (pool.tail != NULL) {
+        pool.tail->next = job;
+    } else {
+        pool.head = job;
+    }
+    pool.tail = job;
+    pool_wake_one(&pool.work_available);
+    pool_unlock();
+}
+
+void gfx_worker_pool_wait(struct GfxWorkerJob *job) {
+    pool_lock();
+    if (job->state == JOB_QUEUED) {
+        gfx_worker_pool_unlink(job);
+        job->state = JOB_IDLE;
+        pool_unlock();
+        job->run(job);
+        return;
+    }
+    while (job->state == JOB_RUNNING) {
+        pool_sleep(&pool.job_finished);
+    }
+    pool_unlock();
+}
+
+bool gfx_worker_pool_cancel(struct GfxWorkerJob *job) {
+    pool_lock();
+    if (job->state == JOB_QUEUED) {
+        gfx_worker_pool_unlink(job);
+        job->state = JOB_IDLE;
+    }
+    bool idle = job->state == JOB_IDLE;
+    pool_unlock();
+    return idle;
+}
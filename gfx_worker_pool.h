@@ -0,0 +1,46 @@
+#ifndef GFX_WORKER_POOL_H
+#define GFX_WORKER_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// A fixed set of worker threads that run jobs in submission order. Jobs are
+// owned by the caller, who must wait for or cancel each submitted job before
+// reusing or freeing it. Waiting for a job that no worker has started yet
+// runs it on the waiting thread instead, so waiting never takes longer than
+// running the job inline (besides a job already running on a worker).
+//
+// Uses pthreads, or Win32 threads on Windows. All functions must be called
+// from the same thread.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct GfxWorkerJob {
+    void (*run)(struct GfxWorkerJob *job);
+    // Owned by the pool while submitted
+    struct GfxWorkerJob *next;
+    volatile int state;
+};
+
+// Starts the worker threads. Returns false if none could be started.
+bool gfx_worker_pool_start(uint32_t num_threads);
+// Stops the worker threads. All submitted jobs must have been waited for or cancelled.
+void gfx_worker_pool_stop(void);
+uint32_t gfx_worker_pool_num_threads(void);
+// Number of logical processors, at least 1
+uint32_t gfx_worker_pool_num_processors(void);
+
+void gfx_worker_pool_submit(struct GfxWorkerJob *job);
+// Waits until the job has run, running it here if no worker has started it
+void gfx_worker_pool_wait(struct GfxWorkerJob *job);
+// Removes the job if no worker has started it yet. Returns false if it is
+// still running, in which case it must be cancelled or waited for again.
+bool gfx_worker_pool_cancel(struct GfxWorkerJob *job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,274 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "gfx_write_watch.h"
+
+#ifdef __linux__
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define WATCHED_PAGES 8192 // power of two
+#define WATCHED_REGIONS 16
+
+struct WatchedPage {
+    uintptr_t page; // 0 means empty slot
+    volatile uint32_t written_generation;
+    volatile bool protected;
+    int prot; // of its mapping, restored when a write is let through
+};
+
+static struct {
+    bool started;
+    uintptr_t page_size;
+    struct sigaction old_action;
+    // Allocated with mmap, so that it never shares a page with watched memory
+    struct WatchedPage *pages;
+    uint32_t num_pages;
+    struct {
+        uintptr_t start, end;
+    } regions[WATCHED_REGIONS];
+    uint32_t num_regions;
+    volatile uint32_t generation;
+    // The mapping found last in /proc/self/maps
+    uintptr_t mapping_start, mapping_end;
+    int mapping_prot;
+} watch;
+
+// Reads the protection of the private mapping containing the page. Returns
+// false if it isn't in one, as writes through other mappings go unnoticed.
+static bool gfx_write_watch_mapping_prot(uintptr_t page, int *prot) {
+    if (page < watch.mapping_start || page >= watch.mapping_end) {
+        FILE *maps = fopen("/proc/self/maps", "r");
+        if (maps == NULL) {
+            return false;
+        }
+        watch.mapping_start = 0;
+        watch.mapping_end = 0;
+        char line[512];
+        while (fgets(line, sizeof(line), maps) != NULL) {
+            unsigned long start, end;
+            char perms[5];
+            if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) == 3 && start <= page && page < end) {
+                if (perms[3] == 'p') {
+                    watch.mapping_start = start;
+                    watch.mapping_end = end;
+                    watch.mapping_prot = (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0) |
+                                         (perms[2] == 'x' ? PROT_EXEC : 0);
+                }
+                break;
+            }
+        }
+        fclose(maps);
+        if (page < watch.mapping_start || page >= watch.mapping_end) {
+            return false;
+        }
+    }
+    *prot = watch.mapping_prot;
+    return true;
+}
+
+static struct WatchedPage *gfx_write_watch_find(uintptr_t page, bool insert) {
+    uint32_t i = (uint32_t)(page / watch.page_size * 0x9e3779b1U) & (WATCHED_PAGES - 1);
+    for (uint32_t probes = 0; probes < WATCHED_PAGES; probes++) {
+        struct WatchedPage *p = &watch.pages[i];
+        if (p->page == page) {
+            return p;
+        }
+        if (p->page == 0) {
+            // Keep some free slots, so that lookups of unwatched pages stay short
+            if (!insert || watch.num_pages >= WATCHED_PAGES * 3 / 4) {
+                return NULL;
+            }
+            watch.num_pages++;
+            p->page = page;
+            return p;
+        }
+        i = (i + 1) & (WATCHED_PAGES - 1);
+    }
+    return NULL;
+}
+
+// Makes all watched pages writable again and forgets them
+static void gfx_write_watch_reset(void) {
+    for (uint32_t i = 0; i < WATCHED_PAGES; i++) {
+        if (watch.pages[i].page != 0 && watch.pages[i].protected && (watch.pages[i].prot & PROT_WRITE)) {
+            mprotect((void *)watch.pages[i].page, watch.page_size, watch.pages[i].prot);
+        }
+    }
+    memset(watch.pages, 0, WATCHED_PAGES * sizeof(struct WatchedPage));
+    watch.num_pages = 0;
+}
+
+static bool gfx_write_watch_in_region(uintptr_t start, uintptr_t end) {
+    for (uint32_t i = 0; i < watch.num_regions; i++) {
+        if (watch.regions[i].start <= start && end <= watch.regions[i].end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void gfx_write_watch_handler(int sig, siginfo_t *info, void *ucontext) {
+    uintptr_t page = (uintptr_t)info->si_addr & ~(watch.page_size - 1);
+    struct WatchedPage *p = gfx_write_watch_find(page, false);
+    if (p != NULL && p->protected && (p->prot & PROT_WRITE)) {
+        // Let the write through when the handler returns
+        mprotect((void *)page, watch.page_size, p->prot);
+        p->protected = false;
+        p->written_generation = ++watch.generation;
+        return;
+    }
+    if (watch.old_action.sa_flags & SA_SIGINFO) {
+        watch.old_action.sa_sigaction(sig, info, ucontext);
+    } else if (watch.old_action.sa_handler == SIG_DFL || watch.old_action.sa_handler == SIG_IGN) {
+        // Fault again without the handler, to crash as usual
+        signal(SIGSEGV, SIG_DFL);
+    } else {
+        watch.old_action.sa_handler(sig);
+    }
+}
+
+bool gfx_write_watch_start(void) {
+    if (watch.started) {
+        return true;
+    }
+    watch.page_size = sysconf(_SC_PAGESIZE);
+    if (watch.pages == NULL) {
+        void *pages = mmap(NULL, WATCHED_PAGES * sizeof(struct WatchedPage), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pages == MAP_FAILED) {
+            return false;
+        }
+        watch.pages = pages;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = gfx_write_watch_handler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &watch.old_action) != 0) {
+        return false;
+    }
+    watch.started = true;
+    return true;
+}
+
+void gfx_write_watch_stop(void) {
+    if (!watch.started) {
+        return;
+    }
+    gfx_write_watch_reset();
+    watch.mapping_start = 0;
+    watch.mapping_end = 0;
+    sigaction(SIGSEGV, &watch.old_action, NULL);
+    watch.started = false;
+}
+
+bool gfx_write_watch_add_region(const void *addr, size_t size) {
+    if (watch.num_regions == WATCHED_REGIONS || size == 0) {
+        return false;
+    }
+    watch.regions[watch.num_regions].start = (uintptr_t)addr;
+    watch.regions[watch.num_regions].end = (uintptr_t)addr + size;
+    watch.num_regions++;
+    return true;
+}
+
+void gfx_write_watch_clear_regions(void) {
+    if (watch.started) {
+        gfx_write_watch_reset();
+    }
+    watch.num_regions = 0;
+}
+
+uint32_t gfx_write_watch_stamp(void) {
+    return watch.generation;
+}
+
+bool gfx_write_watch_protect(const void *addr, size_t size) {
+    if (!watch.started || size == 0 || !gfx_write_watch_in_region((uintptr_t)addr, (uintptr_t)addr + size)) {
+        return false;
+    }
+    uintptr_t first = (uintptr_t)addr & ~(watch.page_size - 1);
+    uintptr_t last = ((uintptr_t)addr + size - 1) & ~(watch.page_size - 1);
+    bool reset = false;
+    for (uintptr_t page = first; page <= last; page += watch.page_size) {
+        struct WatchedPage *p = gfx_write_watch_find(page, false);
+        if (p == NULL) {
+            int prot;
+            if (!gfx_write_watch_mapping_prot(page, &prot)) {
+                return false;
+            }
+            if ((p = gfx_write_watch_find(page, true)) == NULL) {
+                if (reset) {
+                    return false;
+                }
+                // The table is full. Start over, which reports all memory
+                // watched before as written once.
+                gfx_write_watch_reset();
+                reset = true;
+                page = first - watch.page_size;
+                continue;
+            }
+            p->prot = prot;
+        }
+        if (!p->protected) {
+            // Pages that aren't writable, such as constant data, are watched as they are
+            if ((p->prot & PROT_WRITE) && mprotect((void *)page, watch.page_size, p->prot & ~PROT_WRITE) != 0) {
+                return false;
+            }
+            p->protected = true;
+        }
+    }
+    return true;
+}
+
+bool gfx_write_watch_written(const void *addr, size_t size, uint32_t stamp) {
+    if (!watch.started || size == 0) {
+        return true;
+    }
+    uintptr_t first = (uintptr_t)addr & ~(watch.page_size - 1);
+    uintptr_t last = ((uintptr_t)addr + size - 1) & ~(watch.page_size - 1);
+    for (uintptr_t page = first; page <= last; page += watch.page_size) {
+        struct WatchedPage *p = gfx_write_watch_find(page, false);
+        // Writes to unprotected pages go unnoticed
+        if (p == NULL || !p->protected || p->written_generation > stamp) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#else
+
+bool gfx_write_watch_start(void) {
+    return false;
+}
+
+void gfx_write_watch_stop(void) {
+}
+
+bool gfx_write_watch_add_region(const void *addr, size_t size) {
+    return false;
+}
+
+void gfx_write_watch_clear_regions(void) {
+}
+
+uint32_t gfx_write_watch_stamp(void) {
+    return 0;
+}
+
+bool gfx_write_watch_protect(const void *addr, size_t size) {
+    return false;
+}
+
+bool gfx_write_watch_written(const void *addr, size_t size, uint32_t stamp) {
+    return true;
+}
+
+#endif
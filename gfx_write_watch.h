@@ -0,0 +1,52 @@
+#ifndef GFX_WRITE_WATCH_H
+#define GFX_WRITE_WATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Detects writes to memory by write protecting its pages. The first write to a
+// protected page raises SIGSEGV, which is caught to record the write and make
+// the page writable again, so each page costs at most one fault until it is
+// protected again. Only available on Linux; elsewhere gfx_write_watch_start
+// fails.
+//
+// Only memory inside regions registered with gfx_write_watch_add_region is
+// watched. It must be ordinary read/write data that is written by the CPU:
+// writes by system calls (e.g. read into a protected buffer) fail with EFAULT
+// instead of being recorded. Other data sharing a page with watched memory
+// stays writable, at the cost of one fault per page. Only pages of private
+// mappings are watched, and they get their original protection back. Pages
+// that aren't writable are watched without being protected. When too many
+// pages are watched, all of them are released and reported written once.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Installs the SIGSEGV handler. Faults outside watched pages are passed on to
+// the previously installed handler.
+bool gfx_write_watch_start(void);
+// Makes all watched pages writable again and removes the handler
+void gfx_write_watch_stop(void);
+
+// Allows watching the range, e.g. the game's RDRAM. Returns false if too many
+// regions were added.
+bool gfx_write_watch_add_region(const void *addr, size_t size);
+// Releases all watched pages and forgets the regions
+void gfx_write_watch_clear_regions(void);
+
+// Current write generation, advanced by every recorded write. Take it before
+// protecting memory and pass it to gfx_write_watch_written later.
+uint32_t gfx_write_watch_stamp(void);
+// Write protects the pages covering the range. Returns false if they can't
+// all be watched, in which case gfx_write_watch_written reports them written.
+bool gfx_write_watch_protect(const void *addr, size_t size);
+// Whether the range may have been written since the stamp was taken
+bool gfx_write_watch_written(const void *addr, size_t size, uint32_t stamp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif